@@ -4,12 +4,14 @@
  * Template for a networked ASCII "Battle Game" client in C.
  *
  * 1. Connect to the server via TCP.
- * 2. Continuously read user input (e.g. MOVE, ATTACK, QUIT).
- * 3. Send commands to the server.
- * 4. Spawn a thread to receive and display the updated game state from the server.
+ * 2. Read user input (e.g. MOVE, ATTACK, QUIT) and send it to the server.
+ * 3. Receive and display the updated game state from the server, in the same
+ *    poll() loop. On a terminal the board is drawn in place, only changed
+ *    cells are redrawn, and our own MOVE is shown before the server confirms
+ *    it; otherwise the server's output is printed as it arrives.
  *
  * Compile:
- *   gcc client.c -o client -pthread
+ *   gcc client.c -o client
  *
  * Usage:
  *   ./client <SERVER_IP> <PORT>
@@ -18,8 +20,13 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
 #include <unistd.h>
-#include <pthread.h>
+#include <poll.h>
+#include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netdb.h>
@@ -27,42 +34,739 @@
 #include <arpa/inet.h>
 
 #define BUFFER_SIZE 1024
+#define RECV_BUFFER_SIZE 65536 // longest line the receiver splits out; a 4096-wide grid row fits
+#define MAX_FPS 60             // most board redraws per second; frames in between are coalesced
+#define MIN_CONSOLE_ROWS 6     // terminal rows kept below the board for messages and typing
+#define CURSOR_GAP 6           // unchanged cells reprinted rather than jumped over with a cursor move
+#define PROMPT "Enter command (MOVE/ATTACK/QUIT): "
 
-/* Global server socket used by both main thread and receiver thread. */
+/* Global server socket */
 int g_serverSocket = -1;
 
+/* 1 when stdout is a terminal: the board is then drawn in place at the top of
+ * the screen and only the rest scrolls. Otherwise everything the server sends
+ * is printed as it comes. */
+int g_renderBoard;
+
+typedef struct
+{
+    int active, x, y, hp;
+} PlayerInfo;
+
+/* The game as the server last showed it. Grid rows are parsed into `incoming`
+ * and swapped into `cells` once the frame's grid is complete, so a frame is
+ * never drawn half-received. */
+typedef struct
+{
+    char *cells, *incoming;
+    size_t cellsCap, incomingCap;
+    int rows, cols;
+    int incomingRows, incomingCols;
+    PlayerInfo *players;
+    int playerCap;
+    int infoPlayer; // player the ACTIVE PLAYER INFO lines being read are about
+    int me;         // our player index, -1 until a turn notice names us
+    char turn[64];  // whose turn it is, for the status line
+    int dirty;      // changed since it was last drawn
+} Board;
+
+/* What the terminal shows right now, so a redraw only sends what changed */
+typedef struct
+{
+    int termRows, termCols;
+    int viewRows, viewCols;   // board cells that fit on screen
+    int originRow, originCol; // board cell shown top-left
+    char *shown;              // viewRows * viewCols
+    char status[256];
+    int valid; // 0 forces a full redraw
+} Screen;
+
+enum
+{
+    PARSE_TEXT,
+    PARSE_GRID_START, // after "STATE:", before the blank line
+    PARSE_GRID,
+    PARSE_INFO_HEADER, // after the grid, before "ACTIVE PLAYER INFO"
+    PARSE_INFO
+};
+
+Board g_board = {.me = -1};
+Screen g_screen;
+int g_parseState = PARSE_TEXT;
+
+/* Terminal output is gathered here and written in one go */
+char *g_out;
+size_t g_outLen, g_outCap;
+
+long long nowMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void emitBytes(const char *data, size_t len)
+{
+    if (g_outLen + len > g_outCap)
+    {
+        size_t cap = g_outCap ? g_outCap : 4096;
+        while (cap < g_outLen + len)
+        {
+            cap *= 2;
+        }
+        char *grown = realloc(g_out, cap);
+        if (grown == NULL)
+        {
+            return;
+        }
+        g_out = grown;
+        g_outCap = cap;
+    }
+    memcpy(g_out + g_outLen, data, len);
+    g_outLen += len;
+}
+
+void emit(const char *format, ...)
+{
+    char text[512];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(text, sizeof(text), format, args);
+    va_end(args);
+    if (len > 0)
+    {
+        emitBytes(text, len < (int)sizeof(text) ? (size_t)len : sizeof(text) - 1);
+    }
+}
+
+// Write out everything emitted so far, in one piece
+void flushEmitted(void)
+{
+    size_t off = 0;
+    while (off < g_outLen)
+    {
+        ssize_t written = write(STDOUT_FILENO, g_out + off, g_outLen - off);
+        if (written <= 0)
+        {
+            break;
+        }
+        off += written;
+    }
+    g_outLen = 0;
+}
+
+// Give the whole terminal back as a normal scrolling one
+void resetTerminal(void)
+{
+    if (g_renderBoard && g_screen.valid)
+    {
+        emit("\033[r\033[%d;1H\n", g_screen.termRows);
+        flushEmitted();
+    }
+}
+
+// A message that is not part of the board goes to the scrolling part of the
+// screen below it
+void printMessage(const char *line)
+{
+    printf("\n%s", line);
+    fflush(stdout);
+}
+
 /*---------------------------------------------------------------------------*
- * Thread to continuously receive updates (ASCII grid) from the server
+ * Parsing. The server's output is split into lines and fed through a small
+ * state machine that fills in g_board from STATE frames:
+ *
+ *   STATE:
+ *   <blank>
+ *   <one line per grid row>
+ *   <blank>
+ *   ACTIVE PLAYER INFO (IF EXISTS)
+ *   Player <i> / Player position: (<x>, <y>) / Player health points <hp>
+ *
+ * Turn notices update the status line; anything else is printed as before.
  *---------------------------------------------------------------------------*/
-void *receiverThread(void *arg)
+
+// "A".."Z" or a slot number, as the server names players
+int playerIndexFromName(const char *name)
 {
-    (void)arg; // unused
+    if (name[0] >= 'A' && name[0] <= 'Z' && (name[1] == '\0' || name[1] == '\'' || name[1] == ' '))
+    {
+        return name[0] - 'A';
+    }
+    return atoi(name);
+}
 
-    char buffer[BUFFER_SIZE];
+PlayerInfo *boardPlayer(int index)
+{
+    if (index < 0)
+    {
+        return NULL;
+    }
+    if (index >= g_board.playerCap)
+    {
+        int cap = g_board.playerCap ? g_board.playerCap : 4;
+        while (cap <= index)
+        {
+            cap *= 2;
+        }
+        PlayerInfo *grown = realloc(g_board.players, cap * sizeof(PlayerInfo));
+        if (grown == NULL)
+        {
+            return NULL;
+        }
+        memset(grown + g_board.playerCap, 0, (cap - g_board.playerCap) * sizeof(PlayerInfo));
+        g_board.players = grown;
+        g_board.playerCap = cap;
+    }
+    return &g_board.players[index];
+}
 
-    while (1)
+void addGridRow(const char *line, size_t len)
+{
+    if (g_board.incomingRows == 0)
+    {
+        g_board.incomingCols = (int)len;
+    }
+    size_t cols = g_board.incomingCols;
+    size_t needed = (g_board.incomingRows + 1) * cols;
+    if (needed > g_board.incomingCap)
     {
-        memset(buffer, 0, sizeof(buffer));
-        // TODO: recv from g_serverSocket
-        ssize_t bytesRead = recv(g_serverSocket, buffer, BUFFER_SIZE, 0);
-        if (bytesRead <= 0)
+        size_t cap = g_board.incomingCap ? g_board.incomingCap : 1024;
+        while (cap < needed)
         {
-            printf("Disconnected from server.\n");
-            break;
+            cap *= 2;
         }
+        char *grown = realloc(g_board.incoming, cap);
+        if (grown == NULL)
+        {
+            return;
+        }
+        g_board.incoming = grown;
+        g_board.incomingCap = cap;
+    }
 
+    // Rows are all the same width; pad or cut one that is not
+    char *row = g_board.incoming + g_board.incomingRows * cols;
+    memset(row, ' ', cols);
+    memcpy(row, line, len < cols ? len : cols);
+    g_board.incomingRows++;
+}
+
+// The grid of a frame is complete: make it the one that gets drawn
+void commitGrid(void)
+{
+    char *cells = g_board.cells;
+    size_t cellsCap = g_board.cellsCap;
+    g_board.cells = g_board.incoming;
+    g_board.cellsCap = g_board.incomingCap;
+    g_board.rows = g_board.incomingRows;
+    g_board.cols = g_board.incomingCols;
+    g_board.incoming = cells;
+    g_board.incomingCap = cellsCap;
+    g_board.incomingRows = 0;
+    g_board.dirty = 1;
+}
+
+/*---------------------------------------------------------------------------*
+ * Move prediction. A MOVE sent on our turn is shown at once instead of a round
+ * trip later. The next STATE with our position settles it: if it has us where
+ * we predicted, or still where we were (the server has not got to the move
+ * yet), the prediction stands; anywhere else, the server wins. A prediction
+ * still open when the turn moves on, or that the server refused, is dropped.
+ *---------------------------------------------------------------------------*/
+int g_predicting;           // a MOVE is shown that the server has not confirmed
+int g_predictX, g_predictY; // where it shows us
+int g_authX, g_authY;       // where the last STATE had us
+
+// Draw ourselves at x, y in the local grid, clearing the cell we were shown in
+void showOwnPosition(int x, int y)
+{
+    PlayerInfo *me = boardPlayer(g_board.me);
+    if (me == NULL || g_board.cells == NULL)
+    {
+        return;
+    }
+
+    char glyph = g_board.me < 26 ? 'A' + g_board.me : '@';
+    if (me->x >= 0 && me->x < g_board.rows && me->y >= 0 && me->y < g_board.cols &&
+        g_board.cells[me->x * g_board.cols + me->y] == glyph)
+    {
+        g_board.cells[me->x * g_board.cols + me->y] = '.';
+    }
+    if (x >= 0 && x < g_board.rows && y >= 0 && y < g_board.cols)
+    {
+        g_board.cells[x * g_board.cols + y] = glyph;
+    }
+    me->x = x;
+    me->y = y;
+    g_board.dirty = 1;
+}
+
+void predictMove(const char *command)
+{
+    PlayerInfo *me = boardPlayer(g_board.me);
+    if (strncmp(command, "MOVE", 4) != 0 || me == NULL || !me->active || g_predicting ||
+        strcmp(g_board.turn, "Your turn") != 0 || g_board.cells == NULL)
+    {
+        return;
+    }
+
+    // Same rules the server applies: one step, on the board, not into an obstacle
+    int x = me->x, y = me->y;
+    if (strstr(command, "UP"))
+    {
+        x--;
+    }
+    else if (strstr(command, "DOWN"))
+    {
+        x++;
+    }
+    else if (strstr(command, "LEFT"))
+    {
+        y--;
+    }
+    else if (strstr(command, "RIGHT"))
+    {
+        y++;
+    }
+    if (x < 0 || x >= g_board.rows || y < 0 || y >= g_board.cols || (x == me->x && y == me->y) ||
+        g_board.cells[x * g_board.cols + y] == '#')
+    {
+        return;
+    }
+
+    g_authX = me->x;
+    g_authY = me->y;
+    g_predicting = 1;
+    g_predictX = x;
+    g_predictY = y;
+    showOwnPosition(x, y);
+}
+
+// A STATE has just given our position as x, y
+void settlePrediction(int x, int y)
+{
+    int wasX = g_authX, wasY = g_authY;
+    g_authX = x;
+    g_authY = y;
+    if (!g_predicting)
+    {
+        return;
+    }
+
+    if (x == g_predictX && y == g_predictY)
+    {
+        g_predicting = 0; // confirmed
+    }
+    else if (x == wasX && y == wasY)
+    {
+        showOwnPosition(g_predictX, g_predictY); // not applied yet, keep showing it
+    }
+    else
+    {
+        g_predicting = 0; // the server put us somewhere else
+    }
+}
+
+void dropPrediction(void)
+{
+    if (g_predicting)
+    {
+        g_predicting = 0;
+        showOwnPosition(g_authX, g_authY);
+    }
+}
+
+void handleTextLine(const char *line)
+{
+    if (strcmp(line, "STATE:") == 0)
+    {
+        g_parseState = PARSE_GRID_START;
+        g_board.incomingRows = 0;
+        return;
+    }
+    if (line[0] == '\0')
+    {
+        return;
+    }
+
+    if (strncmp(line, "It's your turn, Player ", 23) == 0)
+    {
+        dropPrediction();
+        g_board.me = playerIndexFromName(line + 23);
+        snprintf(g_board.turn, sizeof(g_board.turn), "Your turn");
+    }
+    else if (strncmp(line, "It's Player ", 12) == 0)
+    {
+        dropPrediction();
+        snprintf(g_board.turn, sizeof(g_board.turn), "%s", line + 5);
+    }
+    else
+    {
+        if (strncmp(line, "Welcome back, Player ", 21) == 0)
+        {
+            g_board.me = playerIndexFromName(line + 21);
+        }
+        else if (strncmp(line, "Real-time mode", 14) == 0)
+        {
+            snprintf(g_board.turn, sizeof(g_board.turn), "Real time");
+        }
+        else if (strncmp(line, "Sorry", 5) == 0 || strcmp(line, "You have died!") == 0)
+        {
+            dropPrediction();
+        }
+        printMessage(line);
+        return;
+    }
+    g_board.dirty = 1;
+}
+
+void handleServerLine(const char *line, size_t len)
+{
+    switch (g_parseState)
+    {
+    case PARSE_GRID_START:
+        if (len == 0)
+        {
+            g_parseState = PARSE_GRID;
+            return;
+        }
+        break;
+
+    case PARSE_GRID:
+        if (len == 0)
+        {
+            commitGrid();
+            g_parseState = PARSE_INFO_HEADER;
+        }
+        else
+        {
+            addGridRow(line, len);
+        }
+        return;
+
+    case PARSE_INFO_HEADER:
+        if (strncmp(line, "ACTIVE PLAYER INFO", 18) == 0)
+        {
+            for (int i = 0; i < g_board.playerCap; i++)
+            {
+                g_board.players[i].active = 0;
+            }
+            g_board.infoPlayer = -1;
+            g_parseState = PARSE_INFO;
+            return;
+        }
+        break;
+
+    case PARSE_INFO:
+    {
+        int index, x, y, hp, end = 0;
+        PlayerInfo *player = boardPlayer(g_board.infoPlayer);
+        if (sscanf(line, "Player %d%n", &index, &end) == 1 && (size_t)end == len)
+        {
+            g_board.infoPlayer = index;
+            if ((player = boardPlayer(index)) != NULL)
+            {
+                player->active = 1;
+            }
+            return;
+        }
+        if (sscanf(line, "Player position: (%d, %d)", &x, &y) == 2 && player != NULL)
+        {
+            player->x = x;
+            player->y = y;
+            g_board.dirty = 1;
+            if (g_board.infoPlayer == g_board.me)
+            {
+                settlePrediction(x, y);
+            }
+            return;
+        }
+        if (sscanf(line, "Player health points %d", &hp) == 1 && player != NULL)
+        {
+            player->hp = hp;
+            g_board.dirty = 1;
+            return;
+        }
+        break;
+    }
+    }
+
+    g_parseState = PARSE_TEXT;
+    handleTextLine(line);
+}
+
+// Split what arrived into lines; a partial last line waits for the rest
+void feedServerBytes(char *buffer, size_t *bufLen)
+{
+    char *start = buffer;
+    char *end = buffer + *bufLen;
+    char *newline;
+    while ((newline = memchr(start, '\n', end - start)) != NULL)
+    {
+        size_t len = newline - start;
+        if (len > 0 && start[len - 1] == '\r')
+        {
+            len--;
+        }
+        start[len] = '\0';
+        handleServerLine(start, len);
+        start = newline + 1;
+    }
+
+    *bufLen = end - start;
+    if (*bufLen == RECV_BUFFER_SIZE)
+    {
+        // A line longer than the buffer: take what we have as the line
+        buffer[RECV_BUFFER_SIZE - 1] = '\0';
+        handleServerLine(buffer, RECV_BUFFER_SIZE - 1);
+        *bufLen = 0;
+    }
+    else
+    {
+        memmove(buffer, start, *bufLen);
+    }
+}
+
+/*---------------------------------------------------------------------------*
+ * Drawing. The top line is the status line and the board sits below it; both
+ * are drawn with cursor addressing and never scroll. The rest of the terminal
+ * is a scroll region for messages and the command prompt. A redraw compares
+ * every visible cell with what the terminal already shows and only sends runs
+ * that changed.
+ *---------------------------------------------------------------------------*/
+
+// Keep our own player on screen when the board is bigger than the terminal,
+// moving the view only once they get near its edge
+int viewOrigin(int origin, int pos, int view, int size)
+{
+    int margin = view / 4;
+    if (pos < origin + margin || pos >= origin + view - margin)
+    {
+        origin = pos - view / 2;
+    }
+    if (origin > size - view)
+    {
+        origin = size - view;
+    }
+    return origin < 0 ? 0 : origin;
+}
+
+void drawScreen(void)
+{
+    struct winsize ws;
+    int termRows = 24, termCols = 80;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_row > 0 && ws.ws_col > 0)
+    {
+        termRows = ws.ws_row;
+        termCols = ws.ws_col;
+    }
+
+    int viewRows = g_board.rows;
+    if (viewRows > termRows - MIN_CONSOLE_ROWS - 1)
+    {
+        viewRows = termRows - MIN_CONSOLE_ROWS - 1;
+    }
+    viewRows = viewRows < 0 ? 0 : viewRows;
+    int viewCols = g_board.cols < termCols ? g_board.cols : termCols;
+
+    if (termRows != g_screen.termRows || termCols != g_screen.termCols ||
+        viewRows != g_screen.viewRows || viewCols != g_screen.viewCols)
+    {
+        char *shown = realloc(g_screen.shown, (size_t)viewRows * viewCols + 1);
+        if (shown == NULL)
+        {
+            return;
+        }
+        g_screen.shown = shown;
+        g_screen.termRows = termRows;
+        g_screen.termCols = termCols;
+        g_screen.viewRows = viewRows;
+        g_screen.viewCols = viewCols;
+        g_screen.valid = 0;
+    }
+
+    PlayerInfo *me = g_board.me >= 0 && g_board.me < g_board.playerCap ? &g_board.players[g_board.me] : NULL;
+    if (me != NULL && me->active)
+    {
+        g_screen.originRow = viewOrigin(g_screen.originRow, me->x, viewRows, g_board.rows);
+        g_screen.originCol = viewOrigin(g_screen.originCol, me->y, viewCols, g_board.cols);
+    }
+    else
+    {
+        g_screen.originRow = g_screen.originRow > g_board.rows - viewRows ? 0 : g_screen.originRow;
+        g_screen.originCol = g_screen.originCol > g_board.cols - viewCols ? 0 : g_screen.originCol;
+    }
+
+    if (!g_screen.valid)
+    {
+        // New layout: clear, and make everything below the board scroll on its
+        // own. Clearing took the prompt with it, so put it back.
+        emit("\033[r\033[2J\033[%d;%dr\033[%d;1H%s", viewRows + 3, termRows, termRows, PROMPT);
+        memset(g_screen.shown, 0, (size_t)viewRows * viewCols);
+        g_screen.status[0] = '\0';
+        g_screen.valid = 1;
+    }
+    size_t start = g_outLen;
+    emit("\0337"); // save the cursor, wherever the user is typing
+
+    for (int r = 0; r < viewRows; r++)
+    {
+        const char *want = g_board.cells + (size_t)(g_screen.originRow + r) * g_board.cols + g_screen.originCol;
+        char *shown = g_screen.shown + (size_t)r * viewCols;
+        int c = 0;
+        while (c < viewCols)
+        {
+            if (want[c] == shown[c])
+            {
+                c++;
+                continue;
+            }
+            int runEnd = c + 1;
+            for (int k = runEnd; k < viewCols && k - runEnd < CURSOR_GAP; k++)
+            {
+                if (want[k] != shown[k])
+                {
+                    runEnd = k + 1;
+                }
+            }
+            emit("\033[%d;%dH", r + 2, c + 1);
+            emitBytes(want + c, runEnd - c);
+            memcpy(shown + c, want + c, runEnd - c);
+            c = runEnd;
+        }
+    }
+
+    char status[sizeof(g_screen.status)];
+    if (me != NULL)
+    {
+        char name[16];
+        snprintf(name, sizeof(name), g_board.me < 26 ? "%c" : "%d", g_board.me < 26 ? 'A' + g_board.me : g_board.me);
+        snprintf(status, sizeof(status), "Player %s | HP %d | %s", name, me->active ? me->hp : 0, g_board.turn);
+    }
+    else
+    {
+        snprintf(status, sizeof(status), "%s", g_board.turn[0] ? g_board.turn : "Waiting for your turn");
+    }
+    if ((int)strlen(status) > termCols)
+    {
+        status[termCols] = '\0';
+    }
+    if (strcmp(status, g_screen.status) != 0)
+    {
+        emit("\033[1;1H%s\033[K", status);
+        memcpy(g_screen.status, status, sizeof(status));
+    }
+
+    if (g_outLen == start + 2)
+    {
+        g_outLen = start; // nothing on screen changed
+    }
+    else
+    {
+        emit("\0338"); // back to where the user was typing
+    }
+    flushEmitted();
+    g_board.dirty = 0;
+}
+
+/*---------------------------------------------------------------------------*
+ * Server and keyboard. One poll() loop waits on both. Frames that come in
+ * faster than MAX_FPS are parsed as they arrive but only the latest one is
+ * drawn.
+ *---------------------------------------------------------------------------*/
+
+// Read what the server sent. Returns 0 once it has hung up.
+int readServer(char *buffer, size_t *bufLen)
+{
+    ssize_t bytesRead = recv(g_serverSocket, buffer + *bufLen, RECV_BUFFER_SIZE - *bufLen, 0);
+    if (bytesRead <= 0)
+    {
+        return 0;
+    }
+
+    if (!g_renderBoard)
+    {
         // Print the game state or server message
-        printf("\n%s\n", buffer);
+        printf("\n%.*s\n", (int)bytesRead, buffer);
         fflush(stdout);
+        return 1;
     }
+    *bufLen += bytesRead;
+    feedServerBytes(buffer, bufLen);
+    return 1;
+}
 
-    close(g_serverSocket);
-    exit(0);
-    return NULL;
+// Send one typed line. Returns 0 after QUIT.
+int sendCommand(const char *text, size_t len)
+{
+    // Commands are newline-terminated so the server can tell them apart
+    char command[BUFFER_SIZE + 1];
+    memcpy(command, text, len);
+    command[len++] = '\n';
+    command[len] = '\0';
+    send(g_serverSocket, command, len, 0);
+
+    if (strncmp(command, "QUIT", 4) == 0)
+    {
+        return 0;
+    }
+    if (g_renderBoard)
+    {
+        predictMove(command);
+    }
+    printf("\n" PROMPT);
+    fflush(stdout);
+    return 1;
+}
+
+// Send every complete line typed so far. Returns 0 once the user is done.
+int readKeyboard(char *input, size_t *inLen)
+{
+    ssize_t n = read(STDIN_FILENO, input + *inLen, BUFFER_SIZE - 1 - *inLen);
+    if (n <= 0)
+    {
+        // Possibly user pressed Ctrl+D; a last line without a newline still goes
+        if (*inLen > 0)
+        {
+            sendCommand(input, *inLen);
+        }
+        printf("Exiting client.\n");
+        return 0;
+    }
+
+    char *start = input;
+    char *end = input + *inLen + n;
+    char *newline;
+    while ((newline = memchr(start, '\n', end - start)) != NULL)
+    {
+        if (!sendCommand(start, newline - start))
+        {
+            return 0;
+        }
+        start = newline + 1;
+    }
+
+    // An over-long line goes out in pieces, as fgets would have read it
+    *inLen = end - start;
+    if (*inLen == BUFFER_SIZE - 1)
+    {
+        *inLen = 0;
+        return sendCommand(input, BUFFER_SIZE - 1);
+    }
+    memmove(input, start, *inLen);
+    return 1;
+}
+
+// Only there so a resize interrupts poll() and the board is laid out again
+void handleResize(int sig)
+{
+    (void)sig;
 }
 
 /*---------------------------------------------------------------------------*
- * main: connect to server, spawn receiver thread, send commands in a loop
+ * main: connect to server, then send commands and show updates in one loop
  *---------------------------------------------------------------------------*/
 int main(int argc, char *argv[])
 {
@@ -104,41 +808,56 @@ int main(int argc, char *argv[])
 
     printf("Connected to server %s:%d\n", serverIP, port);
 
-    // 3. Create a receiver thread
-    pthread_t recvThread;
-    pthread_create(&recvThread, NULL, receiverThread, NULL);
-    pthread_detach(recvThread);
+    g_renderBoard = isatty(STDOUT_FILENO);
+    atexit(resetTerminal);
 
-    // 4. Main loop: read user commands, send to server
+    struct sigaction resize = {.sa_handler = handleResize};
+    sigaction(SIGWINCH, &resize, NULL);
+
+    // 3. Main loop: send the user's commands, show what the server sends
+    static char buffer[RECV_BUFFER_SIZE];
+    char input[BUFFER_SIZE];
+    size_t bufLen = 0, inLen = 0;
+    long long lastDrawMs = 0;
+    struct pollfd fds[2] = {{.fd = STDIN_FILENO, .events = POLLIN}, {.fd = g_serverSocket, .events = POLLIN}};
+
+    printf("\n" PROMPT);
+    fflush(stdout);
     while (1)
     {
-        char command[BUFFER_SIZE];
-        memset(command, 0, sizeof(command));
+        // With a redraw pending, wait no longer than until it is due
+        int timeout = -1;
+        if (g_board.dirty)
+        {
+            long long wait = lastDrawMs + 1000 / MAX_FPS - nowMs();
+            timeout = wait > 0 ? (int)wait : 0;
+        }
 
-        printf("\nEnter command (MOVE/ATTACK/QUIT): ");
-        fflush(stdout);
+        if (poll(fds, 2, timeout) < 0)
+        {
+            if (errno != EINTR)
+            {
+                perror("poll failed");
+                break;
+            }
+            g_board.dirty = g_renderBoard; // resized
+            continue;
+        }
 
-        if (fgets(command, sizeof(command), stdin) == NULL)
+        if (fds[1].revents && !readServer(buffer, &bufLen))
         {
-            // Possibly user pressed Ctrl+D
-            printf("Exiting client.\n");
+            printMessage("Disconnected from server.\n");
             break;
         }
-
-        // Remove trailing newline
-        size_t len = strlen(command);
-        if (len > 0 && command[len - 1] == '\n')
+        if (fds[0].revents && !readKeyboard(input, &inLen))
         {
-            command[len - 1] = '\0';
+            break;
         }
 
-        // sending
-        send(g_serverSocket, command, strlen(command), 0);
-
-        // If QUIT => break
-        if (strncmp(command, "QUIT", 4) == 0)
+        if (g_board.dirty && nowMs() >= lastDrawMs + 1000 / MAX_FPS)
         {
-            break;
+            drawScreen();
+            lastDrawMs = nowMs();
         }
     }
 
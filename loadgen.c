@@ -0,0 +1,730 @@
+/******************************************************************************
+ * loadgen.c
+ *
+ * Headless load generator and latency benchmark for the "Battle Game" server.
+ *
+ * 1. Open N connections to a server on this machine (loopback only).
+ * 2. Whenever a bot has the turn, send the next command of its script, or a
+ *    random MOVE/ATTACK, as fast as the target rate allows. Against a
+ *    real-time server (-t) a bot sends again as soon as its last command's
+ *    frame arrives; the round trip then includes the wait for the tick.
+ * 3. Time each command until the bot receives the next STATE (or KEY/DELTA)
+ *    frame, or the turn notice if no frame comes first, and reconnect bots
+ *    whose match has ended.
+ * 4. Print p50/p99/p999 round-trip latency and commands/sec.
+ *
+ * Everything runs on one thread driven by epoll, so the generator itself
+ * adds as little noise as possible to the numbers.
+ *
+ * Compile:
+ *   gcc -O2 loadgen.c -o loadgen
+ *
+ * Usage:
+ *   ./loadgen <PORT> [-c CONNECTIONS] [-r RATE] [-d SECONDS] [-t TIMEOUT_MS]
+ *             [-f SCRIPT] [-s SEED] [-D] [-b]
+ ******************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_EVENTS 256
+#define LINE_KEPT 64       // leading bytes of each server line kept for parsing
+#define JOIN_WINDOW 256    // connections waiting to be accepted at once, well under the server's LISTENQ
+#define RAMP_TIMEOUT_SEC 10 // longest we wait for every bot to join before measuring anyway
+#define MAX_SCRIPT_LINES 1024
+
+/* Binary protocol (-b) opcodes, as the server defines them: a command is one
+ * byte, (opcode << 2) | direction, and ACK adds a big-endian version */
+#define OP_MOVE 1
+#define OP_ATTACK 2
+#define OP_QUIT 3
+#define OP_ACK 5
+
+/*---------------------------------------------------------------------------*
+ * Data Structures
+ *---------------------------------------------------------------------------*/
+
+/* One simulated player */
+typedef struct
+{
+  int fd;      // -1 while disconnected
+  int joined;  // 1 once the server has sent anything, i.e. it accepted us
+  int myTurn;  // the server said it is our turn and we have not moved yet
+  int queued;  // 1 while on the ready ring
+  int awaiting; // a command is out and its frame has not arrived yet
+  long long sentNs;
+  int cooldown; // own commands left before our last shuriken has surely landed
+  int scriptPos;
+  uint64_t rng;
+
+  // Server output is split into lines; only the start of each line is kept
+  char line[LINE_KEPT];
+  size_t lineLen;    // full length of the current line, even past LINE_KEPT
+  int gridPhase;     // reading a STATE grid to learn the map size: 1 blank, 2 rows
+  unsigned int version; // delta mode: version of the frame being received
+} Bot;
+
+/* Latencies of the measured commands, in nanoseconds */
+typedef struct
+{
+  long long *ns;
+  size_t count, cap;
+} Samples;
+
+Bot *g_bots;
+int g_botCount = 64;
+int g_port;
+double g_rate = 0; // commands per second over all bots, 0 = unlimited
+int g_durationSec = 10;
+int g_timeoutMs = 1000;
+int g_deltaMode = 0;
+int g_binaryMode = 0;
+int g_realtime = 0; // the server said it runs in real-time mode, so there are no turns
+char *g_script[MAX_SCRIPT_LINES];
+int g_scriptLines = 0;
+
+int g_epollFd;
+int g_pendingJoins; // connected bots the server has not accepted yet
+int g_idleBots;     // bots with no connection
+int g_rows, g_cols; // map size, learned from the first frame
+
+// Bots that have the turn and may send, in the order they got it
+int *g_ready;
+int g_readyHead, g_readyCount;
+
+// Measurement window and counters
+long long g_measureStartNs = -1;
+Samples g_samples;
+unsigned long g_timeouts, g_reconnects, g_rejected, g_queued;
+
+/*---------------------------------------------------------------------------*
+ * Helpers
+ *---------------------------------------------------------------------------*/
+long long nowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+uint64_t nextRandom(Bot *bot)
+{
+  // xorshift64
+  bot->rng ^= bot->rng << 13;
+  bot->rng ^= bot->rng >> 7;
+  bot->rng ^= bot->rng << 17;
+  return bot->rng;
+}
+
+void addSample(Samples *samples, long long ns)
+{
+  if (samples->count == samples->cap)
+  {
+    samples->cap = samples->cap ? samples->cap * 2 : 1 << 16;
+    samples->ns = realloc(samples->ns, samples->cap * sizeof(long long));
+    if (samples->ns == NULL)
+    {
+      perror("realloc failed");
+      exit(EXIT_FAILURE);
+    }
+  }
+  samples->ns[samples->count++] = ns;
+}
+
+int compareNs(const void *a, const void *b)
+{
+  long long x = *(const long long *)a, y = *(const long long *)b;
+  return (x > y) - (x < y);
+}
+
+// Value at quantile q of the sorted samples (nearest rank)
+double percentileUs(const Samples *samples, double q)
+{
+  if (samples->count == 0)
+  {
+    return 0;
+  }
+  size_t rank = (size_t)(q * samples->count + 0.999999);
+  if (rank < 1)
+  {
+    rank = 1;
+  }
+  if (rank > samples->count)
+  {
+    rank = samples->count;
+  }
+  return samples->ns[rank - 1] / 1000.0;
+}
+
+void raiseFileLimit()
+{
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+  {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+}
+
+/*---------------------------------------------------------------------------*
+ * Connections
+ *---------------------------------------------------------------------------*/
+void markReady(int index)
+{
+  Bot *bot = &g_bots[index];
+  if (bot->queued)
+  {
+    return;
+  }
+  bot->queued = 1;
+  g_ready[(g_readyHead + g_readyCount) % g_botCount] = index;
+  g_readyCount++;
+}
+
+void connectBot(int index)
+{
+  Bot *bot = &g_bots[index];
+  bot->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (bot->fd < 0)
+  {
+    perror("socket failed");
+    exit(EXIT_FAILURE);
+  }
+
+  // Commands are tiny; without this Nagle would hold them back
+  int one = 1;
+  setsockopt(bot->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(g_port);
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  if (connect(bot->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS)
+  {
+    perror("connect failed");
+    exit(EXIT_FAILURE);
+  }
+
+  bot->joined = 0;
+  g_pendingJoins++;
+  g_idleBots--;
+  bot->myTurn = 0;
+  bot->awaiting = 0;
+  bot->cooldown = 0;
+  bot->lineLen = 0;
+  bot->gridPhase = 0;
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+  ev.data.u32 = index;
+  epoll_ctl(g_epollFd, EPOLL_CTL_ADD, bot->fd, &ev);
+}
+
+// Connect disconnected bots, a window at a time so the server's accept queue
+// never overflows (a dropped SYN costs a one-second retransmit)
+void connectWaitingBots()
+{
+  for (int i = 0; i < g_botCount && g_idleBots > 0 && g_pendingJoins < JOIN_WINDOW; i++)
+  {
+    if (g_bots[i].fd == -1)
+    {
+      connectBot(i);
+    }
+  }
+}
+
+void dropBot(int index)
+{
+  Bot *bot = &g_bots[index];
+  if (!bot->joined)
+  {
+    g_pendingJoins--;
+  }
+  close(bot->fd);
+  bot->fd = -1;
+  g_idleBots++;
+  g_reconnects++;
+}
+
+int sendLine(Bot *bot, const char *text)
+{
+  char buffer[LINE_KEPT + 2];
+  int len = snprintf(buffer, sizeof(buffer), "%s\n", text);
+  return send(bot->fd, buffer, len, MSG_NOSIGNAL) == len ? 0 : -1;
+}
+
+// A game command as its one-byte binary message. Anything else becomes an
+// unknown opcode, which the server treats like an unknown text command.
+int sendBinaryCommand(Bot *bot, const char *cmd)
+{
+  static const char *const dirs[] = {"UP", "DOWN", "LEFT", "RIGHT"};
+  int opcode = 0, dir = 0;
+  if (strncmp(cmd, "MOVE ", 5) == 0)
+  {
+    opcode = OP_MOVE;
+  }
+  else if (strncmp(cmd, "ATTACK ", 7) == 0)
+  {
+    opcode = OP_ATTACK;
+  }
+  else if (strcmp(cmd, "QUIT") == 0)
+  {
+    opcode = OP_QUIT;
+  }
+  for (int i = 0; opcode != 0 && opcode != OP_QUIT && i < 4; i++)
+  {
+    if (strcmp(strchr(cmd, ' ') + 1, dirs[i]) == 0)
+    {
+      dir = i;
+    }
+  }
+
+  unsigned char byte = opcode << 2 | dir;
+  return send(bot->fd, &byte, 1, MSG_NOSIGNAL) == 1 ? 0 : -1;
+}
+
+int sendAck(Bot *bot)
+{
+  if (g_binaryMode)
+  {
+    unsigned char msg[5] = {OP_ACK << 2, bot->version >> 24, bot->version >> 16, bot->version >> 8, bot->version};
+    return send(bot->fd, msg, sizeof(msg), MSG_NOSIGNAL) == sizeof(msg) ? 0 : -1;
+  }
+  char ack[32];
+  snprintf(ack, sizeof(ack), "ACK %u", bot->version);
+  return sendLine(bot, ack);
+}
+
+/*---------------------------------------------------------------------------*
+ * Pick this bot's next command: the next script line, or a random MOVE or
+ * ATTACK. The server silently ignores ATTACK while our shuriken is still in
+ * flight, so random bots only attack once the last one must have landed.
+ *---------------------------------------------------------------------------*/
+const char *nextCommand(Bot *bot)
+{
+  static const char *moves[] = {"MOVE UP", "MOVE DOWN", "MOVE LEFT", "MOVE RIGHT"};
+  static const char *attacks[] = {"ATTACK UP", "ATTACK DOWN", "ATTACK LEFT", "ATTACK RIGHT"};
+
+  if (g_scriptLines > 0)
+  {
+    const char *cmd = g_script[bot->scriptPos];
+    bot->scriptPos = (bot->scriptPos + 1) % g_scriptLines;
+    return cmd;
+  }
+
+  uint64_t r = nextRandom(bot);
+  if (bot->cooldown > 0)
+  {
+    bot->cooldown--;
+    return moves[r & 3];
+  }
+  if ((r >> 2) & 1)
+  {
+    bot->cooldown = g_rows + g_cols > 0 ? g_rows + g_cols : 64;
+    return attacks[r & 3];
+  }
+  return moves[r & 3];
+}
+
+void sendCommand(int index)
+{
+  Bot *bot = &g_bots[index];
+  bot->queued = 0;
+  if (bot->fd == -1 || !bot->myTurn || bot->awaiting)
+  {
+    return;
+  }
+
+  bot->myTurn = 0;
+  bot->awaiting = 1;
+  bot->sentNs = nowNs();
+  const char *cmd = nextCommand(bot);
+  if ((g_binaryMode ? sendBinaryCommand(bot, cmd) : sendLine(bot, cmd)) < 0)
+  {
+    dropBot(index);
+  }
+}
+
+/*---------------------------------------------------------------------------*
+ * Server output
+ *---------------------------------------------------------------------------*/
+void frameArrived(Bot *bot)
+{
+  if (!bot->awaiting)
+  {
+    return; // Someone else's move
+  }
+  long long now = nowNs();
+  if (g_measureStartNs >= 0 && bot->sentNs >= g_measureStartNs)
+  {
+    addSample(&g_samples, now - bot->sentNs);
+  }
+  bot->awaiting = 0;
+  if (g_realtime)
+  {
+    bot->myTurn = 1;
+    markReady(bot - g_bots);
+  }
+}
+
+void handleLine(int index)
+{
+  Bot *bot = &g_bots[index];
+  size_t kept = bot->lineLen < LINE_KEPT ? bot->lineLen : LINE_KEPT - 1;
+  bot->line[kept] = '\0';
+  const char *line = bot->line;
+
+  // Learn the map size from the first text STATE grid anyone sees
+  if (bot->gridPhase == 1)
+  {
+    bot->gridPhase = 2;
+    return;
+  }
+  if (bot->gridPhase == 2)
+  {
+    if (bot->lineLen == 0)
+    {
+      bot->gridPhase = 0;
+    }
+    else if (g_cols == 0 || g_cols == (int)bot->lineLen)
+    {
+      g_cols = bot->lineLen;
+      g_rows++;
+    }
+    return;
+  }
+
+  if (strcmp(line, "STATE:") == 0)
+  {
+    if (g_rows == 0)
+    {
+      bot->gridPhase = 1;
+    }
+    frameArrived(bot);
+  }
+  else if (strncmp(line, "KEY ", 4) == 0)
+  {
+    sscanf(line + 4, "%u %d %d", &bot->version, &g_rows, &g_cols);
+    frameArrived(bot);
+  }
+  else if (strncmp(line, "DELTA ", 6) == 0)
+  {
+    sscanf(line + 6, "%*u %u", &bot->version);
+    frameArrived(bot);
+  }
+  else if (strcmp(line, "END") == 0)
+  {
+    sendAck(bot);
+  }
+  else if (strncmp(line, "It's your turn", 14) == 0)
+  {
+    frameArrived(bot);
+    bot->myTurn = 1;
+    markReady(index);
+  }
+  else if (strncmp(line, "It's Player", 11) == 0)
+  {
+    // A move that changed nothing gets no delta frame, only the turn notice
+    frameArrived(bot);
+  }
+  else if (strncmp(line, "Real-time mode", 14) == 0)
+  {
+    g_realtime = 1;
+    bot->myTurn = 1;
+    markReady(index);
+  }
+  else if (strncmp(line, "Sorry, it's not your turn", 25) == 0)
+  {
+    bot->awaiting = 0;
+  }
+  else if (strncmp(line, "Server full", 11) == 0)
+  {
+    g_rejected++;
+  }
+  else if (strncmp(line, "Queued for a match", 18) == 0)
+  {
+    g_queued++;
+  }
+}
+
+void handleReadable(int index)
+{
+  Bot *bot = &g_bots[index];
+  char buffer[65536];
+
+  while (bot->fd != -1)
+  {
+    ssize_t n = recv(bot->fd, buffer, sizeof(buffer), 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      return;
+    }
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n < 0 && errno == ECONNREFUSED)
+    {
+      fprintf(stderr, "No server listening on port %d\n", g_port);
+      exit(EXIT_FAILURE);
+    }
+    if (n <= 0)
+    {
+      dropBot(index); // Match over, died, or the server is gone
+      return;
+    }
+
+    if (!bot->joined)
+    {
+      bot->joined = 1;
+      g_pendingJoins--;
+      if (g_deltaMode)
+      {
+        sendLine(bot, "DELTA");
+      }
+      if (g_binaryMode)
+      {
+        sendLine(bot, "BINARY");
+      }
+    }
+
+    for (ssize_t i = 0; i < n; i++)
+    {
+      if (buffer[i] == '\n')
+      {
+        handleLine(index);
+        bot->lineLen = 0;
+      }
+      else
+      {
+        if (bot->lineLen < LINE_KEPT - 1)
+        {
+          bot->line[bot->lineLen] = buffer[i];
+        }
+        bot->lineLen++;
+      }
+    }
+  }
+}
+
+// A command the server never answered (e.g. an ATTACK it ignored): the bot
+// still has the turn, so let it try again
+void expireCommands(long long now)
+{
+  for (int i = 0; i < g_botCount; i++)
+  {
+    Bot *bot = &g_bots[i];
+    if (bot->fd != -1 && bot->awaiting && now - bot->sentNs > (long long)g_timeoutMs * 1000000)
+    {
+      bot->awaiting = 0;
+      bot->myTurn = 1;
+      markReady(i);
+      if (g_measureStartNs >= 0)
+      {
+        g_timeouts++;
+      }
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------*
+ * Setup
+ *---------------------------------------------------------------------------*/
+void loadScript(const char *path)
+{
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
+  {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+
+  char line[LINE_KEPT];
+  while (g_scriptLines < MAX_SCRIPT_LINES && fgets(line, sizeof(line), file) != NULL)
+  {
+    line[strcspn(line, "\r\n")] = '\0';
+    if (line[0] != '\0' && line[0] != '#')
+    {
+      g_script[g_scriptLines++] = strdup(line);
+    }
+  }
+  fclose(file);
+
+  if (g_scriptLines == 0)
+  {
+    fprintf(stderr, "%s: no commands\n", path);
+    exit(EXIT_FAILURE);
+  }
+}
+
+void usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s <PORT> [-c CONNECTIONS] [-r RATE] [-d SECONDS] [-t TIMEOUT_MS] [-f SCRIPT] [-s SEED] [-D] [-b]\n", prog);
+  exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned long seed = 1;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:r:d:t:f:s:Db")) != -1)
+  {
+    switch (opt)
+    {
+    case 'c':
+      g_botCount = atoi(optarg);
+      break;
+    case 'r':
+      g_rate = atof(optarg);
+      break;
+    case 'd':
+      g_durationSec = atoi(optarg);
+      break;
+    case 't':
+      g_timeoutMs = atoi(optarg);
+      break;
+    case 'f':
+      loadScript(optarg);
+      break;
+    case 's':
+      seed = strtoul(optarg, NULL, 10);
+      break;
+    case 'D':
+      g_deltaMode = 1;
+      break;
+    case 'b':
+      g_binaryMode = 1;
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1 || g_botCount < 1 || g_durationSec < 1 || g_timeoutMs < 1 || g_rate < 0)
+  {
+    usage(argv[0]);
+  }
+  g_port = atoi(argv[optind]);
+
+  raiseFileLimit();
+
+  g_bots = calloc(g_botCount, sizeof(Bot));
+  g_ready = calloc(g_botCount, sizeof(int));
+  g_epollFd = epoll_create1(0);
+  if (g_bots == NULL || g_ready == NULL || g_epollFd < 0)
+  {
+    perror("setup failed");
+    return 1;
+  }
+  g_idleBots = g_botCount;
+  for (int i = 0; i < g_botCount; i++)
+  {
+    g_bots[i].fd = -1;
+    g_bots[i].rng = (seed + i) * 0x9E3779B97F4A7C15ULL | 1;
+    g_bots[i].scriptPos = g_scriptLines > 0 ? i % g_scriptLines : 0;
+  }
+
+  long long start = nowNs();
+  long long end = -1;
+  long long lastExpire = start;
+  long long lastRefill = start;
+  double tokens = 1;
+  unsigned long joinedOnce = 0;
+
+  while (end < 0 || nowNs() < end)
+  {
+    long long now = nowNs();
+
+    connectWaitingBots();
+
+    // Measure once every bot has joined once (or the ramp took too long)
+    if (g_measureStartNs < 0)
+    {
+      joinedOnce = 0;
+      for (int i = 0; i < g_botCount; i++)
+      {
+        joinedOnce += g_bots[i].fd != -1 && g_bots[i].joined;
+      }
+      if (joinedOnce == (unsigned long)g_botCount || now - start > RAMP_TIMEOUT_SEC * 1000000000LL)
+      {
+        g_measureStartNs = now;
+        end = now + g_durationSec * 1000000000LL;
+        g_reconnects = 0;
+      }
+    }
+
+    // Token bucket: at most g_rate commands per second, in bursts of at most one per bot
+    if (g_rate > 0)
+    {
+      tokens += (now - lastRefill) * g_rate / 1e9;
+      if (tokens > g_botCount)
+      {
+        tokens = g_botCount;
+      }
+    }
+    lastRefill = now;
+    while (g_readyCount > 0 && (g_rate == 0 || tokens >= 1))
+    {
+      int index = g_ready[g_readyHead];
+      g_readyHead = (g_readyHead + 1) % g_botCount;
+      g_readyCount--;
+      if (g_bots[index].myTurn && !g_bots[index].awaiting && g_bots[index].fd != -1)
+      {
+        tokens -= 1;
+      }
+      sendCommand(index);
+    }
+
+    int timeoutMs = 100;
+    if (g_readyCount > 0 && g_rate > 0)
+    {
+      timeoutMs = (int)((1 - tokens) * 1000 / g_rate + 0.999);
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(g_epollFd, events, MAX_EVENTS, timeoutMs < 100 ? timeoutMs : 100);
+    for (int i = 0; i < n; i++)
+    {
+      handleReadable(events[i].data.u32);
+    }
+
+    now = nowNs();
+    if (now - lastExpire > 100000000LL)
+    {
+      expireCommands(now);
+      lastExpire = now;
+    }
+  }
+
+  double seconds = (nowNs() - g_measureStartNs) / 1e9;
+  qsort(g_samples.ns, g_samples.count, sizeof(long long), compareNs);
+
+  char rate[32] = "unlimited";
+  if (g_rate > 0)
+  {
+    snprintf(rate, sizeof(rate), "%.0f/s", g_rate);
+  }
+  printf("loadgen: %d connections, %.1f s, target rate %s, map %dx%d, %s protocol%s%s\n",
+         g_botCount, seconds, rate, g_rows, g_cols, g_deltaMode ? "delta" : "text",
+         g_binaryMode ? ", binary commands" : "", g_realtime ? ", real-time server" : "");
+  printf("commands: %zu (%.1f/s), timeouts %lu, reconnects %lu (%.1f/s), queued %lu, server full %lu\n",
+         g_samples.count, g_samples.count / seconds, g_timeouts, g_reconnects, g_reconnects / seconds, g_queued, g_rejected);
+  printf("round trip (us): p50 %.1f  p99 %.1f  p999 %.1f  max %.1f\n",
+         percentileUs(&g_samples, 0.50), percentileUs(&g_samples, 0.99),
+         percentileUs(&g_samples, 0.999), percentileUs(&g_samples, 1.0));
+  return 0;
+}
@@ -9,748 +9,6945 @@
  * 4. On receiving commands (MOVE, ATTACK, QUIT, etc.), update the game state
  *    and broadcast it to all clients.
  *
+ * All sockets are non-blocking and driven by edge-triggered epoll loops, so
+ * an idle connection costs one small Connection struct instead of a thread.
+ * Each match lives in its own Room, and every room is owned by one worker
+ * thread pinned to a core. Each worker accepts its own players on a listening
+ * socket of its own; the main thread runs the admission queue and spectators.
+ *
  * Compile:
  *   gcc server.c -o server -pthread
  *
  * Usage:
- *   ./server <PORT>
+ *   ./server <PORT> [-w WORKERS] [-r MAX_ROOMS] [-l MAX_LAG_MS] [-m MAPFILE|ROWSxCOLS]
+ *            [-p PLAYERS] [-s SHURIKENS] [-j JOURNAL_DIR] [-S SNAPSHOT_FILE]
+ *            [-M STATS_SOCKET] [-t TICK_RATE] [-v SPECTATOR_PORT] [-U] [-a BOT_DELAY_SEC]
  ******************************************************************************/
 
+#define _GNU_SOURCE // pthread_setaffinity_np, accept4
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/io_uring.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <netdb.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/timerfd.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/un.h>
+#include <time.h>
 #include <unistd.h>
-// #include <arpa/inet.h> // Optional if you want to display IP addresses
 
-#define MAX_CLIENTS 4
+#define MAX_CLIENTS 4 // players per room unless -p says otherwise
+#define MAX_ROOM_PLAYERS 4096 // largest arena -p accepts
+#define MAX_SHURIKENS_PER_PLAYER 8 // most shurikens in flight per player -s accepts
 #define BUFFER_SIZE 1024
-#define LISTENQ 4    // Upto 4 people can wait in the lobby for a next game session
-#define MAXLINE 1000 // For hostname
+#define LISTENQ 4096 // pending connections per listening socket (the kernel caps it at somaxconn)
+#define ACCEPT_BATCH 64 // connections a worker accepts per wakeup before getting back to its rooms
+#define MAX_ARRIVALS 4096 // clients on their way from the workers to the admission queue
+#define MAX_EVENTS 64 // epoll events handled per wakeup
+#define DEFAULT_MAX_ROOMS 256   // matches hosted at once unless -r says otherwise
+#define REPORT_INTERVAL_SEC 10  // how often per-worker match throughput is printed
+#define INBUF_SIZE 256 // per-connection input buffer, longer than any command
+#define DEFAULT_MAX_LAG_MS 5000 // how long a client may stay unwritable before it is dropped
+
+/* Map dimensions are read at startup (see loadMap) */
+#define MAX_MAP_SIZE 4096
+
+/* Match journal (-j): records are buffered per room and written in chunks of
+ * this size by a background thread */
+#define JOURNAL_CHUNK_SIZE 65536
+#define REPLAY_SOCKET -2 // marks a seat filled by journal replay, which has no socket
+
+/* Snapshots (-S): how often every room is saved, and how long a player restored
+ * from one has to come back before their seat is given up */
+#define SNAPSHOT_INTERVAL_SEC 5
+#define REJOIN_WINDOW_MS 30000
+#define HELD_SOCKET -3 // marks a restored seat whose player has not rejoined yet
+
+/* Metrics: histograms have 2^HIST_SUB_BITS buckets per power of two (about 6%
+ * resolution) up to 2^HIST_MAX_EXP. Reading the clock costs more than the rest
+ * of the bookkeeping, so only one command and one turn in every
+ * COMMAND_SAMPLE_RATE are timed. */
+#define HIST_SUB_BITS 4
+#define HIST_MAX_EXP 40
+#define HIST_BUCKETS ((HIST_MAX_EXP - HIST_SUB_BITS + 2) << HIST_SUB_BITS)
+#define COMMAND_SAMPLE_RATE 8
+
+#define MAX_TICK_RATE 1000 // fastest real-time mode -t accepts, in ticks per second
+
+#define MAX_SPECTATORS 4096 // read-only watchers one room takes (-v)
+#define MAX_WAITING 65536   // clients the admission queue holds before turning more away; a power of two
 
-/* Grid dimensions */
-#define GRID_ROWS 5
-#define GRID_COLS 5
+/* io_uring backend (-U), per worker */
+#define RING_ENTRIES 4096  // submission queue slots
+#define RING_BUFS 1024     // receive buffers the kernel picks from; a power of two
+#define RING_BUF_SIZE 2048 // bytes in each
+
+/* Binary protocol: every message starts with one byte, (opcode << 2) | direction,
+ * and the opcode alone fixes the message length (see g_opcodes) */
+#define OPCODE_COUNT 64
+
+/* Delta protocol: changes remembered per room, and how often a client is sent
+ * a full keyframe even if it keeps acknowledging */
+#define DELTA_LOG_SIZE 1024
+#define KEYFRAME_INTERVAL 64
+
+/* Server-side bots (-a): a bot searches a copy of its room that holds itself,
+ * its nearest opponents and the shurikens nearest to it. A round of bot turns
+ * on one room shares BOT_ROUND_BUDGET_NS between its bots, and a worker spends
+ * at most BOT_BATCH_BUDGET_NS on bots between two waits for events. */
+#define BOT_SOCKET -4 // marks a seat played by a server-side bot
+#define BOT_SEATS 4   // the bot and its nearest three opponents
+#define BOT_SHURIKENS 32
+#define BOT_MAX_DEPTH 12 // plies, counting every seat's turn
+#define BOT_TABLE_SIZE (1 << 16) // transposition table entries per worker; a power of two
+#define BOT_ROUND_BUDGET_NS 2000000
+#define BOT_BATCH_BUDGET_NS 2000000
+#define BOT_MAX_CELLS (1 << 20) // ray tables take 8 bytes per cell
 
 /*---------------------------------------------------------------------------*
  * Data Structures
  *---------------------------------------------------------------------------*/
 
+/* A pooled shuriken as clients were last shown it (see ShurikenPool) */
 typedef struct
 {
-  int x, y;        // shuriken pos
-  int dx, dy;      // Direction
-  int active;      // Unactive it it hits a wall
-  int justSpawned; // 1 if just spawned, 0 otherwise
+  int x, y;   // shuriken pos
+  int active; // 0 once it hits a wall or a player
 } Shuriken;
 
 /* Player structure */
 typedef struct
 {
-  int x, y;          // current position
-  int hp;            // health points
-  int active;        // 1 if this player slot is used, 0 otherwise
-  Shuriken shuriken; // Each player has one shuriken
+  int x, y;      // current position
+  int hp;        // health points
+  int active;    // 1 if this player slot is used, 0 otherwise
+  int shurikens; // shurikens this player has in flight
 } Player;
 
-/* Game state: grid + players + count */
+/* Every shuriken in a room, kept structure-of-arrays so a turn's advance is a
+ * couple of straight passes over plain int arrays (see stepShurikens). Slots
+ * are recycled through a free list, and the ones in flight are also packed
+ * into live[] so the per-shuriken work never visits a free slot. */
+typedef struct
+{
+  int *x, *y;   // position
+  int *dx, *dy; // direction
+  int *step;    // 1 if it moves this turn, 0 if free or thrown this turn
+  int *owner;   // player slot that threw it, -1 if the slot is free
+  int *landed;  // set by stepShurikens: left the map or hit a wall
+  int *live;    // slots in flight, liveCount of them
+  int *livePos; // slot -> position in live
+  int liveCount;
+  int *freeSlots; // released slots, reused before the high-water mark grows
+  int freeCount;
+  int high;     // slots [0, high) have been handed out at least once
+  int capacity;
+} ShurikenPool;
+
+/* The map every room is played on. Obstacles never change, so all rooms share
+ * one bitboard: 1 bit per cell, each row padded to a whole number of words. */
+typedef struct
+{
+  int rows, cols;
+  int wordsPerRow;     // 64-bit words per bitboard row
+  uint64_t *obstacles; // bit set = '#'
+  int *spawnX, *spawnY; // one spawn cell per player slot
+} Map;
+
+/* Cell -> occupants index. Entries are player slots, each filed under at most
+ * one cell and chained with the other slots in its bucket. There are at least
+ * twice as many buckets as slots, so chains stay short and a lookup is O(1)
+ * however large the map is or however many players share the room. */
+typedef struct
+{
+  int *heads; // bucket -> first slot in it, -1 if empty
+  int *next;  // slot -> next slot in the same bucket
+  int *cell;  // slot -> cell (row * cols + col) it is filed under, -1 if none
+  int shift;  // buckets are picked from the top bits of a multiplicative hash
+} SpatialHash;
+
+/* Game state: occupancy bitboards + players + count */
 typedef struct
 {
-  char grid[GRID_ROWS]
-           [GRID_COLS]; // '.' for empty, '#' for obstacle, or 'A'/'B'/'C'/'D'
-  Player players[MAX_CLIENTS];
+  uint64_t *playerLayer;   // bit set where a living player stands
+  uint64_t *shurikenLayer; // bit set where an active shuriken is
+  Player *players;  // g_roomCapacity slots
+  ShurikenPool shurikens;
   int clientCount; // how many players are connected
   int currentTurn; // Index of the player whose turn it is
   int gameStarted; // 0 if no players have connected yet, 1 after first player connects
+  unsigned int version; // bumped every time a changed state is broadcast
 } GameState;
 
-/* Global game state */
-GameState g_gameState;
+/* A parsed command. Turn-based play applies it right away; in real-time mode
+ * it waits for the room's next tick. */
+typedef struct
+{
+  char verb;      // 'M' move, 'A' attack, 'Q' quit, '?' unknown, 0 none pending
+  signed char dx, dy;
+} Action;
 
-/* Store each client's socket; index corresponds to a player ID (0..3) */
-int g_clientSockets[MAX_CLIENTS];
+/* Binary protocol opcodes. The direction in the low two bits of the first byte
+ * only means something to MOVE and ATTACK. ACK is followed by the version and
+ * REJOIN by the token, both big-endian. */
+enum
+{
+  OP_NONE,
+  OP_MOVE,
+  OP_ATTACK,
+  OP_QUIT,
+  OP_DELTA,
+  OP_ACK,    // + 4 bytes
+  OP_REJOIN, // + 8 bytes
+};
 
-void initSockets()
+enum
 {
-  for (int i = 0; i < MAX_CLIENTS; i++)
-  {
-    g_clientSockets[i] = -1;
-  }
-}
+  DIR_UP,
+  DIR_DOWN,
+  DIR_LEFT,
+  DIR_RIGHT
+};
 
-/* Mutex to protect shared game state (recommended for thread safety) */
-pthread_mutex_t g_stateMutex = PTHREAD_MUTEX_INITIALIZER;
+/* One entry of a room's delta log: something that changed in a given version.
+ * Only the location is stored; the encoder reads the current value. */
+typedef struct
+{
+  unsigned int version;
+  char kind;    // 'C' grid cell, 'P' player fields, 'S' pooled shuriken
+  int row, col; // cell for 'C', player or shuriken slot in row for 'P'/'S'
+} DeltaChange;
 
-// Shifted reset logic from init to a function
-void resetPlayerState(int playerIndex)
+/* Match journal file: a JournalHeader, then records back to back. Each record
+ * is a JournalRecord followed by `length` bytes of command text (no '\n').
+ * Multi-byte fields are in host byte order. */
+typedef struct
 {
-  g_gameState.players[playerIndex].x = -1;
-  g_gameState.players[playerIndex].y = -1;
-  g_gameState.players[playerIndex].hp = 100;
-  g_gameState.players[playerIndex].active = 0;
-  g_gameState.players[playerIndex].shuriken.x = -1;
-  g_gameState.players[playerIndex].shuriken.y = -1;
-  g_gameState.players[playerIndex].shuriken.dx = 0;
-  g_gameState.players[playerIndex].shuriken.dy = 0;
-  g_gameState.players[playerIndex].shuriken.active = 0;
-  g_gameState.players[playerIndex].shuriken.justSpawned = 0;
-}
+  char magic[4]; // "BGJ2"
+  uint32_t roomId;
+  uint32_t rows, cols;
+  uint32_t roomCapacity, maxShurikens;
+  uint32_t tickRate; // -t the match was played with, 0 = turn-based
+  uint64_t mapHash;  // mapHash() of the map the match was played on
+  int64_t startNs;  // CLOCK_REALTIME when the room opened
+} JournalHeader;
 
-void initGameState()
+typedef struct
 {
-  for (int r = 0; r < GRID_ROWS; r++)
-  {
-    for (int c = 0; c < GRID_COLS; c++)
-    {
-      g_gameState.grid[r][c] = '.';
-    }
-  }
+  int64_t timeNs;  // CLOCK_REALTIME
+  uint32_t turn;   // commands the room had accepted (ticks it had run) before this record
+  uint16_t player; // slot
+  uint8_t kind;    // 'J' joined, 'C' command, 'L' left without QUIT, 'T' real-time tick
+  uint8_t length;  // bytes of command text that follow
+} JournalRecord;
 
-  g_gameState.grid[2][2] = '#';
-  g_gameState.grid[1][3] = '#';
+/* One match's journal file. The worker only fills chunks; the file itself is
+ * opened, written and closed by the journal thread. */
+typedef struct Journal
+{
+  char path[256];
+  int fd; // opened by the journal thread on the first chunk
+} Journal;
 
-  for (int i = 0; i < MAX_CLIENTS; i++)
-  {
-    resetPlayerState(i);
-    g_clientSockets[i] = -1;
-  }
+/* A filled buffer on its way to the journal thread */
+typedef struct JournalChunk
+{
+  Journal *journal;
+  char *data;
+  size_t len;
+  int last; // the match is over: close and free the journal after this chunk
+  struct JournalChunk *next;
+} JournalChunk;
 
-  g_gameState.clientCount = 0;
-  g_gameState.currentTurn = 0;
-  g_gameState.gameStarted = 0;
-}
+/* Snapshot file: a SnapshotHeader, then roomCount rooms. Each room is a
+ * RoomSnapshot, g_roomCapacity SeatSnapshots and its ShurikenSnapshots. The
+ * grids are not saved; they are rebuilt from the map and the positions. */
+typedef struct
+{
+  char magic[4]; // "BGS1"
+  uint32_t rows, cols;
+  uint32_t roomCapacity, maxShurikens;
+  uint32_t roomCount;
+  uint64_t mapHash;
+  int64_t takenNs; // CLOCK_REALTIME
+} SnapshotHeader;
 
-// Function to send a message to a player via their socket
-void sendMessageToPlayer(int playerIndex, const char *message)
+typedef struct
 {
-  if (g_clientSockets[playerIndex] != -1)
-  {
-    send(g_clientSockets[playerIndex], message, strlen(message), 0);
-  }
-}
+  int32_t id;
+  int32_t currentTurn;
+  int32_t gameStarted;
+  int32_t peakPlayers;
+  uint32_t turnNumber;
+  uint32_t shurikenCount; // in flight, in live-list order
+} RoomSnapshot;
 
-// Transfered logic for shuriken collision handling to helper function
-int checkShurikenCollision(int shurikenOwnerIndex, int shurikenX, int shurikenY)
+typedef struct
 {
-  int hitPlayerIndex = -1;
-  for (int j = 0; j < MAX_CLIENTS; j++)
-  {
-    if (g_gameState.players[j].active && g_gameState.players[j].hp > 0)
-    {
-      if (g_gameState.players[j].x == shurikenX && g_gameState.players[j].y == shurikenY)
-      {
-        hitPlayerIndex = j;
-        break;
-      }
-    }
-  }
+  uint64_t token; // what the player sends with REJOIN
+  int32_t x, y, hp;
+  int32_t shurikens;
+  int32_t seated; // 0 for a free seat, whose other fields are unused; 2 for a bot
+} SeatSnapshot;
 
-  if (hitPlayerIndex != -1) // A player was hit
-  {
-    g_gameState.players[hitPlayerIndex].hp -= 50;
-    printf("Player %c hit by shuriken! HP reduced to %d\n", 'A' + hitPlayerIndex, g_gameState.players[hitPlayerIndex].hp);
-    fflush(stdout);
+typedef struct
+{
+  int32_t x, y, dx, dy;
+  int32_t step, owner;
+} ShurikenSnapshot;
 
-    // Deactivate shuriken after hitting a player
-    g_gameState.players[shurikenOwnerIndex].shuriken.active = 0;
+/* One worker's rooms, serialized and waiting for the snapshot thread */
+typedef struct
+{
+  char *data;
+  size_t len;
+  uint32_t rooms;
+} SnapshotPart;
 
-    // Check if player's HP is 0 or less
-    if (g_gameState.players[hitPlayerIndex].hp <= 0)
-    {
-      printf("Player %c has been defeated!\n", 'A' + hitPlayerIndex);
-      fflush(stdout);
+/* Counters and histograms each thread keeps about itself. Only the owning
+ * thread writes them, with plain relaxed stores, so collecting costs no locked
+ * instructions; the stats endpoint reads them from another thread and sums. */
+enum
+{
+  STAT_CONNECTS,
+  STAT_REJECTS,
+  STAT_DISCONNECTS,
+  STAT_COMMANDS,
+  STAT_BROADCASTS,
+  STAT_BROADCAST_BYTES,
+  STAT_SEND_CALLS,
+  STAT_BYTES_SENT,
+  STAT_RECV_CALLS,
+  STAT_INBOX_POSTS,   // connections handed to a worker's inbox
+  STAT_INBOX_RETRIES, // inbox pushes that lost a race with another thread and went round again
+  STAT_TICKS,
+  STAT_TICK_OVERRUNS, // ticks that took longer than their budget
+  STAT_TICKS_MISSED,  // timer expirations that were never run, from falling behind
+  STAT_SPECTATORS,    // watchers attached to a room
+  STAT_FRAMES_BUILT,  // STATE/KEY/DELTA frames encoded, at most one per kind and version
+  STAT_FRAMES_REUSED, // lookups served from a room's cached frame
+  STAT_QUEUED,        // clients put in the admission queue because every seat was taken
+  STAT_QUEUE_ADMITTED, // queued clients handed to a worker
+  STAT_QUEUE_ABANDONED, // queued clients that hung up before a seat opened
+  STAT_WAIT_CALLS,    // epoll_wait and io_uring_enter calls by workers
+  STAT_RING_RECVS,    // receives completed through io_uring, no syscall each
+  STAT_RING_SENDS,    // sends issued through io_uring, batched into wait_calls
+  STAT_BOT_TURNS,     // commands played by server-side bots
+  STAT_BOT_NODES,     // positions their searches visited
+  STAT_COUNTERS
+};
 
-      // Send "You have died!" message to the player
-      const char *deathMessage = "You have died!\n";
-      sendMessageToPlayer(hitPlayerIndex, deathMessage);
+enum
+{
+  HIST_COMMAND_NS,    // handleCommand, sampled
+  HIST_TURN_NS,       // from a turn starting to its player's command, sampled
+  HIST_BROADCAST_BYTES, // queued by one broadcastState
+  HIST_INBOX_WAIT_NS, // time a connection spent in a worker's inbox
+  HIST_TICK_NS,       // one real-time tick of every room on a worker
+  HIST_QUEUE_WAIT_NS, // time a client spent in the admission queue
+  HIST_BOT_TURN_NS,   // one bot deciding on its command
+  STAT_HISTOGRAMS
+};
 
-      g_gameState.players[hitPlayerIndex].active = 0;
-      if (g_clientSockets[hitPlayerIndex] != -1)
-      {
-        close(g_clientSockets[hitPlayerIndex]);
-        g_clientSockets[hitPlayerIndex] = -1;
-        g_gameState.clientCount--;
-      }
-    }
-    return 1; // Collision occurred
-  }
-  return 0; // No collision
+typedef struct
+{
+  atomic_ulong buckets[HIST_BUCKETS];
+  atomic_ulong count, sum, max;
+} Histogram;
+
+typedef struct
+{
+  atomic_ulong counters[STAT_COUNTERS];
+  Histogram histograms[STAT_HISTOGRAMS];
+} Metrics;
+
+struct Room;
+struct Worker;
+
+/* One encoded STATE frame handed to many spectators without copying. Only the
+ * room's worker touches it, so the count needs no atomics; the last spectator
+ * to finish sending it (or the room, replacing it) frees it. */
+typedef struct
+{
+  int refs;
+  unsigned int version; // state version it shows
+  size_t len;
+  char data[];
+} SharedFrame;
+
+/* A restored seat waiting for its player. The table is built before the
+ * workers start and only `claimed` changes afterwards: whoever flips it first,
+ * the rejoining client or the seat's worker giving up on it, owns the seat. */
+typedef struct
+{
+  uint64_t token; // 0 = empty table entry
+  struct Worker *worker;
+  struct Room *room;
+  int slot;
+  atomic_int claimed;
+} HeldSeat;
+
+/* One accepted socket registered with a worker's epoll loop */
+typedef struct Connection
+{
+  int fd;                  // -1 once the socket has been closed
+  int playerIndex;         // slot in room->state.players
+  struct Room *room;       // match this client plays in, NULL until placed
+  struct Connection *next; // link in the worker inbox or deferred-free list
+
+  // Inbound bytes not yet split into commands (see processCommands)
+  char inBuf[INBUF_SIZE];
+  size_t inLen;
+  int discarding; // 1 while skipping the rest of an over-long command
+  int moving;     // 1 while being handed to the worker of the seat it rejoins
+  int roomReserved; // first of a batch from the admission queue: opens the room it reserved
+  int seatReserved; // from the admission queue, into a seat counted in the worker's openSeats
+  long long postedNs; // when it was put in a worker's inbox
+
+  // io_uring backend only. Requests in flight still point at the Connection,
+  // so it is freed or handed to another worker only once ringOps drops to 0.
+  int viaRing;        // reads and writes go through the worker's ring
+  int ringOps;        // requests in flight: the multishot receive, a send
+  int ringCancelled;  // its requests have been cancelled
+  size_t ringSendLen; // bytes in the send in flight, 0 if none
+  struct iovec ringIov[2]; // a send that wraps around the ring buffer, kept until it completes
+  struct msghdr ringMsg;
+  char *carry;        // input received after a REJOIN, kept for the seat's worker
+  size_t carryLen;
+
+  // Outbound queue, flushed whenever the socket is writable (see flushOutput)
+  char *outBuf;             // g_outbufSize-byte ring buffer, allocated on first use
+  size_t outHead;           // offset of the first unsent byte
+  size_t outLen;            // bytes waiting to be sent
+  int blocked;              // 1 while the kernel send buffer is full
+  long long blockedSinceMs; // when the client stopped keeping up
+  int stateStale;           // a state frame was skipped while blocked
+  int lagged;               // too far behind; disconnected at the next flush
+  int dirty;                // 1 while on the worker's dirty list
+  struct Connection *nextDirty;
+
+  // Delta protocol state, see sendDeltaFrame()
+  int binaryMode;            // 1 once the client sent BINARY; commands are opcodes from then on
+  int deltaMode;             // 1 once the client sent DELTA
+  unsigned int ackedVersion; // last version the client acknowledged with ACK
+  unsigned int sentVersion;  // newest version sent to the client
+  unsigned int keyVersion;   // version of the last keyframe sent, 0 if none
+
+  // Spectators only, see watchRoom(). Frames go out after outBuf, straight
+  // from the room's shared copy; a newer frame replaces a pending one.
+  int spectating;
+  int watchRoomId;           // room asked for with WATCH, -1 until then
+  int spectatorIndex;        // position in room->spectators
+  SharedFrame *frameSending; // partly sent, frameOffset bytes of it
+  size_t frameOffset;
+  SharedFrame *framePending; // next to send, not started yet
+} Connection;
+
+/* One match: its own game state, socket table and turn state. A room belongs
+ * to exactly one worker thread, which is the only thread that ever touches it,
+ * so the game logic needs no lock. */
+typedef struct Room
+{
+  int id;
+  GameState state;
+  int *clientSockets;       // index corresponds to a player ID (0..g_roomCapacity-1)
+  Connection **connections; // connection owning each slot, NULL if free
+  uint64_t *seatTokens;     // per slot, given to the player so they can REJOIN after a restart
+
+  // Real-time mode: each player's latest command since the last tick, and
+  // which players have one
+  Action *pendingActions;
+  int *pendingPlayers;
+  int pendingCount;
+  int peakPlayers;          // most players that were in the room at once
+  int botCount;             // seats played by server-side bots (-a)
+  long long botFillAtMs;    // when empty seats get bots, 0 until the first player joins
+
+  // Read-only watchers (-v), all fed the room's cached STATE frame
+  Connection **spectators;
+  int spectatorCount, spectatorCap;
+
+  // Newest frames built for this room, see cachedFrame(); NULL until needed
+  SharedFrame *stateFrame; // text STATE
+  SharedFrame *keyFrame;   // KEY
+  SharedFrame *deltaFrame; // DELTA from deltaBase
+  unsigned int deltaBase;
+
+  // Where every living player and flying shuriken is, kept current by
+  // touchPlayer() and touchShuriken()
+  SpatialHash playersByCell;
+  SpatialHash shurikensByCell;
+
+  // Players and shurikens changed since the last refresh; only these are
+  // diffed against their published state as of that refresh
+  int *touched;
+  unsigned char *isTouched;
+  int touchedCount;
+  Player *publishedPlayers;
+  int *touchedShurikens;
+  unsigned char *isShurikenTouched;
+  int touchedShurikenCount;
+  Shuriken *publishedShurikens;
+  unsigned int *sentMark; // per-slot and per-cell marks buildDeltaFrame uses to send each entry once
+  unsigned int sentStamp;
+
+  // Match journal, NULL unless -j was given
+  Journal *journal;
+  char *journalBuf; // JOURNAL_CHUNK_SIZE bytes not yet handed to the journal thread
+  size_t journalLen;
+  unsigned int turnNumber; // commands accepted so far, or ticks run in real-time mode
+  long long turnStartNs;   // when the current turn began if it is timed, else 0
+
+  DeltaChange *deltaLog; // DELTA_LOG_SIZE ring buffer, deltaCount entries ever written
+  unsigned long deltaCount;
+  unsigned int deltaFloor; // deltas can only be built from versions >= this
+
+  struct Worker *worker;
+  struct Room *next; // link in the worker's room list
+} Room;
+
+/* One worker's io_uring: the shared submission and completion rings, and the
+ * provided buffers multishot receives land in */
+typedef struct
+{
+  int fd; // -1 when the worker runs on epoll alone
+  unsigned *sqHead, *sqTail, *sqArray, sqMask, sqEntries;
+  unsigned sqLocalTail; // SQEs prepared up to here, published on submit
+  struct io_uring_sqe *sqes;
+  unsigned *cqHead, *cqTail, cqMask;
+  struct io_uring_cqe *cqes;
+  void *rings;
+  size_t ringsSize, sqesSize;
+  struct io_uring_buf_ring *bufRing;
+  unsigned short bufTail;
+  int disabled;
+  char *bufs; // RING_BUFS * RING_BUF_SIZE
+} Ring;
+
+/* A thread pinned to one core that runs an epoll loop for its rooms */
+typedef struct Worker
+{
+  int id;
+  pthread_t thread;
+  int epollFd;
+  int wakeFd;  // eventfd poked when the inbox goes from empty to not
+  int timerFd; // once a second, drops clients that have lagged for too long
+  int tickFd;  // real-time mode only: fires g_tickRate times a second
+  int listenFd; // this worker's SO_REUSEPORT socket on the game port
+  Ring ring;   // -U: player sockets are read and written through io_uring
+
+  // New connections handed over by other threads: a lock-free LIFO list that
+  // any thread pushes onto and only this worker takes, all at once
+  _Atomic(Connection *) inbox;
+
+  Room *rooms;
+  int roomCount;
+  atomic_int openSeats; // free seats in its rooms; the acceptor reserves them for queued clients
+  int nextRoomId; // room ids are striped: this worker owns every id == its own id mod g_workerCount
+
+  // Connections closed while handling the current batch of epoll events. They
+  // are freed only after the batch, since a later event may still point at them.
+  Connection *closedConnections;
+
+  // Connections with queued output, flushed once the batch has been handled
+  Connection *dirtyConnections;
+
+  // Connections that sent REJOIN, or spectators that asked for another
+  // worker's room, handed to that worker after the batch
+  Connection *movingConnections;
+
+  uint64_t tokenState;  // seeds seat tokens
+  int snapshotTicks;    // timer ticks since the last snapshot
+  int heldSeatsExpired; // 1 once restored seats nobody reclaimed were given up
+  int seatsFreed;       // a player left or a room closed during this batch
+  int arrivalsPosted;   // clients were handed to the admission queue during this batch
+
+  Metrics metrics;
+  unsigned int commandTick; // picks which commands get timed
+
+  // Scratch space for encoding frames before they are cached, g_frameBound bytes each
+  char *stateFrame; // STATE or KEY
+  char *deltaFrame; // DELTA
+
+  struct BotEntry *botTable; // transposition table bots search with, allocated on first use
+  int botNextRoom;  // id of the room whose bots play first next time
+  int botsPending;  // bots still had turns to play when the last batch ran out of time
+
+  atomic_ulong matchesCompleted; // read by the acceptor thread for reporting
+} Worker;
+
+Map g_map;
+size_t g_frameBound; // worst-case size of a STATE or KEY frame on this map
+size_t g_outbufSize; // per-connection outbound ring buffer
+
+Worker *g_workers;
+int g_workerCount;
+
+/* Players across every room, shared with the acceptor for the "Server full" check */
+atomic_int g_playerCount;
+atomic_int g_waitingCount; // clients in the acceptor's admission queue
+int g_admitFd = -1;        // eventfd workers poke when seats free up while clients wait
+int g_maxRooms = DEFAULT_MAX_ROOMS;
+int g_roomCapacity = MAX_CLIENTS; // players per room, -p
+int g_maxShurikens = 1;           // shurikens in flight per player, -s
+int g_maxLagMs = DEFAULT_MAX_LAG_MS;
+int g_firstRoomId; // ids below this were taken by rooms restored from a snapshot
+const char *g_journalDir; // -j: where match journals are written, NULL = off
+const char *g_snapshotPath; // -S: where all rooms are saved, NULL = off
+int g_tickRate;             // -t: real-time ticks per second, 0 = turn-based
+int g_useRing;              // -U: io_uring for player sockets, if the kernel has it
+int g_botDelaySec = -1;     // -a: seconds before empty seats get bots, -1 = off
+
+/* Seats restored from a snapshot, open-addressed by token */
+HeldSeat *g_heldSeats;
+size_t g_heldSeatMask;
+int g_heldSeatCount;
+long long g_rejoinDeadlineMs;
+
+/*---------------------------------------------------------------------------*
+ * Bitboard helpers. Walls and occupancy are one bit test each.
+ *---------------------------------------------------------------------------*/
+int testCell(const uint64_t *layer, int x, int y)
+{
+  return (layer[(size_t)x * g_map.wordsPerRow + (y >> 6)] >> (y & 63)) & 1;
 }
 
-// Function to rotate turns to make sure the game works on a turn by turn basis
-void rotateTurn()
+void setCell(uint64_t *layer, int x, int y, int on)
 {
-  int originalTurn = g_gameState.currentTurn;
+  uint64_t *word = &layer[(size_t)x * g_map.wordsPerRow + (y >> 6)];
+  uint64_t bit = (uint64_t)1 << (y & 63);
+  *word = on ? (*word | bit) : (*word & ~bit);
+}
 
-  // Remainder obviously can't be higher than the divisor, so conveniently I can get the next turn
-  int nextTurn = (g_gameState.currentTurn + 1) % MAX_CLIENTS;
+int isObstacle(int x, int y)
+{
+  return testCell(g_map.obstacles, x, y);
+}
 
-  // Find the next active player
-  while (nextTurn != originalTurn)
+/*---------------------------------------------------------------------------*
+ * Map loading. -m takes either a map file, one line per row with '#' for an
+ * obstacle and anything else for open floor, or ROWSxCOLS for an open map.
+ * Without -m the classic 5x5 map is used.
+ *---------------------------------------------------------------------------*/
+static const char *defaultMap[] = {".....", "...#.", "..#..", ".....", "....."};
+
+int allocMap(int rows, int cols)
+{
+  if (rows < 1 || cols < 1 || rows > MAX_MAP_SIZE || cols > MAX_MAP_SIZE)
   {
-    if (g_gameState.players[nextTurn].active && g_gameState.players[nextTurn].hp > 0)
-    {
-      break;
-    }
-    nextTurn = (nextTurn + 1) % MAX_CLIENTS;
+    fprintf(stderr, "Map must be between 1x1 and %dx%d, got %dx%d\n", MAX_MAP_SIZE, MAX_MAP_SIZE, rows, cols);
+    return -1;
   }
+  g_map.rows = rows;
+  g_map.cols = cols;
+  g_map.wordsPerRow = (cols + 63) / 64;
+  g_map.obstacles = calloc((size_t)rows * g_map.wordsPerRow, sizeof(uint64_t));
+  if (g_map.obstacles == NULL)
+  {
+    perror("calloc failed");
+    return -1;
+  }
+  return 0;
+}
 
-  // If we looped back to the original turn and no other players are active, keep the turn
-  if (nextTurn == originalTurn && (!g_gameState.players[nextTurn].active || g_gameState.players[nextTurn].hp <= 0))
+int readMapFile(const char *path)
+{
+  FILE *file = fopen(path, "r");
+  if (file == NULL)
   {
-    // No active players left, reset turn to 0 (or handle game over)
-    g_gameState.currentTurn = 0;
-    return;
+    perror(path);
+    return -1;
   }
 
-  g_gameState.currentTurn = nextTurn;
+  // First pass sizes the map, second pass fills the bitboard
+  char *line = NULL;
+  size_t lineCap = 0;
+  ssize_t len;
+  int rows = 0, cols = -1;
+  while ((len = getline(&line, &lineCap, file)) > 0)
+  {
+    while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r'))
+    {
+      len--;
+    }
+    if (cols < 0)
+    {
+      cols = (int)len;
+    }
+    else if (len != cols)
+    {
+      fprintf(stderr, "%s: row %d is %zd wide, expected %d\n", path, rows + 1, len, cols);
+      free(line);
+      fclose(file);
+      return -1;
+    }
+    rows++;
+  }
 
-  // Notify the player whose turn it is
-  char turnMessage[BUFFER_SIZE];
-  snprintf(turnMessage, BUFFER_SIZE, "\nIt's your turn, Player %c\n", 'A' + g_gameState.currentTurn);
-  sendMessageToPlayer(g_gameState.currentTurn, turnMessage);
+  if (allocMap(rows, cols) != 0)
+  {
+    free(line);
+    fclose(file);
+    return -1;
+  }
 
-  // Notify all other players whose turn it is
-  char otherMessage[BUFFER_SIZE];
-  snprintf(otherMessage, BUFFER_SIZE, "\nIt's Player %c's turn\n", 'A' + g_gameState.currentTurn);
-  for (int i = 0; i < MAX_CLIENTS; i++)
+  rewind(file);
+  for (int r = 0; r < rows && getline(&line, &lineCap, file) > 0; r++)
   {
-    if (i != g_gameState.currentTurn && g_clientSockets[i] != -1)
+    for (int c = 0; c < cols; c++)
     {
-      sendMessageToPlayer(i, otherMessage);
+      if (line[c] == '#')
+      {
+        setCell(g_map.obstacles, r, c, 1);
+      }
     }
   }
+
+  free(line);
+  fclose(file);
+  return 0;
 }
 
-/*---------------------------------------------------------------------------*
- * Refresh the grid with current player positions.
- * We clear old player marks (leaving obstacles) and re-place them according
- * to the players' (x,y).
- *---------------------------------------------------------------------------*/
-void refreshPlayerPositions()
+int loadMap(const char *spec)
 {
-  // Clear all non-obstacle cells
-  for (int r = 0; r < GRID_ROWS; r++)
+  int rows, cols;
+  char extra;
+  if (spec == NULL)
   {
-    for (int c = 0; c < GRID_COLS; c++)
+    if (allocMap(5, 5) != 0)
+    {
+      return -1;
+    }
+    for (int r = 0; r < 5; r++)
     {
-      if (g_gameState.grid[r][c] != '#')
+      for (int c = 0; c < 5; c++)
       {
-        g_gameState.grid[r][c] = '.';
+        setCell(g_map.obstacles, r, c, defaultMap[r][c] == '#');
       }
     }
   }
-
-  // Place each active shuriken
-  for (int i = 0; i < MAX_CLIENTS; i++)
+  else if (sscanf(spec, "%dx%d%c", &rows, &cols, &extra) == 2)
   {
-    if (g_gameState.players[i].shuriken.active)
+    if (allocMap(rows, cols) != 0)
     {
-      int x = g_gameState.players[i].shuriken.x;
-      int y = g_gameState.players[i].shuriken.y;
-      g_gameState.grid[x][y] = '*';
+      return -1;
     }
   }
+  else if (readMapFile(spec) != 0)
+  {
+    return -1;
+  }
+
+  // Player i spawns on the first open cell at or after (i % rows, i / rows),
+  // so slots fill the first column top to bottom, then the next one
+  g_map.spawnX = malloc(g_roomCapacity * sizeof(int));
+  g_map.spawnY = malloc(g_roomCapacity * sizeof(int));
+  if (g_map.spawnX == NULL || g_map.spawnY == NULL)
+  {
+    perror("malloc failed");
+    return -1;
+  }
 
-  // Place each active player's symbol
-  for (int i = 0; i < MAX_CLIENTS; i++)
+  size_t cells = (size_t)g_map.rows * g_map.cols;
+  for (int i = 0; i < g_roomCapacity; i++)
   {
-    if (g_gameState.players[i].active && g_gameState.players[i].hp > 0)
+    size_t cell = (size_t)(i % g_map.rows) * g_map.cols + (i / g_map.rows) % g_map.cols;
+    size_t tried = 0;
+    while (tried < cells && isObstacle(cell / g_map.cols, cell % g_map.cols))
+    {
+      cell = (cell + 1) % cells;
+      tried++;
+    }
+    if (tried == cells)
     {
-      int px = g_gameState.players[i].x;
-      int py = g_gameState.players[i].y;
-      g_gameState.grid[px][py] = 'A' + i; // 'A', 'B', 'C', 'D'
+      fprintf(stderr, "Map has no open cell to spawn on\n");
+      return -1;
     }
+    g_map.spawnX[i] = cell / g_map.cols;
+    g_map.spawnY[i] = cell % g_map.cols;
+  }
+
+  // Header, one line per row, then the player section at its widest
+  g_frameBound = 32 + (size_t)g_map.rows * (g_map.cols + 1) + 40 + (size_t)g_roomCapacity * 96;
+  if (g_frameBound < BUFFER_SIZE)
+  {
+    g_frameBound = BUFFER_SIZE;
+  }
+  g_outbufSize = 2 * g_frameBound + 2 * BUFFER_SIZE;
+  return 0;
+}
+
+// FNV-1a over the map size and obstacles, so a journal can only be replayed
+// on the map it was recorded on
+uint64_t mapHash()
+{
+  uint64_t hash = 14695981039346656037ULL;
+  const unsigned char *bytes = (const unsigned char *)g_map.obstacles;
+  size_t len = (size_t)g_map.rows * g_map.wordsPerRow * sizeof(uint64_t);
+  for (size_t i = 0; i < len; i++)
+  {
+    hash = (hash ^ bytes[i]) * 1099511628211ULL;
   }
+  return hash ^ ((uint64_t)g_map.rows << 32 | (uint32_t)g_map.cols);
 }
 
 /*---------------------------------------------------------------------------*
- * Build a string that represents the current game state (ASCII grid),
- *       which you can send to all clients.
+ * Spatial index (see SpatialHash)
  *---------------------------------------------------------------------------*/
-void buildStateString(char *outBuffer)
+int spatialInit(SpatialHash *hash, int slots)
 {
-  // e.g., prefix with "STATE\n", then rows of the grid, then player info
-  outBuffer[0] = '\0'; // start empty
+  int bits = 3;
+  while ((1 << bits) < 2 * slots)
+  {
+    bits++;
+  }
+  hash->shift = 32 - bits;
+  hash->heads = malloc(((size_t)1 << bits) * sizeof(int));
+  hash->next = malloc(slots * sizeof(int));
+  hash->cell = malloc(slots * sizeof(int));
+  if (hash->heads == NULL || hash->next == NULL || hash->cell == NULL)
+  {
+    return -1;
+  }
+  memset(hash->heads, -1, ((size_t)1 << bits) * sizeof(int));
+  memset(hash->cell, -1, slots * sizeof(int));
+  return 0;
+}
 
-  strcat(outBuffer, "\nSTATE:\n\n");
+void spatialFree(SpatialHash *hash)
+{
+  free(hash->heads);
+  free(hash->next);
+  free(hash->cell);
+}
+
+unsigned int spatialBucket(const SpatialHash *hash, int cell)
+{
+  return ((unsigned int)cell * 2654435761u) >> hash->shift;
+}
+
+// File a slot under a cell, or take it out of the index if cell is -1
+void spatialMove(SpatialHash *hash, int slot, int cell)
+{
+  if (hash->cell[slot] == cell)
+  {
+    return;
+  }
 
-  // Copy the grid
-  for (int r = 0; r < GRID_ROWS; r++)
+  if (hash->cell[slot] != -1)
   {
-    for (int c = 0; c < GRID_COLS; c++)
+    int *link = &hash->heads[spatialBucket(hash, hash->cell[slot])];
+    while (*link != slot)
     {
-      sprintf(outBuffer + strlen(outBuffer), "%c", g_gameState.grid[r][c]);
+      link = &hash->next[*link];
     }
-    strcat(outBuffer, "\n");
+    *link = hash->next[slot];
   }
-  // ...
-  strcat(outBuffer, "\nACTIVE PLAYER INFO (IF EXISTS)\n");
-  // Optionally append player info
-  for (int i = 0; i < MAX_CLIENTS; i++)
+
+  hash->cell[slot] = cell;
+  if (cell != -1)
   {
-    // Check for active players
-    Player active_player;
-    if (g_gameState.players[i].active == 1)
-    {
+    unsigned int bucket = spatialBucket(hash, cell);
+    hash->next[slot] = hash->heads[bucket];
+    hash->heads[bucket] = slot;
+  }
+}
 
-      active_player = g_gameState.players[i];
-      sprintf(outBuffer + strlen(outBuffer), "Player %d\n", i);
-      sprintf(outBuffer + strlen(outBuffer), "Player position: (%d, %d)\n", active_player.x, active_player.y);
-      sprintf(outBuffer + strlen(outBuffer), "Player health points %d\n", active_player.hp);
-    }
-    else
+// Lowest or highest slot filed under a cell, -1 if there is none
+int spatialFind(const SpatialHash *hash, int cell, int highest)
+{
+  int found = -1;
+  for (int slot = hash->heads[spatialBucket(hash, cell)]; slot != -1; slot = hash->next[slot])
+  {
+    if (hash->cell[slot] == cell && (found == -1 || (highest ? slot > found : slot < found)))
     {
-      continue;
+      found = slot;
     }
   }
+  return found;
 }
 
 /*---------------------------------------------------------------------------*
- * Broadcast the current game state to all connected clients
+ * Shuriken pool (see ShurikenPool)
  *---------------------------------------------------------------------------*/
-void broadcastState()
+int shurikenPoolInit(ShurikenPool *pool, int capacity)
 {
-  char buffer[BUFFER_SIZE];
-  buildStateString(buffer);
-  size_t len = strlen(buffer);
-
-  // send buffer to each active client via send() or write()
-  for (int i = 0; i < MAX_CLIENTS; i++)
+  pool->capacity = capacity;
+  pool->liveCount = 0;
+  pool->freeCount = 0;
+  pool->high = 0;
+  pool->x = calloc(capacity, sizeof(int));
+  pool->y = calloc(capacity, sizeof(int));
+  pool->dx = calloc(capacity, sizeof(int));
+  pool->dy = calloc(capacity, sizeof(int));
+  pool->step = calloc(capacity, sizeof(int));
+  pool->owner = malloc(capacity * sizeof(int));
+  pool->landed = calloc(capacity, sizeof(int));
+  pool->live = malloc(capacity * sizeof(int));
+  pool->livePos = malloc(capacity * sizeof(int));
+  pool->freeSlots = malloc(capacity * sizeof(int));
+  if (pool->x == NULL || pool->y == NULL || pool->dx == NULL || pool->dy == NULL ||
+      pool->step == NULL || pool->owner == NULL || pool->landed == NULL ||
+      pool->live == NULL || pool->livePos == NULL || pool->freeSlots == NULL)
   {
-    // Checking for valid sockets
-    if (g_clientSockets[i] != -1)
-    {
-      if (send(g_clientSockets[i], buffer, len, 0) < 0)
-      {
-        printf("Failed to send message to a socket %d", g_clientSockets[i]);
-        continue;
-      }
-    }
-    else
-    {
-      continue;
-    }
+    return -1;
   }
+  memset(pool->owner, -1, capacity * sizeof(int));
+  return 0;
 }
 
-/*---------------------------------------------------------------------------*
- * Handle a client command: MOVE, ATTACK, QUIT, etc.
- *  - parse the string
- *  - update the player's position or HP
- *  - call refreshPlayerPositions() and broadcastState()
- *---------------------------------------------------------------------------*/
-void handleCommand(int playerIndex, const char *cmd)
+void shurikenPoolFree(ShurikenPool *pool)
 {
-  pthread_mutex_lock(&g_stateMutex);
+  free(pool->x);
+  free(pool->y);
+  free(pool->dx);
+  free(pool->dy);
+  free(pool->step);
+  free(pool->owner);
+  free(pool->landed);
+  free(pool->live);
+  free(pool->livePos);
+  free(pool->freeSlots);
+}
 
-  // Check if it's the player's turn
-  if (playerIndex != g_gameState.currentTurn)
+// A slot for a new shuriken, or -1 if the pool is exhausted
+int takeShurikenSlot(ShurikenPool *pool)
+{
+  int slot;
+  if (pool->freeCount > 0)
   {
-    const char *notYourTurnMsg = "Sorry, it's not your turn\n";
-    sendMessageToPlayer(playerIndex, notYourTurnMsg);
-    pthread_mutex_unlock(&g_stateMutex);
-    return;
+    slot = pool->freeSlots[--pool->freeCount];
   }
-
-  // Move all active shurikens and check for collisions before the player's action
-  for (int i = 0; i < MAX_CLIENTS; i++)
+  else if (pool->high < pool->capacity)
   {
-    if (g_gameState.players[i].shuriken.active)
-    {
-      if (g_gameState.players[i].shuriken.justSpawned)
-      {
-        g_gameState.players[i].shuriken.justSpawned = 0;
-        continue;
-      }
+    slot = pool->high++;
+  }
+  else
+  {
+    return -1;
+  }
 
-      int oldX = g_gameState.players[i].shuriken.x;
-      int oldY = g_gameState.players[i].shuriken.y;
-      int nx = oldX + g_gameState.players[i].shuriken.dx;
-      int ny = oldY + g_gameState.players[i].shuriken.dy;
+  pool->livePos[slot] = pool->liveCount;
+  pool->live[pool->liveCount++] = slot;
+  return slot;
+}
+
+void releaseShurikenSlot(ShurikenPool *pool, int slot)
+{
+  // Swap the last live shuriken into the hole
+  int pos = pool->livePos[slot];
+  int last = pool->live[--pool->liveCount];
+  pool->live[pos] = last;
+  pool->livePos[last] = pos;
+
+  pool->owner[slot] = -1;
+  pool->step[slot] = 0;
+  pool->freeSlots[pool->freeCount++] = slot;
+}
+
+/*---------------------------------------------------------------------------*
+ * Advance every shuriken one cell and flag the ones that landed. Both passes
+ * run branch-free over all slots handed out so far; free and just-thrown
+ * slots have step 0 and stay put, and their flags are ignored.
+ *---------------------------------------------------------------------------*/
+
+// Move, then flag whatever left the map; negative coordinates wrap high as
+// unsigned. The restrict parameters let gcc -O3 vectorize this pass.
+void moveShurikens(int count, int *restrict x, int *restrict y, const int *restrict dx,
+                   const int *restrict dy, const int *restrict step, int *restrict landed)
+{
+  unsigned int rows = g_map.rows, cols = g_map.cols;
+  for (int s = 0; s < count; s++)
+  {
+    x[s] += dx[s] * step[s];
+    y[s] += dy[s] * step[s];
+    landed[s] = ((unsigned int)x[s] >= rows) | ((unsigned int)y[s] >= cols);
+  }
+}
+
+// Flag the shurikens that flew into a wall. This is a gather from the obstacle
+// bitboard, so it only vectorizes on CPUs that have gathers (e.g. gcc -O3
+// -march=native on AVX2). Shurikens already off the map look up (0, 0).
+void hitWalls(int count, const int *restrict x, const int *restrict y, int *restrict landed)
+{
+  const uint64_t *obstacles = g_map.obstacles;
+  int wordsPerRow = g_map.wordsPerRow;
+  for (int s = 0; s < count; s++)
+  {
+    int onMap = !landed[s];
+    int cx = x[s] * onMap, cy = y[s] * onMap;
+    landed[s] |= (int)((obstacles[cx * wordsPerRow + (cy >> 6)] >> (cy & 63)) & 1);
+  }
+}
+
+void stepShurikens(ShurikenPool *pool)
+{
+  moveShurikens(pool->high, pool->x, pool->y, pool->dx, pool->dy, pool->step, pool->landed);
+  hitWalls(pool->high, pool->x, pool->y, pool->landed);
+}
+
+/* Players are lettered A-Z; in larger arenas the rest go by their slot number */
+typedef struct
+{
+  char text[12];
+} PlayerName;
+
+PlayerName playerName(int i)
+{
+  PlayerName name;
+  if (i < 26)
+  {
+    name.text[0] = 'A' + i;
+    name.text[1] = '\0';
+  }
+  else
+  {
+    snprintf(name.text, sizeof(name.text), "%d", i);
+  }
+  return name;
+}
+
+char playerGlyph(int i)
+{
+  return i < 26 ? 'A' + i : '@';
+}
+
+// Shifted reset logic from init to a function
+void resetPlayerState(Room *room, int playerIndex)
+{
+  room->state.players[playerIndex].x = -1;
+  room->state.players[playerIndex].y = -1;
+  room->state.players[playerIndex].hp = 100;
+  room->state.players[playerIndex].active = 0;
+  room->state.players[playerIndex].shurikens = 0;
+}
+
+// The occupancy layers must already be allocated (zeroed) by the caller
+void initGameState(Room *room)
+{
+  for (int i = 0; i < g_roomCapacity; i++)
+  {
+    resetPlayerState(room, i);
+    room->clientSockets[i] = -1;
+  }
+  for (int slot = 0; slot < room->state.shurikens.capacity; slot++)
+  {
+    room->publishedShurikens[slot].x = -1;
+    room->publishedShurikens[slot].y = -1;
+    room->publishedShurikens[slot].active = 0;
+  }
+  room->touchedCount = 0;
+  room->touchedShurikenCount = 0;
+
+  room->state.clientCount = 0;
+  room->state.currentTurn = 0;
+  room->state.gameStarted = 0;
+  room->state.version = 0;
+
+  // Version 0 is the empty map; the delta log starts from there
+  memcpy(room->publishedPlayers, room->state.players, g_roomCapacity * sizeof(Player));
+  room->deltaCount = 0;
+  room->deltaFloor = 0;
+}
+
+void releaseFrame(SharedFrame *frame)
+{
+  if (frame != NULL && --frame->refs == 0)
+  {
+    free(frame);
+  }
+}
+
+void freeRoom(Room *room)
+{
+  free(room->state.playerLayer);
+  free(room->state.shurikenLayer);
+  free(room->state.players);
+  free(room->clientSockets);
+  free(room->connections);
+  free(room->seatTokens);
+  free(room->pendingActions);
+  free(room->pendingPlayers);
+  spatialFree(&room->playersByCell);
+  spatialFree(&room->shurikensByCell);
+  shurikenPoolFree(&room->state.shurikens);
+  free(room->touched);
+  free(room->isTouched);
+  free(room->publishedPlayers);
+  free(room->touchedShurikens);
+  free(room->isShurikenTouched);
+  free(room->publishedShurikens);
+  free(room->sentMark);
+  free(room->journalBuf);
+  free(room->deltaLog);
+  free(room->spectators);
+  releaseFrame(room->stateFrame);
+  releaseFrame(room->keyFrame);
+  releaseFrame(room->deltaFrame);
+  free(room);
+}
+
+// A fresh room with its occupancy layers, not yet attached to a worker
+Room *allocRoom()
+{
+  size_t words = (size_t)g_map.rows * g_map.wordsPerRow;
+  Room *room = calloc(1, sizeof(Room));
+  if (room == NULL)
+  {
+    return NULL;
+  }
+
+  int slots = g_roomCapacity;
+  int shurikenSlots = g_roomCapacity * g_maxShurikens;
+  room->state.playerLayer = calloc(words, sizeof(uint64_t));
+  room->state.shurikenLayer = calloc(words, sizeof(uint64_t));
+  room->state.players = calloc(slots, sizeof(Player));
+  room->clientSockets = calloc(slots, sizeof(int));
+  room->connections = calloc(slots, sizeof(Connection *));
+  room->seatTokens = calloc(slots, sizeof(uint64_t));
+  room->pendingActions = calloc(slots, sizeof(Action));
+  room->pendingPlayers = calloc(slots, sizeof(int));
+  room->touched = calloc(slots, sizeof(int));
+  room->isTouched = calloc(slots, 1);
+  room->publishedPlayers = calloc(slots, sizeof(Player));
+  room->touchedShurikens = calloc(shurikenSlots, sizeof(int));
+  room->isShurikenTouched = calloc(shurikenSlots, 1);
+  room->publishedShurikens = calloc(shurikenSlots, sizeof(Shuriken));
+  room->sentMark = calloc(slots + shurikenSlots + (size_t)g_map.rows * g_map.cols, sizeof(unsigned int));
+  // Only entries below deltaCount are read, so the log needs no zeroing and
+  // a new room does not fault in pages it has not written to yet
+  room->deltaLog = malloc(DELTA_LOG_SIZE * sizeof(DeltaChange));
+  int pooled = spatialInit(&room->playersByCell, slots) == 0 &&
+               spatialInit(&room->shurikensByCell, shurikenSlots) == 0 &&
+               shurikenPoolInit(&room->state.shurikens, shurikenSlots) == 0;
+  if (room->state.playerLayer == NULL || room->state.shurikenLayer == NULL ||
+      room->state.players == NULL || room->clientSockets == NULL || room->connections == NULL ||
+      room->seatTokens == NULL || room->pendingActions == NULL || room->pendingPlayers == NULL ||
+      room->touched == NULL || room->isTouched == NULL || room->publishedPlayers == NULL ||
+      room->touchedShurikens == NULL || room->isShurikenTouched == NULL ||
+      room->publishedShurikens == NULL || room->sentMark == NULL || room->deltaLog == NULL || !pooled)
+  {
+    freeRoom(room);
+    return NULL;
+  }
+
+  initGameState(room);
+  return room;
+}
+
+/*---------------------------------------------------------------------------*
+ * Metrics (see Metrics). Recording is a load and a store per value; the stats
+ * endpoint (-M) dumps the sum over every thread as text.
+ *---------------------------------------------------------------------------*/
+Metrics g_acceptorMetrics; // the main thread's own: connects and rejects
+long long g_startNs;
+
+long long nowNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Only ever called by the thread that owns the counter
+void statAdd(atomic_ulong *counter, unsigned long n)
+{
+  atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+int histBucket(unsigned long value)
+{
+  if (value < (1UL << HIST_SUB_BITS))
+  {
+    return value;
+  }
+  int exp = 63 - __builtin_clzl(value);
+  if (exp > HIST_MAX_EXP)
+  {
+    return HIST_BUCKETS - 1;
+  }
+  return ((exp - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + ((value >> (exp - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+// Largest value that lands in a bucket
+unsigned long histBucketTop(int bucket)
+{
+  if (bucket < (1 << HIST_SUB_BITS))
+  {
+    return bucket;
+  }
+  int exp = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+  unsigned long sub = bucket & ((1 << HIST_SUB_BITS) - 1);
+  return (((1UL << HIST_SUB_BITS) + sub + 1) << (exp - HIST_SUB_BITS)) - 1;
+}
+
+void histRecord(Histogram *hist, unsigned long value)
+{
+  statAdd(&hist->buckets[histBucket(value)], 1);
+  statAdd(&hist->count, 1);
+  statAdd(&hist->sum, value);
+  if (value > atomic_load_explicit(&hist->max, memory_order_relaxed))
+  {
+    atomic_store_explicit(&hist->max, value, memory_order_relaxed);
+  }
+}
+
+/*---------------------------------------------------------------------------*
+ * Outbound queues. Nothing in the game logic writes to a socket directly:
+ * output is appended to the connection's ring buffer and the worker flushes
+ * every dirty connection after handling a batch of events, or when epoll says
+ * a blocked socket is writable again. A client that cannot keep up only holds
+ * up itself; see flushDirtyConnections() for how it is throttled.
+ *---------------------------------------------------------------------------*/
+long long nowMs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+void markDirty(Worker *worker, Connection *conn)
+{
+  if (!conn->dirty)
+  {
+    conn->dirty = 1;
+    conn->nextDirty = worker->dirtyConnections;
+    worker->dirtyConnections = conn;
+  }
+}
+
+// Append to a connection's ring buffer. If it does not fit the client is too
+// far behind: the data is dropped and the client marked for disconnection.
+void queueOutput(Worker *worker, Connection *conn, const char *data, size_t len)
+{
+  if (conn->fd == -1 || conn->lagged)
+  {
+    return;
+  }
+
+  if (conn->outBuf == NULL)
+  {
+    conn->outBuf = malloc(g_outbufSize);
+    conn->outHead = 0;
+    conn->outLen = 0;
+  }
+  if (conn->outBuf == NULL || len > g_outbufSize - conn->outLen)
+  {
+    conn->lagged = 1;
+    markDirty(worker, conn);
+    return;
+  }
+
+  // Copy in up to two pieces, wrapping around the end of the ring
+  size_t tail = (conn->outHead + conn->outLen) % g_outbufSize;
+  size_t first = len < g_outbufSize - tail ? len : g_outbufSize - tail;
+  memcpy(conn->outBuf + tail, data, first);
+  memcpy(conn->outBuf, data + first, len - first);
+  conn->outLen += len;
+
+  markDirty(worker, conn);
+}
+
+/*---------------------------------------------------------------------------*
+ * io_uring backend (-U). Player sockets get one multishot receive each, which
+ * keeps delivering into buffers the kernel picks from a provided buffer ring,
+ * and their output is sent with SEND requests that are only prepared during a
+ * batch; the io_uring_enter that waits for the next batch submits all of them
+ * at once. The worker's epoll instance still carries the wake eventfd, the
+ * timers and spectators, and is itself watched by a multishot poll. The ring
+ * is driven with the raw syscalls.
+ *---------------------------------------------------------------------------*/
+enum
+{
+  RING_EPOLL,  // the worker's epoll fd has events
+  RING_RECV,   // a Connection's multishot receive
+  RING_SEND,   // a Connection's send
+  RING_CANCEL, // a cancel request; nothing to do
+  RING_TAG_MASK = 3
+};
+
+int ringSetup(unsigned entries, struct io_uring_params *params)
+{
+  return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+int ringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+  return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, NULL, 0);
+}
+
+void ringAddBuffer(Ring *ring, unsigned short bid)
+{
+  struct io_uring_buf *buf = &ring->bufRing->bufs[ring->bufTail & (RING_BUFS - 1)];
+  buf->addr = (uint64_t)(uintptr_t)(ring->bufs + (size_t)bid * RING_BUF_SIZE);
+  buf->len = RING_BUF_SIZE;
+  buf->bid = bid;
+  ring->bufTail++;
+  __atomic_store_n(&ring->bufRing->tail, ring->bufTail, __ATOMIC_RELEASE);
+}
+
+void ringClose(Ring *ring)
+{
+  if (ring->bufRing != NULL)
+  {
+    munmap(ring->bufRing, RING_BUFS * sizeof(struct io_uring_buf));
+  }
+  if (ring->sqes != NULL)
+  {
+    munmap(ring->sqes, ring->sqesSize);
+  }
+  if (ring->rings != NULL)
+  {
+    munmap(ring->rings, ring->ringsSize);
+  }
+  free(ring->bufs);
+  if (ring->fd >= 0)
+  {
+    close(ring->fd);
+  }
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+}
+
+// Set up a ring and its receive buffers. -1 if the kernel lacks what we use.
+int ringOpen(Ring *ring)
+{
+  memset(ring, 0, sizeof(*ring));
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  // Single issuer: the ring starts disabled and belongs to whichever thread
+  // enables it, which is the worker rather than main
+  params.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_R_DISABLED;
+  ring->fd = ringSetup(RING_ENTRIES, &params);
+  ring->disabled = ring->fd >= 0;
+  if (ring->fd < 0 && errno == EINVAL)
+  {
+    memset(&params, 0, sizeof(params));
+    ring->fd = ringSetup(RING_ENTRIES, &params);
+  }
+  if (ring->fd < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP))
+  {
+    ringClose(ring);
+    return -1;
+  }
+
+  // The submission and completion rings share one mapping
+  size_t sqSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  size_t cqSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  ring->ringsSize = sqSize > cqSize ? sqSize : cqSize;
+  ring->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+  char *rings = mmap(NULL, ring->ringsSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  ring->sqes = mmap(NULL, ring->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  ring->rings = rings == MAP_FAILED ? NULL : rings;
+  if (ring->rings == NULL || ring->sqes == MAP_FAILED)
+  {
+    ring->sqes = ring->sqes == MAP_FAILED ? NULL : ring->sqes;
+    ringClose(ring);
+    return -1;
+  }
+  ring->sqHead = (unsigned *)(rings + params.sq_off.head);
+  ring->sqTail = (unsigned *)(rings + params.sq_off.tail);
+  ring->sqArray = (unsigned *)(rings + params.sq_off.array);
+  ring->sqMask = *(unsigned *)(rings + params.sq_off.ring_mask);
+  ring->sqEntries = params.sq_entries;
+  ring->sqLocalTail = *ring->sqTail;
+  ring->cqHead = (unsigned *)(rings + params.cq_off.head);
+  ring->cqTail = (unsigned *)(rings + params.cq_off.tail);
+  ring->cqMask = *(unsigned *)(rings + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+
+  // Provided buffer ring (Linux 5.19+): page-aligned, so it gets its own mapping
+  void *bufRing = mmap(NULL, RING_BUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ring->bufRing = bufRing == MAP_FAILED ? NULL : bufRing;
+  ring->bufs = malloc((size_t)RING_BUFS * RING_BUF_SIZE);
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)ring->bufRing;
+  reg.ring_entries = RING_BUFS;
+  reg.bgid = 0;
+  if (ring->bufRing == NULL || ring->bufs == NULL ||
+      syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+  {
+    ringClose(ring);
+    return -1;
+  }
+  for (int bid = 0; bid < RING_BUFS; bid++)
+  {
+    ringAddBuffer(ring, bid);
+  }
+  return 0;
+}
+
+// Called from the thread that will submit to the ring
+int ringEnable(Ring *ring)
+{
+  if (ring->disabled && syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_ENABLE_RINGS, NULL, 0) < 0)
+  {
+    return -1;
+  }
+  ring->disabled = 0;
+  return 0;
+}
+
+// Publish prepared SQEs and, with wait set, block for at least one completion
+void ringSubmit(Worker *worker, int wait)
+{
+  Ring *ring = &worker->ring;
+  unsigned toSubmit = ring->sqLocalTail - *ring->sqTail;
+  if (toSubmit == 0 && !wait)
+  {
+    return;
+  }
+  __atomic_store_n(ring->sqTail, ring->sqLocalTail, __ATOMIC_RELEASE);
+
+  statAdd(&worker->metrics.counters[STAT_WAIT_CALLS], 1);
+  while (ringEnter(ring->fd, toSubmit, wait ? 1 : 0, wait ? IORING_ENTER_GETEVENTS : 0) < 0)
+  {
+    if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+    {
+      perror("io_uring_enter failed");
+      return;
+    }
+    // Anything not taken yet is still in the ring; only wait from here on
+    toSubmit = ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE);
+    if (errno == EBUSY)
+    {
+      return; // completions to reap first
+    }
+  }
+}
+
+// Next free SQE, zeroed. Submits what is pending if the queue is full.
+struct io_uring_sqe *ringGetSqe(Worker *worker)
+{
+  Ring *ring = &worker->ring;
+  if (ring->sqLocalTail - __atomic_load_n(ring->sqHead, __ATOMIC_ACQUIRE) >= ring->sqEntries)
+  {
+    ringSubmit(worker, 0);
+  }
+  unsigned index = ring->sqLocalTail & ring->sqMask;
+  struct io_uring_sqe *sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sqArray[index] = index;
+  ring->sqLocalTail++;
+  return sqe;
+}
+
+uint64_t ringTag(Connection *conn, int tag)
+{
+  return (uint64_t)(uintptr_t)conn | tag;
+}
+
+// Watch the worker's epoll fd, for everything that is not a player socket
+void ringWatchEpoll(Worker *worker)
+{
+  struct io_uring_sqe *sqe = ringGetSqe(worker);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = worker->epollFd;
+  sqe->poll32_events = POLLIN;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->user_data = RING_EPOLL;
+}
+
+// One receive that keeps completing for as long as the client sends
+void ringArmRecv(Worker *worker, Connection *conn)
+{
+  struct io_uring_sqe *sqe = ringGetSqe(worker);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = conn->fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  sqe->user_data = ringTag(conn, RING_RECV);
+  conn->ringOps++;
+}
+
+// Send everything queued in the ring buffer in one operation: a plain SEND when
+// it is contiguous, a SENDMSG gathering both pieces when it wraps. The kernel
+// waits for room itself, so a send in flight means the client is not keeping
+// up yet; with dontWait it tries once and gives up instead.
+void ringSend(Worker *worker, Connection *conn, int dontWait)
+{
+  size_t first = conn->outLen < g_outbufSize - conn->outHead ? conn->outLen : g_outbufSize - conn->outHead;
+  struct io_uring_sqe *sqe = ringGetSqe(worker);
+  sqe->fd = conn->fd;
+  if (first < conn->outLen)
+  {
+    // Wrapped: both pieces go in one SENDMSG rather than two sends
+    conn->ringIov[0].iov_base = conn->outBuf + conn->outHead;
+    conn->ringIov[0].iov_len = first;
+    conn->ringIov[1].iov_base = conn->outBuf;
+    conn->ringIov[1].iov_len = conn->outLen - first;
+    memset(&conn->ringMsg, 0, sizeof(conn->ringMsg));
+    conn->ringMsg.msg_iov = conn->ringIov;
+    conn->ringMsg.msg_iovlen = 2;
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->addr = (uint64_t)(uintptr_t)&conn->ringMsg;
+    sqe->len = 1;
+  }
+  else
+  {
+    sqe->opcode = IORING_OP_SEND;
+    sqe->addr = (uint64_t)(uintptr_t)(conn->outBuf + conn->outHead);
+    sqe->len = first;
+  }
+  size_t chunk = conn->outLen;
+  sqe->msg_flags = MSG_NOSIGNAL | (dontWait ? MSG_DONTWAIT : 0);
+  sqe->user_data = ringTag(conn, RING_SEND);
+  conn->ringOps++;
+  conn->ringSendLen = chunk;
+  statAdd(&worker->metrics.counters[STAT_RING_SENDS], 1);
+  if (!conn->blocked)
+  {
+    conn->blocked = 1;
+    conn->blockedSinceMs = nowMs();
+  }
+}
+
+// Cancel whatever is in flight on a connection's socket
+void ringCancel(Worker *worker, Connection *conn)
+{
+  if (conn->ringCancelled || conn->ringOps == 0)
+  {
+    return;
+  }
+  struct io_uring_sqe *sqe = ringGetSqe(worker);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = conn->fd;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  sqe->user_data = RING_CANCEL;
+  conn->ringCancelled = 1;
+}
+
+// About to close a ring connection's socket: one last try at its output, as
+// the epoll path does, then cancel the rest. Everything has to reach the
+// kernel before the fd is closed and its number reused.
+void ringRelease(Worker *worker, Connection *conn)
+{
+  if (conn->ringSendLen == 0 && conn->outLen > 0)
+  {
+    ringSend(worker, conn, 1);
+  }
+  ringCancel(worker, conn);
+  ringSubmit(worker, 0);
+}
+
+// Send as much queued output as the socket takes: the ring buffer, then a
+// spectator's shared frames. Returns 1 once everything is sent, 0 if the
+// socket is full (EPOLLOUT will bring us back).
+int flushOutput(Worker *worker, Connection *conn)
+{
+  // Ring sends are sent in the background; one at a time keeps them in order
+  if (conn->viaRing)
+  {
+    if (conn->ringSendLen == 0 && conn->outLen > 0)
+    {
+      ringSend(worker, conn, 0);
+    }
+    return conn->ringSendLen == 0;
+  }
+
+  Metrics *metrics = &worker->metrics;
+  while (1)
+  {
+    // Gather everything queued into one sendmsg: the ring buffer, in two
+    // pieces if it wraps, then a spectator's shared frames
+    struct iovec iov[4];
+    int pieces = 0;
+    if (conn->outLen > 0)
+    {
+      size_t first = conn->outLen < g_outbufSize - conn->outHead ? conn->outLen : g_outbufSize - conn->outHead;
+      iov[pieces].iov_base = conn->outBuf + conn->outHead;
+      iov[pieces++].iov_len = first;
+      if (first < conn->outLen)
+      {
+        iov[pieces].iov_base = conn->outBuf;
+        iov[pieces++].iov_len = conn->outLen - first;
+      }
+    }
+    if (conn->frameSending == NULL)
+    {
+      conn->frameSending = conn->framePending;
+      conn->framePending = NULL;
+      conn->frameOffset = 0;
+    }
+    if (conn->frameSending != NULL)
+    {
+      iov[pieces].iov_base = conn->frameSending->data + conn->frameOffset;
+      iov[pieces++].iov_len = conn->frameSending->len - conn->frameOffset;
+    }
+    if (conn->framePending != NULL)
+    {
+      iov[pieces].iov_base = conn->framePending->data;
+      iov[pieces++].iov_len = conn->framePending->len;
+    }
+    if (pieces == 0)
+    {
+      break;
+    }
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = iov;
+    msg.msg_iovlen = pieces;
+    ssize_t sent = sendmsg(conn->fd, &msg, MSG_NOSIGNAL);
+    statAdd(&metrics->counters[STAT_SEND_CALLS], 1);
+    if (sent < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        if (!conn->blocked)
+        {
+          conn->blocked = 1;
+          conn->blockedSinceMs = nowMs();
+        }
+        return 0;
+      }
+
+      // The peer is gone; the read side reports the disconnect
+      conn->outLen = 0;
+      releaseFrame(conn->frameSending);
+      releaseFrame(conn->framePending);
+      conn->frameSending = conn->framePending = NULL;
+      break;
+    }
+
+    // Consume what went out, in the order it was gathered
+    statAdd(&metrics->counters[STAT_BYTES_SENT], sent);
+    size_t left = sent;
+    size_t fromRing = left < conn->outLen ? left : conn->outLen;
+    conn->outHead = (conn->outHead + fromRing) % g_outbufSize;
+    conn->outLen -= fromRing;
+    left -= fromRing;
+    while (left > 0 && conn->frameSending != NULL)
+    {
+      size_t fromFrame = conn->frameSending->len - conn->frameOffset;
+      if (left < fromFrame)
+      {
+        conn->frameOffset += left;
+        break;
+      }
+      left -= fromFrame;
+      releaseFrame(conn->frameSending);
+      conn->frameSending = conn->framePending;
+      conn->framePending = NULL;
+      conn->frameOffset = 0;
+    }
+  }
+
+  conn->outHead = 0;
+  conn->blocked = 0;
+  return 1;
+}
+
+// Give a player slot back. If clients are queued for one, the acceptor is told
+// once, after the batch (see announceFreedSeats).
+void releaseSeat(Worker *worker)
+{
+  atomic_fetch_sub(&g_playerCount, 1);
+  worker->seatsFreed = 1;
+}
+
+// Close a player's socket and give their slot back. The Connection itself is
+// only marked closed here and freed at the end of the current event batch.
+void closeClientSocket(Room *room, int playerIndex)
+{
+  if (room->clientSockets[playerIndex] == -1)
+  {
+    return;
+  }
+
+  // Last-chance flush so goodbye messages ("You have died!", ...) go out
+  Connection *conn = room->connections[playerIndex];
+  if (conn != NULL && conn->viaRing)
+  {
+    ringRelease(room->worker, conn);
+  }
+  else if (conn != NULL && conn->outLen > 0)
+  {
+    flushOutput(room->worker, conn);
+  }
+
+  // Replayed, restored and bot seats have no socket behind them
+  if (room->clientSockets[playerIndex] >= 0)
+  {
+    close(room->clientSockets[playerIndex]);
+    releaseSeat(room->worker);
+  }
+  else if (room->clientSockets[playerIndex] == BOT_SOCKET)
+  {
+    room->botCount--;
+  }
+  room->clientSockets[playerIndex] = -1;
+  room->state.clientCount--;
+  atomic_fetch_add(&room->worker->openSeats, 1);
+  room->worker->seatsFreed = 1;
+
+  if (conn != NULL)
+  {
+    conn->fd = -1;
+    conn->next = room->worker->closedConnections;
+    room->worker->closedConnections = conn;
+    room->connections[playerIndex] = NULL;
+  }
+}
+
+// Function to send a message to a player via their socket
+void sendMessageToPlayer(Room *room, int playerIndex, const char *message)
+{
+  if (room->connections[playerIndex] != NULL)
+  {
+    queueOutput(room->worker, room->connections[playerIndex], message, strlen(message));
+  }
+}
+
+/*---------------------------------------------------------------------------*
+ * Call after changing a player or a shuriken: refiles it in the spatial index
+ * and queues it for the next refreshPlayerPositions().
+ *---------------------------------------------------------------------------*/
+void touchPlayer(Room *room, int i)
+{
+  const Player *player = &room->state.players[i];
+  int alive = player->active && player->hp > 0;
+  spatialMove(&room->playersByCell, i, alive ? player->x * g_map.cols + player->y : -1);
+
+  if (!room->isTouched[i])
+  {
+    room->isTouched[i] = 1;
+    room->touched[room->touchedCount++] = i;
+  }
+}
+
+void touchShuriken(Room *room, int slot)
+{
+  const ShurikenPool *pool = &room->state.shurikens;
+  int flying = pool->owner[slot] != -1;
+  spatialMove(&room->shurikensByCell, slot, flying ? pool->x[slot] * g_map.cols + pool->y[slot] : -1);
+
+  if (!room->isShurikenTouched[slot])
+  {
+    room->isShurikenTouched[slot] = 1;
+    room->touchedShurikens[room->touchedShurikenCount++] = slot;
+  }
+}
+
+// A shuriken hit a wall or a player, or went off the map: give its slot back
+void landShuriken(Room *room, int slot)
+{
+  ShurikenPool *pool = &room->state.shurikens;
+  room->state.players[pool->owner[slot]].shurikens--;
+  releaseShurikenSlot(pool, slot);
+  touchShuriken(room, slot);
+}
+
+// Take a leaving player's shurikens off the board
+void dropShurikens(Room *room, int playerIndex)
+{
+  ShurikenPool *pool = &room->state.shurikens;
+  for (int n = pool->liveCount - 1; n >= 0; n--)
+  {
+    if (pool->owner[pool->live[n]] == playerIndex)
+    {
+      landShuriken(room, pool->live[n]);
+    }
+  }
+}
+
+// Transfered logic for shuriken collision handling to helper function
+int checkShurikenCollision(Room *room, int slot)
+{
+  ShurikenPool *pool = &room->state.shurikens;
+  int hitPlayerIndex = spatialFind(&room->playersByCell, pool->x[slot] * g_map.cols + pool->y[slot], 0);
+
+  if (hitPlayerIndex != -1) // A player was hit
+  {
+    room->state.players[hitPlayerIndex].hp -= 50;
+    printf("Player %s hit by shuriken! HP reduced to %d\n", playerName(hitPlayerIndex).text, room->state.players[hitPlayerIndex].hp);
+    fflush(stdout);
+
+    // Deactivate shuriken after hitting a player
+    landShuriken(room, slot);
+
+    // Check if player's HP is 0 or less
+    if (room->state.players[hitPlayerIndex].hp <= 0)
+    {
+      printf("Player %s has been defeated!\n", playerName(hitPlayerIndex).text);
+      fflush(stdout);
+
+      // Send "You have died!" message to the player
+      const char *deathMessage = "You have died!\n";
+      sendMessageToPlayer(room, hitPlayerIndex, deathMessage);
+
+      room->state.players[hitPlayerIndex].active = 0;
+      closeClientSocket(room, hitPlayerIndex);
+    }
+    touchPlayer(room, hitPlayerIndex);
+    return 1; // Collision occurred
+  }
+  return 0; // No collision
+}
+
+// Function to rotate turns to make sure the game works on a turn by turn basis
+void rotateTurn(Room *room)
+{
+  // Real-time play has no turns
+  if (g_tickRate > 0)
+  {
+    return;
+  }
+
+  int originalTurn = room->state.currentTurn;
+
+  // Remainder obviously can't be higher than the divisor, so conveniently I can get the next turn
+  int nextTurn = (room->state.currentTurn + 1) % g_roomCapacity;
+
+  // Find the next active player
+  while (nextTurn != originalTurn)
+  {
+    if (room->state.players[nextTurn].active && room->state.players[nextTurn].hp > 0)
+    {
+      break;
+    }
+    nextTurn = (nextTurn + 1) % g_roomCapacity;
+  }
+
+  // If we looped back to the original turn and no other players are active, keep the turn
+  if (nextTurn == originalTurn && (!room->state.players[nextTurn].active || room->state.players[nextTurn].hp <= 0))
+  {
+    // No active players left, reset turn to 0 (or handle game over)
+    room->state.currentTurn = 0;
+    return;
+  }
+
+  room->state.currentTurn = nextTurn;
+  room->turnStartNs = room->turnNumber % COMMAND_SAMPLE_RATE == 0 ? nowNs() : 0;
+
+  // Notify the player whose turn it is
+  char turnMessage[BUFFER_SIZE];
+  snprintf(turnMessage, BUFFER_SIZE, "\nIt's your turn, Player %s\n", playerName(room->state.currentTurn).text);
+  sendMessageToPlayer(room, room->state.currentTurn, turnMessage);
+
+  // Notify all other players whose turn it is
+  char otherMessage[BUFFER_SIZE];
+  snprintf(otherMessage, BUFFER_SIZE, "\nIt's Player %s's turn\n", playerName(room->state.currentTurn).text);
+  for (int i = 0; i < g_roomCapacity; i++)
+  {
+    if (i != room->state.currentTurn && room->clientSockets[i] != -1)
+    {
+      sendMessageToPlayer(room, i, otherMessage);
+    }
+  }
+}
+
+// What a client sees in a cell: players over shurikens over empty floor. When
+// players share a cell, the highest index is shown (it was drawn last).
+char cellGlyph(Room *room, int x, int y)
+{
+  if (isObstacle(x, y))
+  {
+    return '#';
+  }
+  if (testCell(room->state.playerLayer, x, y))
+  {
+    int top = spatialFind(&room->playersByCell, x * g_map.cols + y, 1);
+    if (top != -1)
+    {
+      return playerGlyph(top);
+    }
+  }
+  if (testCell(room->state.shurikenLayer, x, y))
+  {
+    return '*';
+  }
+  return '.';
+}
+
+void logDeltaChange(Room *room, char kind, int row, int col);
+
+// Recompute one cell's occupancy bits from the spatial index, and record it
+// for delta clients
+void refreshCell(Room *room, int x, int y)
+{
+  if (x < 0 || x >= g_map.rows || y < 0 || y >= g_map.cols)
+  {
+    return;
+  }
+
+  int cell = x * g_map.cols + y;
+  int hasPlayer = spatialFind(&room->playersByCell, cell, 0) != -1;
+  int hasShuriken = spatialFind(&room->shurikensByCell, cell, 0) != -1;
+  setCell(room->state.playerLayer, x, y, hasPlayer);
+  setCell(room->state.shurikenLayer, x, y, hasShuriken);
+  logDeltaChange(room, 'C', x, y);
+}
+
+/*---------------------------------------------------------------------------*
+ * Refresh the grid with current player positions.
+ * Players touched since the last refresh are diffed against it; only the cells
+ * they left or entered are recomputed, so the cost depends on neither the map
+ * size nor the number of players. If anything changed, the state version is
+ * bumped and the changes are recorded in the delta log.
+ *---------------------------------------------------------------------------*/
+void refreshPlayerPositions(Room *room)
+{
+  unsigned int nextVersion = room->state.version + 1;
+
+  for (int n = 0; n < room->touchedCount; n++)
+  {
+    int i = room->touched[n];
+    room->isTouched[i] = 0;
+
+    const Player *now = &room->state.players[i];
+    const Player *then = &room->publishedPlayers[i];
+
+    if (now->active == then->active && now->x == then->x && now->y == then->y && now->hp == then->hp)
+    {
+      continue;
+    }
+
+    // Changes are logged under the version they will be published as
+    room->state.version = nextVersion;
+    refreshCell(room, then->x, then->y);
+    refreshCell(room, now->x, now->y);
+    logDeltaChange(room, 'P', i, 0);
+    room->publishedPlayers[i] = *now;
+  }
+  room->touchedCount = 0;
+
+  const ShurikenPool *pool = &room->state.shurikens;
+  for (int n = 0; n < room->touchedShurikenCount; n++)
+  {
+    int slot = room->touchedShurikens[n];
+    room->isShurikenTouched[slot] = 0;
+
+    Shuriken now = {pool->x[slot], pool->y[slot], pool->owner[slot] != -1};
+    Shuriken *then = &room->publishedShurikens[slot];
+    if (now.active == then->active && now.x == then->x && now.y == then->y)
+    {
+      continue;
+    }
+
+    room->state.version = nextVersion;
+    refreshCell(room, then->x, then->y);
+    refreshCell(room, now.x, now.y);
+    logDeltaChange(room, 'S', slot, 0);
+    *then = now;
+  }
+  room->touchedShurikenCount = 0;
+}
+
+/*---------------------------------------------------------------------------*
+ * State encoder: appends into a fixed buffer through a moving cursor, so every
+ * byte is written once and nothing ever rescans the output with strlen().
+ * Appends that do not fit are dropped and flag the encoder as overflowed; the
+ * buffer always stays '\0'-terminated.
+ *---------------------------------------------------------------------------*/
+typedef struct
+{
+  char *buf;
+  size_t cap;   // size of buf, including room for the terminating '\0'
+  size_t len;   // bytes written so far
+  int overflow; // 1 once an append did not fit
+} Encoder;
+
+void encInit(Encoder *enc, char *buf, size_t cap)
+{
+  enc->buf = buf;
+  enc->cap = cap;
+  enc->len = 0;
+  enc->overflow = 0;
+  buf[0] = '\0';
+}
+
+void encPutBytes(Encoder *enc, const char *data, size_t n)
+{
+  if (enc->overflow || n >= enc->cap - enc->len)
+  {
+    enc->overflow = 1;
+    return;
+  }
+  memcpy(enc->buf + enc->len, data, n);
+  enc->len += n;
+  enc->buf[enc->len] = '\0';
+}
+
+// Claim n bytes to fill in directly; NULL (and overflow) if they do not fit
+char *encReserve(Encoder *enc, size_t n)
+{
+  if (enc->overflow || n >= enc->cap - enc->len)
+  {
+    enc->overflow = 1;
+    return NULL;
+  }
+  char *out = enc->buf + enc->len;
+  enc->len += n;
+  enc->buf[enc->len] = '\0';
+  return out;
+}
+
+void encPutChar(Encoder *enc, char c)
+{
+  encPutBytes(enc, &c, 1);
+}
+
+void encPutStr(Encoder *enc, const char *str)
+{
+  encPutBytes(enc, str, strlen(str));
+}
+
+// Decimal without going through printf
+void encPutInt(Encoder *enc, int value)
+{
+  char digits[12];
+  int pos = sizeof(digits);
+  unsigned int v = value < 0 ? 0u - (unsigned int)value : (unsigned int)value;
+
+  do
+  {
+    digits[--pos] = '0' + v % 10;
+    v /= 10;
+  } while (v != 0);
+
+  if (value < 0)
+  {
+    digits[--pos] = '-';
+  }
+  encPutBytes(enc, digits + pos, sizeof(digits) - pos);
+}
+
+/*---------------------------------------------------------------------------*
+ * Render the map, one text row per grid row. Rows are filled with '.', then
+ * only the set bits of the obstacle and shuriken layers are visited, and the
+ * players are written over the top at their offsets.
+ *---------------------------------------------------------------------------*/
+void encPutGridRows(Encoder *enc, Room *room)
+{
+  size_t lineLen = g_map.cols + 1;
+  char *grid = encReserve(enc, (size_t)g_map.rows * lineLen);
+  if (grid == NULL)
+  {
+    return;
+  }
+
+  for (int r = 0; r < g_map.rows; r++)
+  {
+    char *line = grid + r * lineLen;
+    memset(line, '.', g_map.cols);
+    line[g_map.cols] = '\n';
+
+    const uint64_t *walls = g_map.obstacles + (size_t)r * g_map.wordsPerRow;
+    const uint64_t *shurikens = room->state.shurikenLayer + (size_t)r * g_map.wordsPerRow;
+    for (int w = 0; w < g_map.wordsPerRow; w++)
+    {
+      uint64_t bits = walls[w] | shurikens[w];
+      while (bits != 0)
+      {
+        int c = w * 64 + __builtin_ctzll(bits);
+        line[c] = (walls[w] >> (c & 63)) & 1 ? '#' : '*';
+        bits &= bits - 1;
+      }
+    }
+  }
+
+  for (int i = 0; i < g_roomCapacity; i++)
+  {
+    const Player *player = &room->state.players[i];
+    if (player->active && player->hp > 0)
+    {
+      grid[player->x * lineLen + player->y] = playerGlyph(i);
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------*
+ * Build a string that represents the current game state (ASCII grid),
+ *       which you can send to all clients.
+ * Returns the frame length, or -1 if it did not fit in outCapacity bytes.
+ *---------------------------------------------------------------------------*/
+int buildStateString(Room *room, char *outBuffer, size_t outCapacity)
+{
+  Encoder enc;
+  encInit(&enc, outBuffer, outCapacity);
+
+  // e.g., prefix with "STATE\n", then rows of the grid, then player info
+  encPutStr(&enc, "\nSTATE:\n\n");
+
+  encPutGridRows(&enc, room);
+
+  encPutStr(&enc, "\nACTIVE PLAYER INFO (IF EXISTS)\n");
+  for (int i = 0; i < g_roomCapacity; i++)
+  {
+    // Check for active players
+    const Player *active_player = &room->state.players[i];
+    if (active_player->active != 1)
+    {
+      continue;
+    }
+
+    encPutStr(&enc, "Player ");
+    encPutInt(&enc, i);
+    encPutStr(&enc, "\nPlayer position: (");
+    encPutInt(&enc, active_player->x);
+    encPutStr(&enc, ", ");
+    encPutInt(&enc, active_player->y);
+    encPutStr(&enc, ")\nPlayer health points ");
+    encPutInt(&enc, active_player->hp);
+    encPutChar(&enc, '\n');
+  }
+
+  return enc.overflow ? -1 : (int)enc.len;
+}
+
+/*---------------------------------------------------------------------------*
+ * Delta protocol. Clients that send DELTA get versioned frames instead of the
+ * full STATE text:
+ *
+ *   KEY <version> <rows> <cols>        DELTA <base> <version>
+ *   <grid rows>                        C <row> <col> <char>
+ *   P <i> <active> <x> <y> <hp>        P <i> <active> <x> <y> <hp>
+ *   S <i> <active> <x> <y>             S <i> <active> <x> <y>
+ *   END                                END
+ *
+ * A DELTA carries everything that changed after <base>, the last version the
+ * client acknowledged with "ACK <version>". Every entry is an absolute value,
+ * so applying a delta on top of any version >= base yields <version>.
+ *---------------------------------------------------------------------------*/
+
+void logDeltaChange(Room *room, char kind, int row, int col)
+{
+  DeltaChange *slot = &room->deltaLog[room->deltaCount % DELTA_LOG_SIZE];
+
+  // Overwriting the oldest entry loses part of its version's changes
+  if (room->deltaCount >= DELTA_LOG_SIZE)
+  {
+    room->deltaFloor = slot->version;
+  }
+
+  slot->version = room->state.version;
+  slot->kind = kind;
+  slot->row = row;
+  slot->col = col;
+  room->deltaCount++;
+}
+
+void encPutPlayerFields(Encoder *enc, Room *room, int i)
+{
+  const Player *player = &room->state.players[i];
+  encPutStr(enc, "P ");
+  encPutInt(enc, i);
+  encPutChar(enc, ' ');
+  encPutInt(enc, player->active);
+  encPutChar(enc, ' ');
+  encPutInt(enc, player->x);
+  encPutChar(enc, ' ');
+  encPutInt(enc, player->y);
+  encPutChar(enc, ' ');
+  encPutInt(enc, player->hp);
+  encPutChar(enc, '\n');
+}
+
+void encPutShurikenFields(Encoder *enc, Room *room, int slot)
+{
+  const ShurikenPool *pool = &room->state.shurikens;
+  encPutStr(enc, "S ");
+  encPutInt(enc, slot);
+  encPutChar(enc, ' ');
+  encPutInt(enc, pool->owner[slot] != -1);
+  encPutChar(enc, ' ');
+  encPutInt(enc, pool->x[slot]);
+  encPutChar(enc, ' ');
+  encPutInt(enc, pool->y[slot]);
+  encPutChar(enc, '\n');
+}
+
+int buildKeyFrame(Room *room, char *outBuffer, size_t outCapacity)
+{
+  Encoder enc;
+  encInit(&enc, outBuffer, outCapacity);
+
+  encPutStr(&enc, "KEY ");
+  encPutInt(&enc, room->state.version);
+  encPutChar(&enc, ' ');
+  encPutInt(&enc, g_map.rows);
+  encPutChar(&enc, ' ');
+  encPutInt(&enc, g_map.cols);
+  encPutChar(&enc, '\n');
+
+  encPutGridRows(&enc, room);
+  for (int i = 0; i < g_roomCapacity; i++)
+  {
+    if (room->state.players[i].active)
+    {
+      encPutPlayerFields(&enc, room, i);
+    }
+  }
+  for (int n = 0; n < room->state.shurikens.liveCount; n++)
+  {
+    encPutShurikenFields(&enc, room, room->state.shurikens.live[n]);
+  }
+  encPutStr(&enc, "END\n");
+
+  return enc.overflow ? -1 : (int)enc.len;
+}
+
+// Returns -1 if the changes since baseVersion are no longer all in the log,
+// or if they do not fit in the buffer; the caller sends a keyframe instead
+int buildDeltaFrame(Room *room, unsigned int baseVersion, char *outBuffer, size_t outCapacity)
+{
+  if (baseVersion < room->deltaFloor)
+  {
+    return -1;
+  }
+
+  Encoder enc;
+  encInit(&enc, outBuffer, outCapacity);
+
+  encPutStr(&enc, "DELTA ");
+  encPutInt(&enc, baseVersion);
+  encPutChar(&enc, ' ');
+  encPutInt(&enc, room->state.version);
+  encPutChar(&enc, '\n');
+
+  // Walk back to the first entry newer than the base, then emit forwards
+  unsigned long first = room->deltaCount;
+  unsigned long oldest = room->deltaCount > DELTA_LOG_SIZE ? room->deltaCount - DELTA_LOG_SIZE : 0;
+  while (first > oldest && room->deltaLog[(first - 1) % DELTA_LOG_SIZE].version > baseVersion)
+  {
+    first--;
+  }
+
+  // Something that changed several times is sent once: sentMark[i] for
+  // player i (then one per shuriken slot, then one per grid cell) is set to
+  // this frame's stamp
+  unsigned int *cellMark = room->sentMark + g_roomCapacity + room->state.shurikens.capacity;
+  unsigned int stamp = ++room->sentStamp;
+  if (stamp == 0)
+  {
+    size_t marks = g_roomCapacity + room->state.shurikens.capacity + (size_t)g_map.rows * g_map.cols;
+    memset(room->sentMark, 0, marks * sizeof(unsigned int));
+    stamp = room->sentStamp = 1;
+  }
+  for (unsigned long n = first; n < room->deltaCount; n++)
+  {
+    const DeltaChange *change = &room->deltaLog[n % DELTA_LOG_SIZE];
+    if (change->kind == 'C' && cellMark[(long)change->row * g_map.cols + change->col] != stamp)
+    {
+      cellMark[(long)change->row * g_map.cols + change->col] = stamp;
+      encPutStr(&enc, "C ");
+      encPutInt(&enc, change->row);
+      encPutChar(&enc, ' ');
+      encPutInt(&enc, change->col);
+      encPutChar(&enc, ' ');
+      encPutChar(&enc, cellGlyph(room, change->row, change->col));
+      encPutChar(&enc, '\n');
+    }
+    else if (change->kind == 'P' && room->sentMark[change->row] != stamp)
+    {
+      room->sentMark[change->row] = stamp;
+      encPutPlayerFields(&enc, room, change->row);
+    }
+    else if (change->kind == 'S' && room->sentMark[g_roomCapacity + change->row] != stamp)
+    {
+      room->sentMark[g_roomCapacity + change->row] = stamp;
+      encPutShurikenFields(&enc, room, change->row);
+    }
+  }
+  encPutStr(&enc, "END\n");
+
+  return enc.overflow ? -1 : (int)enc.len;
+}
+
+/*---------------------------------------------------------------------------*
+ * Frame cache. Each room keeps the last STATE, KEY and DELTA frame it built,
+ * tagged with the state version (and for a DELTA its base). A frame is only
+ * encoded when the state changed since, so repeated broadcasts, clients
+ * catching up and new joiners reuse the cached bytes.
+ *---------------------------------------------------------------------------*/
+typedef int (*FrameBuilder)(Room *room, char *outBuffer, size_t outCapacity);
+
+// Copy len encoded bytes into a new frame for the room's current version,
+// held by *cache in place of the frame it had
+SharedFrame *cacheFrame(Room *room, SharedFrame **cache, const char *encoded, int len)
+{
+  SharedFrame *frame = malloc(sizeof(SharedFrame) + len);
+  if (frame == NULL)
+  {
+    return NULL;
+  }
+  frame->refs = 1; // the room's own reference
+  frame->version = room->state.version;
+  frame->len = len;
+  memcpy(frame->data, encoded, len);
+
+  releaseFrame(*cache);
+  *cache = frame;
+  statAdd(&room->worker->metrics.counters[STAT_FRAMES_BUILT], 1);
+  return frame;
+}
+
+// The frame build makes of the room's current version. Returns NULL if it
+// does not fit in g_frameBound.
+SharedFrame *cachedFrame(Room *room, SharedFrame **cache, FrameBuilder build)
+{
+  if (*cache != NULL && (*cache)->version == room->state.version)
+  {
+    statAdd(&room->worker->metrics.counters[STAT_FRAMES_REUSED], 1);
+    return *cache;
+  }
+
+  char *buffer = room->worker->stateFrame;
+  int frameLen = build(room, buffer, g_frameBound);
+  return frameLen < 0 ? NULL : cacheFrame(room, cache, buffer, frameLen);
+}
+
+// A DELTA from base to the current version. Delta clients that acknowledge in
+// step all want the same one. Returns NULL if base is too old for a delta.
+SharedFrame *cachedDeltaFrame(Room *room, unsigned int base)
+{
+  SharedFrame *cached = room->deltaFrame;
+  if (cached != NULL && cached->version == room->state.version && room->deltaBase == base)
+  {
+    statAdd(&room->worker->metrics.counters[STAT_FRAMES_REUSED], 1);
+    return cached;
+  }
+
+  char *buffer = room->worker->deltaFrame;
+  int frameLen = buildDeltaFrame(room, base, buffer, g_frameBound);
+  if (frameLen < 0)
+  {
+    return NULL;
+  }
+  room->deltaBase = base;
+  return cacheFrame(room, &room->deltaFrame, buffer, frameLen);
+}
+
+/*---------------------------------------------------------------------------*
+ * Send a delta-mode client whatever it is missing: a DELTA since its last
+ * ACK, or a keyframe if it never had one, is too far behind, or is due one.
+ *---------------------------------------------------------------------------*/
+void sendDeltaFrame(Room *room, Connection *conn)
+{
+  if (conn->sentVersion == room->state.version && conn->keyVersion != 0)
+  {
+    return; // Nothing new since the last frame
+  }
+
+  SharedFrame *frame = NULL;
+
+  if (conn->keyVersion != 0 && room->state.version - conn->keyVersion < KEYFRAME_INTERVAL)
+  {
+    frame = cachedDeltaFrame(room, conn->ackedVersion);
+  }
+  if (frame == NULL)
+  {
+    frame = cachedFrame(room, &room->keyFrame, buildKeyFrame);
+    conn->keyVersion = room->state.version;
+  }
+  if (frame == NULL)
+  {
+    fprintf(stderr, "Room %d: keyframe does not fit in %zu bytes\n", room->id, g_frameBound);
+    return;
+  }
+
+  conn->sentVersion = room->state.version;
+  queueOutput(room->worker, conn, frame->data, frame->len);
+}
+
+/*---------------------------------------------------------------------------*
+ * BINARY, DELTA and ACK switch a connection's protocol mode and can be sent
+ * at any time, turn or not. Returns 1 if cmd was one of them.
+ *---------------------------------------------------------------------------*/
+int handleProtocolCommand(Connection *conn, const char *cmd)
+{
+  if (strcmp(cmd, "BINARY") == 0)
+  {
+    conn->binaryMode = 1;
+    const char *binaryMsg = "BINARY\n";
+    queueOutput(conn->room->worker, conn, binaryMsg, strlen(binaryMsg));
+    return 1;
+  }
+
+  if (strcmp(cmd, "DELTA") == 0)
+  {
+    conn->deltaMode = 1;
+    conn->ackedVersion = 0;
+    conn->keyVersion = 0; // Start with a keyframe
+    refreshPlayerPositions(conn->room);
+    sendDeltaFrame(conn->room, conn);
+    return 1;
+  }
+
+  if (strncmp(cmd, "ACK ", 4) == 0)
+  {
+    unsigned long version = strtoul(cmd + 4, NULL, 10);
+    // Clients can only acknowledge versions they were actually sent
+    if (version > conn->ackedVersion && version <= conn->sentVersion)
+    {
+      conn->ackedVersion = version;
+    }
+    return 1;
+  }
+
+  return 0;
+}
+
+/*---------------------------------------------------------------------------*
+ * Spectator frames. Every spectator's queue takes a reference to the room's
+ * cached STATE frame instead of a copy. A spectator that is still sending an
+ * older frame has its pending one replaced, so a slow watcher skips frames
+ * instead of queueing them.
+ *---------------------------------------------------------------------------*/
+void queueSharedFrame(Worker *worker, Connection *conn, SharedFrame *frame)
+{
+  if (conn->fd == -1 || conn->lagged || conn->framePending == frame || conn->frameSending == frame)
+  {
+    return;
+  }
+  releaseFrame(conn->framePending);
+  frame->refs++;
+  conn->framePending = frame;
+  markDirty(worker, conn);
+}
+
+/*---------------------------------------------------------------------------*
+ * Broadcast the current game state to all connected clients
+ *---------------------------------------------------------------------------*/
+void broadcastState(Room *room)
+{
+  SharedFrame *frame = NULL; // the full STATE text is only looked up if someone needs it
+  int looked = 0;
+  size_t queued = 0;
+
+  // queue buffer for each active client
+  for (int i = 0; i < g_roomCapacity; i++)
+  {
+    Connection *conn = room->connections[i];
+
+    // Checking for valid sockets
+    if (conn == NULL)
+    {
+      continue;
+    }
+
+    // A client that is not keeping up only gets the latest state once its
+    // socket drains; frames in between are coalesced away. The same goes for
+    // a client that already has a frame waiting for this batch's flush, as
+    // happens when a crowded room sees many joins at once.
+    if (conn->blocked || conn->outLen > g_frameBound)
+    {
+      conn->stateStale = 1;
+      continue;
+    }
+
+    size_t before = conn->outLen;
+    if (conn->deltaMode)
+    {
+      sendDeltaFrame(room, conn);
+      queued += conn->outLen - before;
+      continue;
+    }
+
+    if (!looked)
+    {
+      frame = cachedFrame(room, &room->stateFrame, buildStateString);
+      looked = 1;
+      if (frame == NULL)
+      {
+        fprintf(stderr, "Room %d: state frame does not fit in %zu bytes\n", room->id, g_frameBound);
+      }
+    }
+    if (frame == NULL)
+    {
+      continue;
+    }
+
+    queueOutput(room->worker, conn, frame->data, frame->len);
+    queued += conn->outLen - before;
+  }
+
+  if (room->spectatorCount > 0)
+  {
+    if (!looked)
+    {
+      frame = cachedFrame(room, &room->stateFrame, buildStateString);
+    }
+    for (int n = 0; frame != NULL && n < room->spectatorCount; n++)
+    {
+      queueSharedFrame(room->worker, room->spectators[n], frame);
+    }
+  }
+
+  Metrics *metrics = &room->worker->metrics;
+  statAdd(&metrics->counters[STAT_BROADCASTS], 1);
+  statAdd(&metrics->counters[STAT_BROADCAST_BYTES], queued);
+  histRecord(&metrics->histograms[HIST_BROADCAST_BYTES], queued);
+}
+
+// Queue the current state for one client that skipped frames while blocked
+void sendLatestState(Room *room, Connection *conn)
+{
+  // Publish anything still pending so the cached frame is the whole state
+  refreshPlayerPositions(room);
+  if (conn->deltaMode)
+  {
+    sendDeltaFrame(room, conn);
+    return;
+  }
+
+  SharedFrame *frame = cachedFrame(room, &room->stateFrame, buildStateString);
+  if (frame != NULL)
+  {
+    queueOutput(room->worker, conn, frame->data, frame->len);
+  }
+}
+
+/*---------------------------------------------------------------------------*
+ * Match journal. Workers append records to their room's buffer and hand full
+ * buffers to one journal thread, which does all the file I/O, so a slow disk
+ * never holds up a game. The worker timer hands over partial buffers once a
+ * second, which bounds how much a crash can lose.
+ *---------------------------------------------------------------------------*/
+pthread_mutex_t g_journalMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_journalReady = PTHREAD_COND_INITIALIZER;
+JournalChunk *g_journalQueue; // FIFO, oldest first
+JournalChunk **g_journalTail = &g_journalQueue;
+
+int64_t realtimeNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// Hand the room's buffered records to the journal thread
+void submitJournal(Room *room, int last)
+{
+  if (room->journal == NULL || (room->journalLen == 0 && !last))
+  {
+    return;
+  }
+
+  JournalChunk *chunk = malloc(sizeof(JournalChunk));
+  if (chunk == NULL)
+  {
+    return; // Keep buffering; the next submit tries again
+  }
+  chunk->journal = room->journal;
+  chunk->data = room->journalBuf;
+  chunk->len = room->journalLen;
+  chunk->last = last;
+  chunk->next = NULL;
+
+  room->journalBuf = last ? NULL : malloc(JOURNAL_CHUNK_SIZE);
+  room->journalLen = 0;
+  if (last || room->journalBuf == NULL)
+  {
+    room->journal = NULL; // Nothing more can be recorded for this match
+  }
+
+  pthread_mutex_lock(&g_journalMutex);
+  *g_journalTail = chunk;
+  g_journalTail = &chunk->next;
+  pthread_cond_signal(&g_journalReady);
+  pthread_mutex_unlock(&g_journalMutex);
+}
+
+void journalAppend(Room *room, char kind, int playerIndex, const char *text)
+{
+  if (room->journal == NULL)
+  {
+    return;
+  }
+
+  size_t len = text ? strlen(text) : 0;
+  if (len > UINT8_MAX)
+  {
+    len = UINT8_MAX; // Longer than any command the input buffer lets through
+  }
+  if (room->journalLen + sizeof(JournalRecord) + len > JOURNAL_CHUNK_SIZE)
+  {
+    submitJournal(room, 0);
+    if (room->journal == NULL)
+    {
+      return;
+    }
+  }
+
+  JournalRecord record;
+  record.timeNs = realtimeNs();
+  record.turn = room->turnNumber;
+  record.player = playerIndex;
+  record.kind = kind;
+  record.length = len;
+  memcpy(room->journalBuf + room->journalLen, &record, sizeof(record));
+  memcpy(room->journalBuf + room->journalLen + sizeof(record), text, len);
+  room->journalLen += sizeof(record) + len;
+}
+
+// Start a journal for a new room; the header is its first bytes
+void openJournal(Room *room)
+{
+  if (g_journalDir == NULL)
+  {
+    return;
+  }
+
+  Journal *journal = malloc(sizeof(Journal));
+  room->journalBuf = malloc(JOURNAL_CHUNK_SIZE);
+  if (journal == NULL || room->journalBuf == NULL)
+  {
+    free(journal);
+    free(room->journalBuf);
+    room->journalBuf = NULL;
+    return;
+  }
+
+  JournalHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, "BGJ2", 4);
+  header.roomId = room->id;
+  header.rows = g_map.rows;
+  header.cols = g_map.cols;
+  header.roomCapacity = g_roomCapacity;
+  header.maxShurikens = g_maxShurikens;
+  header.tickRate = g_tickRate;
+  header.mapHash = mapHash();
+  header.startNs = realtimeNs();
+
+  snprintf(journal->path, sizeof(journal->path), "%s/match-%lld-%d-%d.bgj", g_journalDir,
+           (long long)(header.startNs / 1000000000LL), (int)getpid(), room->id);
+  journal->fd = -1;
+
+  memcpy(room->journalBuf, &header, sizeof(header));
+  room->journalLen = sizeof(header);
+  room->journal = journal;
+}
+
+void *journalMain(void *arg)
+{
+  (void)arg;
+  while (1)
+  {
+    pthread_mutex_lock(&g_journalMutex);
+    while (g_journalQueue == NULL)
+    {
+      pthread_cond_wait(&g_journalReady, &g_journalMutex);
+    }
+    JournalChunk *chunks = g_journalQueue;
+    g_journalQueue = NULL;
+    g_journalTail = &g_journalQueue;
+    pthread_mutex_unlock(&g_journalMutex);
+
+    while (chunks != NULL)
+    {
+      JournalChunk *chunk = chunks;
+      chunks = chunk->next;
+      Journal *journal = chunk->journal;
+
+      if (journal->fd == -1)
+      {
+        journal->fd = open(journal->path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+        if (journal->fd < 0)
+        {
+          perror(journal->path);
+          journal->fd = -2; // Don't retry for every chunk
+        }
+      }
+      for (size_t done = 0; journal->fd >= 0 && done < chunk->len;)
+      {
+        ssize_t n = write(journal->fd, chunk->data + done, chunk->len - done);
+        if (n < 0 && errno == EINTR)
+        {
+          continue;
+        }
+        if (n <= 0)
+        {
+          perror(journal->path);
+          break;
+        }
+        done += n;
+      }
+
+      if (chunk->last)
+      {
+        if (journal->fd >= 0)
+        {
+          close(journal->fd);
+        }
+        free(journal);
+      }
+      free(chunk->data);
+      free(chunk);
+    }
+  }
+  return NULL;
+}
+
+/*---------------------------------------------------------------------------*
+ * Game rules, shared by turn-based play (handleCommand) and real-time ticks
+ * (runRoomTick): commands are parsed into an Action, shurikens advance one
+ * cell, then actions are applied.
+ *---------------------------------------------------------------------------*/
+// Indexed by DIR_UP, DIR_DOWN, DIR_LEFT and DIR_RIGHT
+const signed char g_dirDx[4] = {-1, 1, 0, 0};
+const signed char g_dirDy[4] = {0, 0, -1, 1};
+const char *const g_dirNames[4] = {"UP", "DOWN", "LEFT", "RIGHT"};
+
+Action parseAction(const char *cmd)
+{
+  Action action = {'?', 0, 0};
+  if (strncmp(cmd, "MOVE", 4) == 0)
+  {
+    action.verb = 'M';
+  }
+  else if (strncmp(cmd, "ATTACK", 6) == 0)
+  {
+    action.verb = 'A';
+  }
+  else if (strncmp(cmd, "QUIT", 4) == 0)
+  {
+    action.verb = 'Q';
+    return action;
+  }
+  else
+  {
+    return action;
+  }
+
+  for (int dir = DIR_UP; dir <= DIR_RIGHT; dir++)
+  {
+    if (strstr(cmd, g_dirNames[dir]))
+    {
+      action.dx = g_dirDx[dir];
+      action.dy = g_dirDy[dir];
+      break;
+    }
+  }
+  return action;
+}
+
+// The command parseAction reads back as this action, for the journal
+void actionText(Action action, char *out, size_t size)
+{
+  const char *verb = action.verb == 'M' ? "MOVE" : action.verb == 'A' ? "ATTACK" : "QUIT";
+  for (int dir = DIR_UP; dir <= DIR_RIGHT && action.verb != 'Q'; dir++)
+  {
+    if (action.dx == g_dirDx[dir] && action.dy == g_dirDy[dir])
+    {
+      snprintf(out, size, "%s %s", verb, g_dirNames[dir]);
+      return;
+    }
+  }
+  snprintf(out, size, "%s", verb);
+}
+
+// Move all active shurikens and check for collisions
+void advanceShurikens(Room *room)
+{
+  ShurikenPool *pool = &room->state.shurikens;
+  stepShurikens(pool);
+
+  // Walked backwards: a shuriken that lands is swapped out of the live list
+  // for one that has already been handled
+  for (int n = pool->liveCount - 1; n >= 0; n--)
+  {
+    int slot = pool->live[n];
+    if (!pool->step[slot])
+    {
+      pool->step[slot] = 1; // Thrown last turn, starts moving from the next one
+      continue;
+    }
+
+    if (pool->landed[slot])
+    {
+      landShuriken(room, slot);
+      continue;
+    }
+
+    touchShuriken(room, slot);
+    checkShurikenCollision(room, slot);
+  }
+}
+
+// Apply one player's action. Returns 0 if it was refused (an ATTACK with every
+// shuriken already in the air), which does not use up the player's turn. The
+// caller refreshes and broadcasts.
+int applyAction(Room *room, int playerIndex, Action action)
+{
+  Player *player = &room->state.players[playerIndex];
+
+  if (action.verb == 'M')
+  {
+    int nx = player->x + action.dx;
+    int ny = player->y + action.dy;
+    if (nx >= 0 && nx < g_map.rows && ny >= 0 && ny < g_map.cols && !isObstacle(nx, ny))
+    {
+      player->x = nx;
+      player->y = ny;
+    }
+    touchPlayer(room, playerIndex);
+  }
+  else if (action.verb == 'A')
+  {
+    if (player->shurikens >= g_maxShurikens)
+    {
+      return 0;
+    }
+
+    int tx = player->x + action.dx;
+    int ty = player->y + action.dy;
+    if (tx >= 0 && tx < g_map.rows && ty >= 0 && ty < g_map.cols && !isObstacle(tx, ty))
+    {
+      // Cannot fail: the pool holds g_maxShurikens for every player slot
+      ShurikenPool *pool = &room->state.shurikens;
+      int slot = takeShurikenSlot(pool);
+      pool->x[slot] = tx;
+      pool->y[slot] = ty;
+      pool->dx[slot] = action.dx;
+      pool->dy[slot] = action.dy;
+      pool->step[slot] = 0;
+      pool->owner[slot] = playerIndex;
+      player->shurikens++;
+      touchShuriken(room, slot);
+
+      checkShurikenCollision(room, slot);
+    }
+  }
+  else if (action.verb == 'Q')
+  {
+    // Notify the player they are quitting
+    const char *quitMessage = "\nhYou have quit the game.\n";
+    sendMessageToPlayer(room, playerIndex, quitMessage);
+
+    // Notify other players that this player has quit
+    char otherMessage[BUFFER_SIZE];
+    snprintf(otherMessage, BUFFER_SIZE, "\nPlayer %s has quit the game.\n", playerName(playerIndex).text);
+    for (int i = 0; i < g_roomCapacity; i++)
+    {
+      if (i != playerIndex && room->clientSockets[i] != -1)
+      {
+        sendMessageToPlayer(room, i, otherMessage);
+      }
+    }
+
+    // Reset the player's state
+    dropShurikens(room, playerIndex);
+    resetPlayerState(room, playerIndex);
+    touchPlayer(room, playerIndex);
+
+    // Close their socket
+    closeClientSocket(room, playerIndex);
+  }
+  return 1;
+}
+
+/*---------------------------------------------------------------------------*
+ * Handle a client command: MOVE, ATTACK, QUIT, etc.
+ *---------------------------------------------------------------------------*/
+// Run a command in turn-based play. cmd is its text form, for the journal.
+void handleAction(Room *room, int playerIndex, Action action, const char *cmd)
+{
+  // Check if it's the player's turn
+  if (playerIndex != room->state.currentTurn)
+  {
+    const char *notYourTurnMsg = "Sorry, it's not your turn\n";
+    sendMessageToPlayer(room, playerIndex, notYourTurnMsg);
+    return;
+  }
+
+  journalAppend(room, 'C', playerIndex, cmd);
+  room->turnNumber++;
+  if (room->turnStartNs != 0)
+  {
+    histRecord(&room->worker->metrics.histograms[HIST_TURN_NS], nowNs() - room->turnStartNs);
+    room->turnStartNs = 0;
+  }
+
+  // Shurikens move before the player's action
+  advanceShurikens(room);
+  if (!applyAction(room, playerIndex, action))
+  {
+    return;
+  }
+
+  // Refresh positions and broadcast
+  refreshPlayerPositions(room);
+  broadcastState(room);
+
+  // Rotate the turn to the next player
+  rotateTurn(room);
+}
+
+void handleCommand(Room *room, int playerIndex, const char *cmd)
+{
+  handleAction(room, playerIndex, parseAction(cmd), cmd);
+}
+
+/*---------------------------------------------------------------------------*
+ * Server-side bots (-a). A bot decides with an alpha-beta search over a small
+ * copy of its room: itself, its nearest opponents and the shurikens nearest
+ * to it, with every opponent assumed to play against it. The copy follows
+ * the rules of advanceShurikens and applyAction, but checks moves and flights
+ * against precomputed rays instead of the map, and positions already searched
+ * are kept in a per-worker transposition table. The search deepens until the
+ * bot's share of BOT_ROUND_BUDGET_NS is spent, and the command it settles on
+ * is then played like any client's, through parseAction and handleAction.
+ *---------------------------------------------------------------------------*/
+// cell * 4 + direction -> open cells in a row from there, which is how far a
+// shuriken flies before it lands; 0 means the neighbour is blocked
+uint16_t *g_rays;
+
+int buildRayTables(void)
+{
+  if (g_rays != NULL)
+  {
+    return 0;
+  }
+  long cells = (long)g_map.rows * g_map.cols;
+  if (cells > BOT_MAX_CELLS)
+  {
+    fprintf(stderr, "Bots need a map of at most %d cells\n", BOT_MAX_CELLS);
+    return -1;
+  }
+  g_rays = malloc(cells * 4 * sizeof(uint16_t));
+  if (g_rays == NULL)
+  {
+    perror("malloc failed");
+    return -1;
+  }
+
+  // Each ray is one longer than its neighbour's in the same direction, so
+  // every row and column is filled in by one sweep each way
+  int cols = g_map.cols;
+  for (int x = 0; x < g_map.rows; x++)
+  {
+    for (int y = 0; y < cols; y++)
+    {
+      g_rays[((long)x * cols + y) * 4 + 2] = y > 0 && !isObstacle(x, y - 1) ? g_rays[((long)x * cols + y - 1) * 4 + 2] + 1 : 0;
+    }
+    for (int y = cols - 1; y >= 0; y--)
+    {
+      g_rays[((long)x * cols + y) * 4 + 3] = y < cols - 1 && !isObstacle(x, y + 1) ? g_rays[((long)x * cols + y + 1) * 4 + 3] + 1 : 0;
+    }
+  }
+  for (int y = 0; y < cols; y++)
+  {
+    for (int x = 0; x < g_map.rows; x++)
+    {
+      g_rays[((long)x * cols + y) * 4 + 0] = x > 0 && !isObstacle(x - 1, y) ? g_rays[((long)(x - 1) * cols + y) * 4 + 0] + 1 : 0;
+    }
+    for (int x = g_map.rows - 1; x >= 0; x--)
+    {
+      g_rays[((long)x * cols + y) * 4 + 1] = x < g_map.rows - 1 && !isObstacle(x + 1, y) ? g_rays[((long)(x + 1) * cols + y) * 4 + 1] + 1 : 0;
+    }
+  }
+  return 0;
+}
+
+/* What a search looks at. Seat 0 is the bot, the others follow in turn order. */
+typedef struct
+{
+  int cell[BOT_SEATS]; // row * cols + col; dead players keep their last cell
+  short hp[BOT_SEATS];
+  unsigned char thrown[BOT_SEATS]; // shurikens in flight
+  int shCell[BOT_SHURIKENS];
+  unsigned short shRange[BOT_SHURIKENS]; // cells it still flies before it lands
+  unsigned char shDir[BOT_SHURIKENS];
+  unsigned char shOwner[BOT_SHURIKENS]; // seat, or BOT_SEATS for a player the search leaves out
+  unsigned char shMoving[BOT_SHURIKENS]; // pool step: 0 if thrown this turn
+  int shCount;
+  int seats;
+  int turn; // seat to move
+} BotState;
+
+typedef struct BotEntry
+{
+  uint64_t key;
+  short value;
+  unsigned char depth;
+  unsigned char bound; // BOT_EXACT, BOT_LOWER or BOT_UPPER
+  unsigned char move;
+} BotEntry;
+
+enum
+{
+  BOT_EXACT,
+  BOT_LOWER, // the value is at least this (a beta cutoff)
+  BOT_UPPER  // at most this (nothing beat alpha)
+};
+
+typedef struct
+{
+  BotEntry *table;      // the worker's, BOT_TABLE_SIZE entries
+  int slot[BOT_SEATS];  // room slot of each seat, for ties and the hash
+  uint64_t seed;        // hash of the seating, so bots don't share entries
+  int step[4];          // cell offset of each direction
+  long long deadlineNs;
+  int checkDeadline;    // off for the first, always finished, depth
+  int aborted;
+  unsigned long nodes;
+} BotSearch;
+
+#define BOT_WIN 10000 // beyond any evaluation
+
+uint64_t botMix(uint64_t h)
+{
+  h ^= h >> 31;
+  h *= 0x7FB5D329728EA185ULL;
+  h ^= h >> 27;
+  h *= 0x81DADEF4BC2DD44DULL;
+  return h ^ (h >> 33);
+}
+
+// Shurikens are hashed as a set, so the order they are listed in doesn't matter
+uint64_t botHash(const BotState *st, const BotSearch *search)
+{
+  uint64_t h = botMix(search->seed ^ (uint64_t)st->turn);
+  for (int s = 0; s < st->seats; s++)
+  {
+    h = botMix(h ^ ((uint64_t)(uint32_t)st->cell[s] << 24 | (uint64_t)(uint16_t)st->hp[s] << 8 | st->thrown[s]));
+  }
+  uint64_t shurikens = 0;
+  for (int n = 0; n < st->shCount; n++)
+  {
+    shurikens += botMix((uint64_t)(uint32_t)st->shCell[n] << 16 | st->shDir[n] << 12 | st->shOwner[n] << 4 | st->shMoving[n]);
+  }
+  return h ^ shurikens;
+}
+
+void botLand(BotState *st, int n)
+{
+  if (st->shOwner[n] < BOT_SEATS)
+  {
+    st->thrown[st->shOwner[n]]--;
+  }
+  st->shCount--;
+  st->shCell[n] = st->shCell[st->shCount];
+  st->shRange[n] = st->shRange[st->shCount];
+  st->shDir[n] = st->shDir[st->shCount];
+  st->shOwner[n] = st->shOwner[st->shCount];
+  st->shMoving[n] = st->shMoving[st->shCount];
+}
+
+// checkShurikenCollision: the lowest living slot in the cell takes 50
+void botCollide(BotState *st, const BotSearch *search, int n)
+{
+  int hit = -1;
+  for (int s = 0; s < st->seats; s++)
+  {
+    if (st->hp[s] > 0 && st->cell[s] == st->shCell[n] && (hit == -1 || search->slot[s] < search->slot[hit]))
+    {
+      hit = s;
+    }
+  }
+  if (hit != -1)
+  {
+    st->hp[hit] -= 50;
+    botLand(st, n);
+  }
+}
+
+// One command: moves 0-3 are MOVE and 4-7 ATTACK in g_dirNames order. As in
+// handleAction, the shurikens move first, and a player they kill still acts.
+void botPlay(BotState *st, const BotSearch *search, int move)
+{
+  for (int n = st->shCount - 1; n >= 0; n--)
+  {
+    if (!st->shMoving[n])
+    {
+      st->shMoving[n] = 1;
+    }
+    else if (st->shRange[n] == 0)
+    {
+      botLand(st, n);
+    }
+    else
+    {
+      st->shCell[n] += search->step[st->shDir[n]];
+      st->shRange[n]--;
+      botCollide(st, search, n);
+    }
+  }
+
+  int s = st->turn, dir = move & 3;
+  int cell = st->cell[s];
+  if (g_rays[(long)cell * 4 + dir] > 0)
+  {
+    if (move < 4)
+    {
+      st->cell[s] = cell + search->step[dir];
+    }
+    else
+    {
+      int n = st->shCount++;
+      st->shCell[n] = cell + search->step[dir];
+      st->shRange[n] = g_rays[(long)st->shCell[n] * 4 + dir];
+      st->shDir[n] = dir;
+      st->shOwner[n] = s;
+      st->shMoving[n] = 0;
+      st->thrown[s]++;
+      botCollide(st, search, n);
+    }
+  }
+
+  // rotateTurn: the next living seat, or the same one if nobody else is
+  for (int k = 1; k <= st->seats; k++)
+  {
+    int next = (s + k) % st->seats;
+    if (st->hp[next] > 0)
+    {
+      st->turn = next;
+      break;
+    }
+  }
+}
+
+// Commands worth trying for the seat to move, attacks first. A MOVE into a
+// wall stands for staying put, when there is a wall to move into.
+int botMoves(const BotState *st, int *moves)
+{
+  int s = st->turn, count = 0, blocked = -1;
+  const uint16_t *rays = &g_rays[(long)st->cell[s] * 4];
+  for (int dir = 0; dir < 4; dir++)
+  {
+    if (rays[dir] > 0 && st->thrown[s] < g_maxShurikens && st->shCount < BOT_SHURIKENS)
+    {
+      moves[count++] = 4 + dir;
+    }
+  }
+  for (int dir = 0; dir < 4; dir++)
+  {
+    if (rays[dir] > 0)
+    {
+      moves[count++] = dir;
+    }
+    else
+    {
+      blocked = dir;
+    }
+  }
+  if (blocked != -1)
+  {
+    moves[count++] = blocked;
+  }
+  return count;
+}
+
+// Distance from a cell to a shuriken's target, if it is on the shuriken's
+// remaining path; -1 if it is not
+int botInPath(const BotState *st, int n, int cell)
+{
+  int cols = g_map.cols;
+  int from = st->shCell[n], dir = st->shDir[n];
+  int dx = cell / cols - from / cols, dy = cell % cols - from % cols;
+  int distance = g_dirDx[dir] != 0 ? dx * g_dirDx[dir] : dy * g_dirDy[dir];
+  int inLine = g_dirDx[dir] != 0 ? dy == 0 : dx == 0;
+  return inLine && distance >= 0 && distance <= st->shRange[n] ? distance : -1;
+}
+
+// From the bot's side: its health over the others', a bonus per opponent
+// down, shurikens on their way to someone, and closing in on the nearest
+// opponent so bots go looking for a fight
+int botEvaluate(const BotState *st)
+{
+  int cols = g_map.cols;
+  int score = st->hp[0] * 3, nearest = -1;
+  for (int s = 1; s < st->seats; s++)
+  {
+    if (st->hp[s] <= 0)
+    {
+      score += 100;
+      continue;
+    }
+    score -= st->hp[s] * 2;
+    int distance = abs(st->cell[s] / cols - st->cell[0] / cols) + abs(st->cell[s] % cols - st->cell[0] % cols);
+    if (nearest == -1 || distance < nearest)
+    {
+      nearest = distance;
+    }
+  }
+  if (nearest > 0)
+  {
+    score -= nearest;
+  }
+
+  for (int n = 0; n < st->shCount; n++)
+  {
+    for (int s = 0; s < st->seats; s++)
+    {
+      int distance = st->hp[s] > 0 ? botInPath(st, n, st->cell[s]) : -1;
+      if (distance >= 0)
+      {
+        int threat = 60 - 4 * (distance < 10 ? distance : 10);
+        score += s == 0 ? -threat : threat / 2;
+        break;
+      }
+    }
+  }
+  return score;
+}
+
+int botSearch(BotState *st, BotSearch *search, int depth, int alpha, int beta)
+{
+  search->nodes++;
+  if (search->checkDeadline && (search->nodes & 1023) == 0 && nowNs() > search->deadlineNs)
+  {
+    search->aborted = 1;
+  }
+  if (search->aborted)
+  {
+    return 0;
+  }
+
+  // Sooner is better for a win and worse for a loss
+  if (st->hp[0] <= 0)
+  {
+    return -BOT_WIN - depth;
+  }
+  int opponents = 0;
+  for (int s = 1; s < st->seats; s++)
+  {
+    opponents += st->hp[s] > 0;
+  }
+  if (opponents == 0 && st->seats > 1)
+  {
+    return BOT_WIN + depth;
+  }
+  if (depth == 0)
+  {
+    return botEvaluate(st);
+  }
+
+  uint64_t key = botHash(st, search);
+  BotEntry *entry = &search->table[key & (BOT_TABLE_SIZE - 1)];
+  int hint = -1;
+  if (entry->key == key)
+  {
+    hint = entry->move;
+    if (entry->depth >= depth &&
+        (entry->bound == BOT_EXACT || (entry->bound == BOT_LOWER && entry->value >= beta) ||
+         (entry->bound == BOT_UPPER && entry->value <= alpha)))
+    {
+      return entry->value;
+    }
+  }
+
+  int moves[9];
+  int count = botMoves(st, moves);
+  for (int i = 1; hint != -1 && i < count; i++)
+  {
+    if (moves[i] == hint)
+    {
+      moves[i] = moves[0];
+      moves[0] = hint;
+    }
+  }
+
+  // Paranoid: the bot maximizes, everyone else minimizes
+  int maximizing = st->turn == 0;
+  int best = maximizing ? -BOT_WIN * 2 : BOT_WIN * 2, bestMove = moves[0];
+  int low = alpha, high = beta;
+  for (int i = 0; i < count; i++)
+  {
+    BotState child = *st;
+    botPlay(&child, search, moves[i]);
+    int value = botSearch(&child, search, depth - 1, low, high);
+    if (maximizing ? value > best : value < best)
+    {
+      best = value;
+      bestMove = moves[i];
+    }
+    if (maximizing && best > low)
+    {
+      low = best;
+    }
+    if (!maximizing && best < high)
+    {
+      high = best;
+    }
+    if (low >= high)
+    {
+      break;
+    }
+  }
+  if (search->aborted)
+  {
+    return 0;
+  }
+
+  entry->key = key;
+  entry->value = best;
+  entry->depth = depth;
+  entry->bound = best <= alpha ? BOT_UPPER : best >= beta ? BOT_LOWER : BOT_EXACT;
+  entry->move = bestMove;
+  return best;
+}
+
+// The bot's view of the room: its nearest opponents, seated in turn order
+// from the bot, and the shurikens nearest to it
+void botSnapshot(Room *room, int botSlot, BotState *st, BotSearch *search)
+{
+  int cols = g_map.cols;
+  const Player *players = room->state.players;
+  const Player *me = &players[botSlot];
+  int picked[BOT_SEATS], pickedDistance[BOT_SEATS];
+  int count = 0;
+  for (int i = 0; i < g_roomCapacity; i++)
+  {
+    if (i == botSlot || room->clientSockets[i] == -1 || !players[i].active || players[i].hp <= 0)
+    {
+      continue;
+    }
+    int distance = abs(players[i].x - me->x) + abs(players[i].y - me->y);
+    if (count == BOT_SEATS - 1 && distance >= pickedDistance[count - 1])
+    {
+      continue;
+    }
+    int at = count < BOT_SEATS - 1 ? count++ : count - 1;
+    while (at > 0 && pickedDistance[at - 1] > distance)
+    {
+      picked[at] = picked[at - 1];
+      pickedDistance[at] = pickedDistance[at - 1];
+      at--;
+    }
+    picked[at] = i;
+    pickedDistance[at] = distance;
+  }
+
+  // Turn order is slot order, wrapping around after the bot
+  for (int a = 1; a < count; a++)
+  {
+    for (int b = a; b > 0 && (picked[b] - botSlot + g_roomCapacity) % g_roomCapacity <
+                                 (picked[b - 1] - botSlot + g_roomCapacity) % g_roomCapacity; b--)
+    {
+      int slot = picked[b];
+      picked[b] = picked[b - 1];
+      picked[b - 1] = slot;
+    }
+  }
+
+  memset(st, 0, sizeof(*st));
+  st->seats = count + 1;
+  search->slot[0] = botSlot;
+  for (int s = 0; s < st->seats; s++)
+  {
+    int slot = s == 0 ? botSlot : picked[s - 1];
+    search->slot[s] = slot;
+    st->cell[s] = players[slot].x * cols + players[slot].y;
+    st->hp[s] = players[slot].hp;
+    st->thrown[s] = players[slot].shurikens;
+  }
+
+  const ShurikenPool *pool = &room->state.shurikens;
+  int nearest[BOT_SHURIKENS], nearestDistance[BOT_SHURIKENS];
+  int found = 0;
+  for (int n = 0; n < pool->liveCount; n++)
+  {
+    int slot = pool->live[n];
+    int distance = abs(pool->x[slot] - me->x) + abs(pool->y[slot] - me->y);
+    if (found == BOT_SHURIKENS && distance >= nearestDistance[found - 1])
+    {
+      continue;
+    }
+    int at = found < BOT_SHURIKENS ? found++ : found - 1;
+    while (at > 0 && nearestDistance[at - 1] > distance)
+    {
+      nearest[at] = nearest[at - 1];
+      nearestDistance[at] = nearestDistance[at - 1];
+      at--;
+    }
+    nearest[at] = slot;
+    nearestDistance[at] = distance;
+  }
+  for (int k = 0; k < found; k++)
+  {
+    int slot = nearest[k];
+    int dir = pool->dx[slot] < 0 ? 0 : pool->dx[slot] > 0 ? 1 : pool->dy[slot] < 0 ? 2 : 3;
+    int n = st->shCount++;
+    st->shCell[n] = pool->x[slot] * cols + pool->y[slot];
+    st->shRange[n] = g_rays[(long)st->shCell[n] * 4 + dir];
+    st->shDir[n] = dir;
+    st->shOwner[n] = BOT_SEATS;
+    for (int s = 0; s < st->seats; s++)
+    {
+      if (search->slot[s] == pool->owner[slot])
+      {
+        st->shOwner[n] = s;
+      }
+    }
+    st->shMoving[n] = pool->step[slot] != 0;
+  }
+
+  search->seed = 0;
+  for (int s = 0; s < st->seats; s++)
+  {
+    search->seed = botMix(search->seed ^ (uint64_t)search->slot[s]);
+  }
+  for (int dir = 0; dir < 4; dir++)
+  {
+    search->step[dir] = g_dirDx[dir] * cols + g_dirDy[dir];
+  }
+}
+
+// Pick a bot's command within budgetNs: iterative deepening, keeping the best
+// move of the deepest search that finished. Returns 0-7 as in botPlay.
+int botChooseMove(Worker *worker, Room *room, int botSlot, long long budgetNs, int *depthReached)
+{
+  if (worker->botTable == NULL && (worker->botTable = calloc(BOT_TABLE_SIZE, sizeof(BotEntry))) == NULL)
+  {
+    perror("calloc failed");
+    return 0;
+  }
+
+  BotState root;
+  BotSearch search;
+  memset(&search, 0, sizeof(search));
+  search.table = worker->botTable;
+  botSnapshot(room, botSlot, &root, &search);
+  search.deadlineNs = nowNs() + budgetNs;
+
+  int moves[9];
+  int count = botMoves(&root, moves);
+  int bestMove = moves[0];
+  *depthReached = 0;
+  for (int depth = 1; depth <= BOT_MAX_DEPTH; depth++)
+  {
+    int best = -BOT_WIN * 2, bestHere = moves[0];
+    for (int i = 0; i < count && !search.aborted; i++)
+    {
+      BotState child = root;
+      botPlay(&child, &search, moves[i]);
+      int value = botSearch(&child, &search, depth - 1, best, BOT_WIN * 2);
+      if (value > best)
+      {
+        best = value;
+        bestHere = moves[i];
+      }
+    }
+    if (search.aborted)
+    {
+      break;
+    }
+    bestMove = bestHere;
+    *depthReached = depth;
+
+    // Search the best move first next time round
+    for (int i = 1; i < count; i++)
+    {
+      if (moves[i] == bestMove)
+      {
+        moves[i] = moves[0];
+        moves[0] = bestMove;
+      }
+    }
+    if (best >= BOT_WIN || best <= -BOT_WIN || nowNs() > search.deadlineNs)
+    {
+      break; // decided, or out of time
+    }
+    search.checkDeadline = 1;
+  }
+
+  statAdd(&worker->metrics.counters[STAT_BOT_NODES], search.nodes);
+  return bestMove;
+}
+
+// Play one turn for the bot whose turn it is, as a command of its own
+void playBotTurn(Room *room, long long budgetNs)
+{
+  Worker *worker = room->worker;
+  int slot = room->state.currentTurn, depth;
+  long long start = nowNs();
+  int move = botChooseMove(worker, room, slot, budgetNs, &depth);
+  histRecord(&worker->metrics.histograms[HIST_BOT_TURN_NS], nowNs() - start);
+  statAdd(&worker->metrics.counters[STAT_BOT_TURNS], 1);
+
+  char cmd[16];
+  snprintf(cmd, sizeof(cmd), "%s %s", move < 4 ? "MOVE" : "ATTACK", g_dirNames[move & 3]);
+  handleAction(room, slot, parseAction(cmd), cmd);
+}
+
+/*---------------------------------------------------------------------------*
+ * Real-time mode (-t). Commands are not applied as they arrive: each player's
+ * latest one waits for the next tick of their worker's tick timer. A tick
+ * advances the shurikens once, applies every waiting command in slot order,
+ * and ends with at most one broadcast. Rooms where nothing is waiting and
+ * nothing is in flight are skipped.
+ *---------------------------------------------------------------------------*/
+void queueAction(Room *room, int playerIndex, Action action)
+{
+  if (action.verb == '?')
+  {
+    return; // Nothing to wait for
+  }
+
+  if (room->pendingActions[playerIndex].verb == 0)
+  {
+    room->pendingPlayers[room->pendingCount++] = playerIndex;
+  }
+  room->pendingActions[playerIndex] = action; // The latest command in a tick wins
+}
+
+void runRoomTick(Room *room)
+{
+  if (room->pendingCount == 0 && room->state.shurikens.liveCount == 0)
+  {
+    return;
+  }
+
+  // Only the commands the tick runs are journaled, ahead of the tick itself,
+  // so replay queues them again and then runs the same tick
+  for (int n = 0; n < room->pendingCount && room->journal != NULL; n++)
+  {
+    char cmd[16];
+    actionText(room->pendingActions[room->pendingPlayers[n]], cmd, sizeof(cmd));
+    journalAppend(room, 'C', room->pendingPlayers[n], cmd);
+  }
+  journalAppend(room, 'T', 0, NULL);
+  room->turnNumber++;
+
+  advanceShurikens(room);
+  for (int n = 0; n < room->pendingCount; n++)
+  {
+    int i = room->pendingPlayers[n];
+    Action action = room->pendingActions[i];
+    room->pendingActions[i].verb = 0;
+
+    // The player may have been killed by a shuriken earlier in this tick
+    if (room->clientSockets[i] != -1 && room->state.players[i].active)
+    {
+      applyAction(room, i, action);
+    }
+  }
+  room->pendingCount = 0;
+
+  unsigned int version = room->state.version;
+  refreshPlayerPositions(room);
+  if (room->state.version != version)
+  {
+    broadcastState(room);
+  }
+}
+
+/*---------------------------------------------------------------------------*
+ * Put a newly connected client into their player slot and send them the state
+ *---------------------------------------------------------------------------*/
+void handleJoin(Room *room, int playerIndex)
+{
+  room->state.players[playerIndex].x = g_map.spawnX[playerIndex];
+  room->state.players[playerIndex].y = g_map.spawnY[playerIndex];
+  room->state.players[playerIndex].active = 1;
+  touchPlayer(room, playerIndex);
+
+  if (g_tickRate > 0)
+  {
+    room->state.gameStarted = 1;
+    char modeMessage[BUFFER_SIZE];
+    snprintf(modeMessage, BUFFER_SIZE, "\nReal-time mode: %d ticks per second, send commands any time\n", g_tickRate);
+    sendMessageToPlayer(room, playerIndex, modeMessage);
+  }
+  else if (!room->state.gameStarted)
+  {
+    room->state.gameStarted = 1;
+    const char *yourTurnMsg = "\nIt's your turn, Player A\n";
+    sendMessageToPlayer(room, playerIndex, yourTurnMsg);
+    if (g_botDelaySec >= 0)
+    {
+      room->botFillAtMs = nowMs() + g_botDelaySec * 1000LL;
+    }
+  }
+
+  refreshPlayerPositions(room);
+  broadcastState(room);
+}
+
+/*---------------------------------------------------------------------------*
+ * A client went away without sending QUIT: free their slot and tell the rest.
+ * leaveSeat closes the connection, or with closeSocket == 0 only detaches it
+ * so it can be seated elsewhere (see rejoinSeat).
+ *---------------------------------------------------------------------------*/
+void leaveSeat(Room *room, int playerIndex, int closeSocket)
+{
+  journalAppend(room, 'L', playerIndex, NULL);
+
+  // Notify other players that this player has disconnected
+  char disconnectMessage[BUFFER_SIZE];
+  snprintf(disconnectMessage, BUFFER_SIZE, "\nPlayer %s has disconnected.\n", playerName(playerIndex).text);
+  for (int i = 0; i < g_roomCapacity; i++)
+  {
+    if (i != playerIndex && room->clientSockets[i] != -1)
+    {
+      sendMessageToPlayer(room, i, disconnectMessage);
+    }
+  }
+
+  // Reset the player's state
+  dropShurikens(room, playerIndex);
+  resetPlayerState(room, playerIndex);
+  touchPlayer(room, playerIndex);
+
+  // Close the socket
+  if (closeSocket)
+  {
+    statAdd(&room->worker->metrics.counters[STAT_DISCONNECTS], 1);
+    closeClientSocket(room, playerIndex);
+  }
+  else
+  {
+    room->clientSockets[playerIndex] = -1;
+    room->connections[playerIndex] = NULL;
+    room->state.clientCount--;
+    atomic_fetch_add(&room->worker->openSeats, 1);
+    room->worker->seatsFreed = 1;
+  }
+
+  // Refresh and broadcast the updated state
+  refreshPlayerPositions(room);
+  broadcastState(room);
+
+  // Rotate turn if the disconnected player was the current turn
+  if (playerIndex == room->state.currentTurn)
+  {
+    rotateTurn(room);
+  }
+}
+
+void handleDisconnect(Room *room, int playerIndex)
+{
+  leaveSeat(room, playerIndex, 1);
+}
+
+/*---------------------------------------------------------------------------*
+ * Rejoining after a restart. Every seated player is sent a token; after the
+ * server comes back from a snapshot, "REJOIN <token>" moves the connection out
+ * of the seat it was just given and back into its old one. That seat may
+ * belong to another worker, so the connection is handed over through that
+ * worker's inbox once the current batch of events is done.
+ *---------------------------------------------------------------------------*/
+HeldSeat *findHeldSeat(uint64_t token)
+{
+  if (g_heldSeats == NULL || token == 0)
+  {
+    return NULL;
+  }
+  for (size_t i = (token * 0x9E3779B97F4A7C15ULL) & g_heldSeatMask;; i = (i + 1) & g_heldSeatMask)
+  {
+    if (g_heldSeats[i].token == token)
+    {
+      return &g_heldSeats[i];
+    }
+    if (g_heldSeats[i].token == 0)
+    {
+      return NULL;
+    }
+  }
+}
+
+void rejoinSeat(Connection *conn, uint64_t token)
+{
+  HeldSeat *seat = findHeldSeat(token);
+  if (seat == NULL || atomic_exchange(&seat->claimed, 1))
+  {
+    const char *unknownMsg = "Unknown or expired rejoin token\n";
+    queueOutput(conn->room->worker, conn, unknownMsg, strlen(unknownMsg));
+    return;
+  }
+
+  Worker *worker = conn->room->worker;
+  printf("Room %d: Player %s is rejoining room %d as Player %s\n", conn->room->id, playerName(conn->playerIndex).text, seat->room->id, playerName(seat->slot).text);
+  leaveSeat(conn->room, conn->playerIndex, 0);
+
+  conn->room = seat->room;
+  conn->playerIndex = seat->slot;
+  conn->moving = 1;
+  conn->next = worker->movingConnections;
+  worker->movingConnections = conn;
+}
+
+// Worker timer: give up the seats of restored players who never came back
+void expireHeldSeats(Worker *worker)
+{
+  worker->heldSeatsExpired = 1;
+  for (size_t i = 0; g_heldSeats != NULL && i <= g_heldSeatMask; i++)
+  {
+    HeldSeat *seat = &g_heldSeats[i];
+    if (seat->token != 0 && seat->worker == worker && !atomic_exchange(&seat->claimed, 1))
+    {
+      printf("Room %d: Player %s did not rejoin in time\n", seat->room->id, playerName(seat->slot).text);
+      handleDisconnect(seat->room, seat->slot);
+    }
+  }
+}
+
+// Apply a game command now, or queue it for the next tick in real-time mode.
+// cmd is its text form, for the journal in turn-based play.
+void runCommand(Connection *conn, Action action, const char *cmd)
+{
+  Worker *worker = conn->room->worker;
+  statAdd(&worker->metrics.counters[STAT_COMMANDS], 1);
+  if (g_tickRate > 0)
+  {
+    queueAction(conn->room, conn->playerIndex, action);
+  }
+  else if (++worker->commandTick % COMMAND_SAMPLE_RATE == 0)
+  {
+    long long start = nowNs();
+    handleAction(conn->room, conn->playerIndex, action, cmd);
+    histRecord(&worker->metrics.histograms[HIST_COMMAND_NS], nowNs() - start);
+  }
+  else
+  {
+    handleAction(conn->room, conn->playerIndex, action, cmd);
+  }
+}
+
+/*---------------------------------------------------------------------------*
+ * Binary protocol. A client switches to it by sending the line "BINARY"; the
+ * server answers "BINARY" and reads opcodes from then on, while its output
+ * stays the same. The first byte of a message indexes g_binaryActions and its
+ * opcode indexes g_opcodes, so decoding is two table loads and one indirect
+ * call, with no scanning and nothing to allocate.
+ *---------------------------------------------------------------------------*/
+typedef void (*OpcodeHandler)(Connection *conn, const unsigned char *msg);
+
+typedef struct
+{
+  size_t length; // whole message, first byte included
+  OpcodeHandler handler;
+} Opcode;
+
+Action g_binaryActions[256];           // what each first byte means as a game command
+const char *g_binaryCommandText[256];  // and its text form, which the journal records
+
+uint64_t readBigEndian(const unsigned char *bytes, int count)
+{
+  uint64_t value = 0;
+  for (int i = 0; i < count; i++)
+  {
+    value = value << 8 | bytes[i];
+  }
+  return value;
+}
+
+// MOVE, ATTACK and QUIT, and unknown opcodes, which count as unknown commands
+void opGameCommand(Connection *conn, const unsigned char *msg)
+{
+  runCommand(conn, g_binaryActions[msg[0]], g_binaryCommandText[msg[0]]);
+}
+
+void opDelta(Connection *conn, const unsigned char *msg)
+{
+  (void)msg;
+  handleProtocolCommand(conn, "DELTA");
+}
+
+void opAck(Connection *conn, const unsigned char *msg)
+{
+  unsigned int version = readBigEndian(msg + 1, 4);
+  if (version > conn->ackedVersion && version <= conn->sentVersion)
+  {
+    conn->ackedVersion = version;
+  }
+}
+
+void opRejoin(Connection *conn, const unsigned char *msg)
+{
+  rejoinSeat(conn, readBigEndian(msg + 1, 8));
+}
+
+Opcode g_opcodes[OPCODE_COUNT]; // the jump table, indexed by opcode
+
+// Fill in the tables above; call once at startup
+void initBinaryProtocol()
+{
+  for (int opcode = 0; opcode < OPCODE_COUNT; opcode++)
+  {
+    g_opcodes[opcode] = (Opcode){1, opGameCommand};
+  }
+  g_opcodes[OP_DELTA] = (Opcode){1, opDelta};
+  g_opcodes[OP_ACK] = (Opcode){5, opAck};
+  g_opcodes[OP_REJOIN] = (Opcode){9, opRejoin};
+
+  static const char verbs[] = {[OP_MOVE] = 'M', [OP_ATTACK] = 'A'};
+  static char texts[OP_QUIT][4][16]; // "MOVE UP" and so on, for MOVE and ATTACK
+
+  for (int byte = 0; byte < 256; byte++)
+  {
+    int opcode = byte >> 2, dir = byte & 3;
+    if (opcode == OP_QUIT)
+    {
+      g_binaryActions[byte] = (Action){'Q', 0, 0};
+      g_binaryCommandText[byte] = "QUIT";
+    }
+    else if (opcode >= OP_MOVE && opcode <= OP_ATTACK)
+    {
+      Action action = {verbs[opcode], g_dirDx[dir], g_dirDy[dir]};
+      g_binaryActions[byte] = action;
+      snprintf(texts[opcode][dir], sizeof(texts[opcode][dir]), "%s %s", opcode == OP_MOVE ? "MOVE" : "ATTACK", g_dirNames[dir]);
+      g_binaryCommandText[byte] = texts[opcode][dir];
+    }
+    else
+    {
+      g_binaryActions[byte] = (Action){'?', 0, 0};
+      g_binaryCommandText[byte] = "?";
+    }
+  }
+}
+
+/*---------------------------------------------------------------------------*
+ * Split the connection's input buffer into '\n'-terminated commands and run
+ * each one. A trailing partial command stays buffered for the next read.
+ *---------------------------------------------------------------------------*/
+void processCommands(Connection *conn)
+{
+  size_t start = 0;
+
+  while (conn->fd != -1 && !conn->moving)
+  {
+    // Everything after BINARY is opcodes; a message cut short waits for more
+    if (conn->binaryMode)
+    {
+      const unsigned char *msg = (const unsigned char *)conn->inBuf + start;
+      if (start == conn->inLen || conn->inLen - start < g_opcodes[msg[0] >> 2].length)
+      {
+        break;
+      }
+      start += g_opcodes[msg[0] >> 2].length;
+      g_opcodes[msg[0] >> 2].handler(conn, msg);
+      continue;
+    }
+
+    char *newline = memchr(conn->inBuf + start, '\n', conn->inLen - start);
+    if (newline == NULL)
+    {
+      break;
+    }
+
+    char *cmd = conn->inBuf + start;
+    size_t len = newline - cmd;
+    start += len + 1;
+
+    // Strip trailing newline (and the '\r' of "\r\n")
+    *newline = '\0';
+    if (len > 0 && cmd[len - 1] == '\r')
+    {
+      cmd[len - 1] = '\0';
+    }
+
+    // The rest of an over-long command that was already thrown away
+    if (conn->discarding)
+    {
+      conn->discarding = 0;
+      continue;
+    }
+
+    if (handleProtocolCommand(conn, cmd))
+    {
+      continue;
+    }
+    if (strncmp(cmd, "REJOIN ", 7) == 0)
+    {
+      rejoinSeat(conn, strtoull(cmd + 7, NULL, 16));
+      continue;
+    }
+
+    // Handle the command. If the player quit or died, handleAction has
+    // already closed the socket and conn->fd is -1, which ends the loop.
+    runCommand(conn, parseAction(cmd), cmd);
+  }
+
+  if (conn->fd == -1)
+  {
+    return;
+  }
+
+  // Keep the unterminated tail for the next read
+  conn->inLen -= start;
+  memmove(conn->inBuf, conn->inBuf + start, conn->inLen);
+
+  // No command is this long; drop it up to its newline
+  if (conn->inLen == INBUF_SIZE)
+  {
+    conn->inLen = 0;
+    conn->discarding = 1;
+  }
+}
+
+// Add received bytes to the input buffer and run the commands in them. Bytes
+// that arrive once the connection is moving to another worker are kept in
+// conn->carry, since only the worker it ends up on may run them.
+void deliverInput(Connection *conn, const char *data, size_t len)
+{
+  while (len > 0 && conn->fd != -1)
+  {
+    size_t n = INBUF_SIZE - conn->inLen < len ? INBUF_SIZE - conn->inLen : len;
+    if (conn->moving || n == 0)
+    {
+      char *carry = realloc(conn->carry, conn->carryLen + len);
+      if (carry == NULL)
+      {
+        perror("realloc failed");
+        return;
+      }
+      memcpy(carry + conn->carryLen, data, len);
+      conn->carry = carry;
+      conn->carryLen += len;
+      return;
+    }
+    memcpy(conn->inBuf + conn->inLen, data, n);
+    conn->inLen += n;
+    data += n;
+    len -= n;
+    processCommands(conn);
+  }
+}
+
+/*---------------------------------------------------------------------------*
+ * Drain everything the client has sent. The sockets are edge-triggered, so we
+ * have to keep reading until recv() reports EAGAIN or we won't be woken again.
+ * Reads land straight in the connection's input buffer, so commands split
+ * across TCP segments are reassembled and several commands in one segment
+ * are all run, in order, before the worker flushes any output.
+ *---------------------------------------------------------------------------*/
+void handleReadable(Connection *conn)
+{
+  while (conn->fd != -1 && !conn->moving)
+  {
+    ssize_t bytesReceived = recv(conn->fd, conn->inBuf + conn->inLen, INBUF_SIZE - conn->inLen, 0);
+    statAdd(&conn->room->worker->metrics.counters[STAT_RECV_CALLS], 1);
+    if (bytesReceived < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        return; // Nothing left to read for now
+      }
+    }
+
+    if (bytesReceived <= 0) // Client disconnected
+    {
+      handleDisconnect(conn->room, conn->playerIndex);
+      return;
+    }
+
+    conn->inLen += bytesReceived;
+    processCommands(conn);
+  }
+}
+
+/*---------------------------------------------------------------------------*
+ * Rooms: created on demand by the worker that owns them, torn down once the
+ * match is over
+ *---------------------------------------------------------------------------*/
+atomic_int g_roomCount;
+atomic_ulong g_playersDealt; // players accepted and handed to a worker to seat, see dealPlayer
+
+// splitmix64 over the worker's seed; never 0, which marks an empty HeldSeat
+uint64_t nextSeatToken(Worker *worker)
+{
+  uint64_t z = (worker->tokenState += 0x9E3779B97F4A7C15ULL);
+  z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+  z ^= z >> 31;
+  return z ? z : 1;
+}
+
+// Put a player in a free slot and spawn them. Shared with journal replay,
+// which seats players that have no connection.
+void seatPlayer(Room *room, int playerIndex, int fd, Connection *conn)
+{
+  room->clientSockets[playerIndex] = fd; // Adding the activeClient to the array
+  room->connections[playerIndex] = conn;
+  room->state.clientCount++;
+  atomic_fetch_sub(&room->worker->openSeats, 1);
+  if (room->state.clientCount > room->peakPlayers)
+  {
+    room->peakPlayers = room->state.clientCount;
+  }
+
+  room->seatTokens[playerIndex] = nextSeatToken(room->worker);
+  char tokenMessage[BUFFER_SIZE];
+  snprintf(tokenMessage, BUFFER_SIZE, "TOKEN %016llx\n", (unsigned long long)room->seatTokens[playerIndex]);
+  sendMessageToPlayer(room, playerIndex, tokenMessage);
+
+  journalAppend(room, 'J', playerIndex, NULL);
+  handleJoin(room, playerIndex);
+}
+
+// Set up a room whose place under the global limit is already reserved
+Room *openRoom(Worker *worker)
+{
+  Room *room = allocRoom();
+  if (room == NULL)
+  {
+    atomic_fetch_sub(&g_roomCount, 1);
+    return NULL;
+  }
+
+  room->id = worker->nextRoomId;
+  worker->nextRoomId += g_workerCount;
+  room->worker = worker;
+  openJournal(room);
+
+  room->next = worker->rooms;
+  worker->rooms = room;
+  worker->roomCount++;
+  atomic_fetch_add(&worker->openSeats, g_roomCapacity);
+  return room;
+}
+
+Room *createRoom(Worker *worker)
+{
+  // Reserve a room against the global limit before allocating it
+  if (atomic_fetch_add(&g_roomCount, 1) >= g_maxRooms)
+  {
+    atomic_fetch_sub(&g_roomCount, 1);
+    return NULL;
+  }
+  return openRoom(worker);
+}
+
+// Find a room on this worker with a free slot, or open a new one
+Room *findOpenRoom(Worker *worker)
+{
+  for (Room *room = worker->rooms; room != NULL; room = room->next)
+  {
+    // A started room that has emptied out is about to be torn down
+    if (room->state.gameStarted && room->state.clientCount == 0)
+    {
+      continue;
+    }
+    if (room->state.clientCount < g_roomCapacity)
+    {
+      return room;
+    }
+  }
+  return createRoom(worker);
+}
+
+// Refuse a client we have no room for
+void rejectClient(int sock)
+{
+  printf("Server full! Rejecting new client.\n");
+  const char *msg = "Server full. Please try again later.\n";
+  send(sock, msg, strlen(msg), MSG_DONTWAIT);
+  close(sock);
+}
+
+// Start reading a player's socket: a multishot receive on the worker's ring,
+// or an edge-triggered epoll registration
+int watchConnection(Worker *worker, Connection *conn)
+{
+  if (worker->ring.fd >= 0)
+  {
+    conn->viaRing = 1;
+    conn->ringCancelled = 0;
+    ringArmRecv(worker, conn);
+    return 0;
+  }
+
+  // Registered for EPOLLOUT up front: with edge triggering it only fires when
+  // a full socket becomes writable again, which is when a blocked queue drains
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.ptr = conn;
+  return epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, conn->fd, &ev);
+}
+
+/*---------------------------------------------------------------------------*
+ * Seat a connection handed over by the acceptor in one of this worker's rooms
+ *---------------------------------------------------------------------------*/
+void seatConnection(Worker *worker, Connection *conn, Room *room)
+{
+  // The room has capacity, find a free index in its socket table
+  int freeIndex = 0;
+  for (int i = 0; i < g_roomCapacity; i++)
+  {
+    if (room->clientSockets[i] == -1) // Change to ==
+    {
+      freeIndex = i;
+      break;
+    }
+  }
+
+  conn->room = room;
+  conn->playerIndex = freeIndex;
+
+  if (watchConnection(worker, conn) < 0)
+  {
+    perror("epoll_ctl failed");
+    close(conn->fd);
+    releaseSeat(worker);
+    free(conn);
+    return;
+  }
+
+  printf("Room %d: Player %s joined on worker %d. Players in room: %d/%d\n", room->id, playerName(freeIndex).text, worker->id, room->state.clientCount + 1, g_roomCapacity);
+
+  seatPlayer(room, freeIndex, conn->fd, conn);
+}
+
+/*---------------------------------------------------------------------------*
+ * Where new players go. Every worker accepts players on a listener of its own,
+ * but the kernel spreads connections over the listeners one by one, so which
+ * worker seats a player is decided here, once for the whole server: players
+ * are dealt to the workers g_roomCapacity at a time, in the order they were
+ * accepted on any listener, so players who arrive together share a match.
+ * Clients that cannot be seated yet go to the acceptor's admission queue.
+ *---------------------------------------------------------------------------*/
+typedef struct
+{
+  int fd;
+  long long sinceNs;
+} Waiter;
+
+// Clients a worker accepted while others were queued or no seat was free,
+// waiting for the acceptor to move them into the admission queue. Like a
+// worker's inbox, a lock-free LIFO list that only the acceptor takes from.
+typedef struct Arrival
+{
+  Waiter waiter;
+  struct Arrival *next;
+} Arrival;
+
+_Atomic(Arrival *) g_arrivals;
+atomic_int g_arrivingCount; // posted and not yet in the queue
+
+// Clients queued, or on their way to the queue; nobody may be seated ahead of them
+int anyoneWaiting(void)
+{
+  return atomic_load(&g_waitingCount) > 0 || atomic_load(&g_arrivingCount) > 0;
+}
+
+// Hand a client to the admission queue. -1 if too many are already on the way.
+int postArrival(Worker *worker, int sock)
+{
+  Arrival *arrival = NULL;
+  if (atomic_fetch_add(&g_arrivingCount, 1) >= MAX_ARRIVALS || (arrival = malloc(sizeof(Arrival))) == NULL)
+  {
+    atomic_fetch_sub(&g_arrivingCount, 1);
+    return -1;
+  }
+  arrival->waiter.fd = sock;
+  arrival->waiter.sinceNs = nowNs();
+  arrival->next = atomic_load_explicit(&g_arrivals, memory_order_relaxed);
+  while (!atomic_compare_exchange_weak_explicit(&g_arrivals, &arrival->next, arrival, memory_order_release,
+                                                memory_order_relaxed))
+  {
+    statAdd(&worker->metrics.counters[STAT_INBOX_RETRIES], 1);
+  }
+  worker->arrivalsPosted = 1;
+  return 0;
+}
+
+// The worker that seats the next player accepted on any listener
+Worker *dealPlayer(void)
+{
+  unsigned long dealt = atomic_fetch_add(&g_playersDealt, 1);
+  return &g_workers[(dealt / g_roomCapacity) % g_workerCount];
+}
+
+void placeConnection(Worker *worker, Connection *conn)
+{
+  // A batch from the admission queue starts its own match; the rest of the
+  // batch follows in the inbox and finds the new room first. A client sent
+  // for a free seat hands its reservation back to seatPlayer, which takes it.
+  if (conn->seatReserved)
+  {
+    atomic_fetch_add(&worker->openSeats, 1);
+    conn->seatReserved = 0;
+  }
+  Room *room = conn->roomReserved ? openRoom(worker) : findOpenRoom(worker);
+  if (room == NULL)
+  {
+    // No room to open here after all: queue the client rather than turn it away
+    if (conn->roomReserved || postArrival(worker, conn->fd) < 0)
+    {
+      rejectClient(conn->fd);
+      statAdd(&worker->metrics.counters[STAT_REJECTS], 1);
+    }
+    releaseSeat(worker);
+    free(conn);
+    return;
+  }
+  seatConnection(worker, conn, room);
+}
+
+/*---------------------------------------------------------------------------*
+ * Seating bots and playing their turns. A room's empty seats get bots
+ * g_botDelaySec after its first player joined, once; after every batch of
+ * events, each bot whose turn it is plays before the humans are waited on.
+ *---------------------------------------------------------------------------*/
+void fillRoomsWithBots(Worker *worker)
+{
+  long long now = nowMs();
+  for (Room *room = worker->rooms; room != NULL; room = room->next)
+  {
+    if (room->botFillAtMs == 0 || now < room->botFillAtMs)
+    {
+      continue;
+    }
+    room->botFillAtMs = 0;
+
+    // Nobody to play against, or already closing
+    if (room->state.clientCount == 0)
+    {
+      continue;
+    }
+    for (int i = 0; i < g_roomCapacity; i++)
+    {
+      if (room->clientSockets[i] == -1)
+      {
+        printf("Room %d: Player %s is a bot\n", room->id, playerName(i).text);
+        room->botCount++;
+        seatPlayer(room, i, BOT_SOCKET, NULL);
+      }
+    }
+  }
+}
+
+// A bot has the turn and there is a human left to wait for
+int botTurnDue(Room *room)
+{
+  int slot = room->state.currentTurn;
+  const Player *player = &room->state.players[slot];
+  return room->botCount > 0 && room->state.clientCount > room->botCount &&
+         room->clientSockets[slot] == BOT_SOCKET && player->active && player->hp > 0;
+}
+
+// Play the bots whose turn it is, for at most BOT_BATCH_BUDGET_NS however many
+// rooms have them, so sockets and timers never wait on more than that. Rooms
+// are taken in turn starting where the last batch stopped; if time runs out,
+// botsPending has the worker come straight back instead of blocking.
+void runBotTurns(Worker *worker)
+{
+  worker->botsPending = 0;
+  Room *start = worker->rooms;
+  for (Room *room = worker->rooms; room != NULL; room = room->next)
+  {
+    if (room->id == worker->botNextRoom)
+    {
+      start = room;
+      break;
+    }
+  }
+
+  long long deadlineNs = 0;
+  Room *room = start;
+  for (int n = 0; n < worker->roomCount && room != NULL; n++)
+  {
+    // Up to a round of turns, then on to the next room
+    for (int turns = 0; turns < g_roomCapacity && botTurnDue(room); turns++)
+    {
+      long long now = nowNs();
+      if (deadlineNs == 0)
+      {
+        deadlineNs = now + BOT_BATCH_BUDGET_NS;
+      }
+      if (now >= deadlineNs)
+      {
+        worker->botNextRoom = room->id;
+        worker->botsPending = 1;
+        return;
+      }
+      long long budgetNs = BOT_ROUND_BUDGET_NS / room->botCount;
+      playBotTurn(room, budgetNs < deadlineNs - now ? budgetNs : deadlineNs - now);
+    }
+    worker->botsPending |= botTurnDue(room);
+    room = room->next != NULL ? room->next : worker->rooms;
+  }
+  worker->botNextRoom = room != NULL ? room->id : -1;
+}
+
+// Put a rejoining connection back in the restored seat it claimed
+void resumeSeat(Worker *worker, Connection *conn)
+{
+  Room *room = conn->room;
+  int i = conn->playerIndex;
+  conn->moving = 0;
+
+  if (watchConnection(worker, conn) < 0)
+  {
+    perror("epoll_ctl failed");
+    close(conn->fd);
+    releaseSeat(worker);
+    free(conn->carry);
+    free(conn->outBuf);
+    free(conn);
+    handleDisconnect(room, i);
+    return;
+  }
+
+  room->clientSockets[i] = conn->fd;
+  room->connections[i] = conn;
+  printf("Room %d: Player %s rejoined on worker %d\n", room->id, playerName(i).text, worker->id);
+
+  // The new room's versions mean nothing to a delta client; start it over
+  conn->ackedVersion = 0;
+  conn->sentVersion = 0;
+  conn->keyVersion = 0;
+
+  char message[BUFFER_SIZE];
+  snprintf(message, BUFFER_SIZE, "\nWelcome back, Player %s\n", playerName(i).text);
+  sendMessageToPlayer(room, i, message);
+  sendLatestState(room, conn);
+  if (g_tickRate == 0)
+  {
+    if (room->state.currentTurn == i)
+    {
+      snprintf(message, BUFFER_SIZE, "\nIt's your turn, Player %s\n", playerName(i).text);
+    }
+    else
+    {
+      snprintf(message, BUFFER_SIZE, "\nIt's Player %s's turn\n", playerName(room->state.currentTurn).text);
+    }
+    sendMessageToPlayer(room, i, message);
+  }
+
+  // Commands that arrived right behind the REJOIN
+  processCommands(conn);
+  char *carry = conn->carry;
+  size_t carryLen = conn->carryLen;
+  conn->carry = NULL;
+  conn->carryLen = 0;
+  deliverInput(conn, carry, carryLen);
+  free(carry);
+}
+
+/*---------------------------------------------------------------------------*
+ * Spectators (-v). A watcher connects to the spectator port and sends
+ * "WATCH <room>". Room ids are striped across workers, so the worker that
+ * owns a room is known from its id alone; a watcher who asked another worker
+ * is handed over to it like a rejoining player. Once attached it only ever
+ * receives frames, and whatever it sends is read and dropped.
+ *---------------------------------------------------------------------------*/
+// goodbye, if not NULL, is sent after whatever frames the spectator has queued
+void closeSpectator(Worker *worker, Connection *conn, const char *goodbye)
+{
+  Room *room = conn->room;
+  if (room != NULL)
+  {
+    Connection *last = room->spectators[--room->spectatorCount];
+    room->spectators[conn->spectatorIndex] = last;
+    last->spectatorIndex = conn->spectatorIndex;
+  }
+
+  // Last chance for the frames it has queued, then the goodbye
+  if (!conn->lagged && flushOutput(worker, conn) && goodbye != NULL)
+  {
+    queueOutput(worker, conn, goodbye, strlen(goodbye));
+    flushOutput(worker, conn);
+  }
+  releaseFrame(conn->frameSending);
+  releaseFrame(conn->framePending);
+  conn->frameSending = conn->framePending = NULL;
+
+  close(conn->fd);
+  conn->fd = -1;
+  conn->room = NULL;
+  conn->next = worker->closedConnections;
+  worker->closedConnections = conn;
+}
+
+// Attach a spectator to the room it asked for, which this worker owns
+void watchRoom(Worker *worker, Connection *conn)
+{
+  Room *room = worker->rooms;
+  while (room != NULL && room->id != conn->watchRoomId)
+  {
+    room = room->next;
+  }
+
+  char message[BUFFER_SIZE];
+  if (room == NULL || room->spectatorCount == MAX_SPECTATORS)
+  {
+    snprintf(message, BUFFER_SIZE, "Room %d is not being played or has no room for more spectators\n", conn->watchRoomId);
+    closeSpectator(worker, conn, message);
+    return;
+  }
+
+  if (room->spectatorCount == room->spectatorCap)
+  {
+    int cap = room->spectatorCap ? room->spectatorCap * 2 : 16;
+    Connection **grown = realloc(room->spectators, cap * sizeof(Connection *));
+    if (grown == NULL)
+    {
+      closeSpectator(worker, conn, NULL);
+      return;
+    }
+    room->spectators = grown;
+    room->spectatorCap = cap;
+  }
+  conn->room = room;
+  conn->spectatorIndex = room->spectatorCount;
+  room->spectators[room->spectatorCount++] = conn;
+  statAdd(&worker->metrics.counters[STAT_SPECTATORS], 1);
+
+  snprintf(message, BUFFER_SIZE, "Watching room %d\n", room->id);
+  queueOutput(worker, conn, message, strlen(message));
+  refreshPlayerPositions(room);
+  SharedFrame *frame = cachedFrame(room, &room->stateFrame, buildStateString);
+  if (frame != NULL)
+  {
+    queueSharedFrame(worker, conn, frame);
+  }
+}
+
+// A spectator arriving from the acceptor, or from the worker it sent WATCH to
+void admitSpectator(Worker *worker, Connection *conn)
+{
+  conn->moving = 0;
+
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.ptr = conn;
+  if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, conn->fd, &ev) < 0)
+  {
+    perror("epoll_ctl failed");
+    close(conn->fd);
+    free(conn);
+    return;
+  }
+
+  if (conn->watchRoomId >= 0)
+  {
+    watchRoom(worker, conn);
+  }
+}
+
+void handleSpectatorReadable(Worker *worker, Connection *conn)
+{
+  while (conn->fd != -1 && !conn->moving)
+  {
+    ssize_t bytesReceived = recv(conn->fd, conn->inBuf + conn->inLen, INBUF_SIZE - conn->inLen, 0);
+    statAdd(&worker->metrics.counters[STAT_RECV_CALLS], 1);
+    if (bytesReceived < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+      {
+        return;
+      }
+    }
+    if (bytesReceived <= 0)
+    {
+      closeSpectator(worker, conn, NULL);
+      return;
+    }
+    if (conn->room != NULL)
+    {
+      continue; // Watchers are read-only
+    }
+
+    conn->inLen += bytesReceived;
+    char *newline = memchr(conn->inBuf, '\n', conn->inLen);
+    if (newline == NULL)
+    {
+      if (conn->inLen == INBUF_SIZE)
+      {
+        conn->inLen = 0;
+      }
+      continue;
+    }
+    *newline = '\0';
+    conn->inLen = 0;
+
+    int roomId;
+    if (sscanf(conn->inBuf, "WATCH %d", &roomId) != 1 || roomId < 0)
+    {
+      const char *usageMsg = "Send WATCH <room> to watch a match\n";
+      queueOutput(worker, conn, usageMsg, strlen(usageMsg));
+      continue;
+    }
+    conn->watchRoomId = roomId;
+    if (&g_workers[roomId % g_workerCount] == worker)
+    {
+      watchRoom(worker, conn);
+    }
+    else
+    {
+      conn->moving = 1;
+      conn->next = worker->movingConnections;
+      worker->movingConnections = conn;
+    }
+  }
+}
+
+// Take every connection other threads queued for this worker
+void drainInbox(Worker *worker)
+{
+  uint64_t count;
+  while (read(worker->wakeFd, &count, sizeof(count)) > 0)
+  {
+    // Reset the eventfd counter
+  }
+
+  Connection *list = atomic_exchange_explicit(&worker->inbox, NULL, memory_order_acquire);
+
+  // The inbox is LIFO; reverse it so clients are seated in arrival order
+  Connection *ordered = NULL;
+  while (list != NULL)
+  {
+    Connection *next = list->next;
+    list->next = ordered;
+    ordered = list;
+    list = next;
+  }
+
+  while (ordered != NULL)
+  {
+    Connection *next = ordered->next;
+    ordered->next = NULL;
+    histRecord(&worker->metrics.histograms[HIST_INBOX_WAIT_NS], nowNs() - ordered->postedNs);
+    if (ordered->spectating)
+    {
+      admitSpectator(worker, ordered);
+    }
+    else if (ordered->room != NULL)
+    {
+      resumeSeat(worker, ordered);
+    }
+    else
+    {
+      placeConnection(worker, ordered);
+    }
+    ordered = next;
+  }
+}
+
+// Queue a connection for a worker and wake it up. metrics are the calling
+// thread's own. Only a push onto an empty inbox needs the wakeup: anything
+// already there has a wakeup of its own pending, and the worker takes the
+// whole list at once.
+void postToWorker(Worker *worker, Connection *conn, Metrics *metrics)
+{
+  statAdd(&metrics->counters[STAT_INBOX_POSTS], 1);
+  conn->postedNs = nowNs();
+  conn->next = atomic_load_explicit(&worker->inbox, memory_order_relaxed);
+  while (!atomic_compare_exchange_weak_explicit(&worker->inbox, &conn->next, conn, memory_order_release,
+                                                memory_order_relaxed))
+  {
+    statAdd(&metrics->counters[STAT_INBOX_RETRIES], 1);
+  }
+
+  if (conn->next == NULL)
+  {
+    uint64_t one = 1;
+    write(worker->wakeFd, &one, sizeof(one));
+  }
+}
+
+// 1 if a held seat in the room has been claimed by a REJOIN still on its way.
+// Unclaimed held seats are claimed here, so the room can be closed safely.
+int keepForRejoin(Room *room)
+{
+  for (int i = 0; i < g_roomCapacity; i++)
+  {
+    HeldSeat *seat = room->clientSockets[i] == HELD_SOCKET ? findHeldSeat(room->seatTokens[i]) : NULL;
+    if (seat != NULL && atomic_exchange(&seat->claimed, 1))
+    {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*---------------------------------------------------------------------------*
+ * End matches that are over and free rooms nobody is left in. A match is won
+ * once it has had at least two players and only one is still standing.
+ *---------------------------------------------------------------------------*/
+void endFinishedMatches(Worker *worker)
+{
+  Room **link = &worker->rooms;
+  while (*link != NULL)
+  {
+    Room *room = *link;
+
+    // A restored seat claimed with REJOIN keeps the room open for its player,
+    // who is on the way; claiming it here stops anyone rejoining a closed room
+    if (room->peakPlayers >= 2 && room->state.clientCount == 1 && !keepForRejoin(room))
+    {
+      for (int i = 0; i < g_roomCapacity; i++)
+      {
+        if (room->clientSockets[i] != -1)
+        {
+          char winMessage[BUFFER_SIZE];
+          snprintf(winMessage, BUFFER_SIZE, "\nPlayer %s wins the game!\n", playerName(i).text);
+          sendMessageToPlayer(room, i, winMessage);
+          printf("Room %d: Player %s wins the game!\n", room->id, playerName(i).text);
+          closeClientSocket(room, i);
+        }
+      }
+    }
+
+    // Bots don't play on among themselves once the last human has gone
+    if (room->botCount > 0 && room->state.clientCount == room->botCount)
+    {
+      for (int i = 0; i < g_roomCapacity; i++)
+      {
+        closeClientSocket(room, i);
+      }
+    }
+
+    if (room->state.gameStarted && room->state.clientCount == 0)
+    {
+      *link = room->next;
+      worker->roomCount--;
+      atomic_fetch_sub(&worker->openSeats, g_roomCapacity);
+      atomic_fetch_sub(&g_roomCount, 1);
+      worker->seatsFreed = 1;
+      atomic_fetch_add(&worker->matchesCompleted, 1);
+      printf("Room %d: match over, room closed\n", room->id);
+      while (room->spectatorCount > 0)
+      {
+        closeSpectator(worker, room->spectators[0], "Match over\n");
+      }
+      submitJournal(room, 1);
+      freeRoom(room);
+      continue;
+    }
+
+    link = &room->next;
+  }
+}
+
+/*---------------------------------------------------------------------------*
+ * Snapshots (-S). Every SNAPSHOT_INTERVAL_SEC each worker copies its rooms
+ * into a fresh buffer between two events, when every room is consistent, and
+ * hands the copy to the snapshot thread. Once every worker has handed one over
+ * the thread writes them out as one file, replacing the previous snapshot by
+ * rename(). The workers only ever pay for the copy; a slow disk just means an
+ * unwritten copy is replaced by a newer one.
+ *---------------------------------------------------------------------------*/
+pthread_mutex_t g_snapshotMutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_snapshotReady = PTHREAD_COND_INITIALIZER;
+SnapshotPart *g_snapshotParts; // latest unwritten part per worker, data NULL if none
+int g_snapshotPartCount;       // workers with a part waiting
+
+void postSnapshot(Worker *worker)
+{
+  // Size it first so the copy is one straight pass
+  size_t len = 0;
+  uint32_t rooms = 0;
+  for (Room *room = worker->rooms; room != NULL; room = room->next)
+  {
+    if (room->state.clientCount > 0)
+    {
+      len += sizeof(RoomSnapshot) + g_roomCapacity * sizeof(SeatSnapshot) +
+             room->state.shurikens.liveCount * sizeof(ShurikenSnapshot);
+      rooms++;
+    }
+  }
+
+  char *data = malloc(len ? len : 1);
+  if (data == NULL)
+  {
+    return; // Try again next interval
+  }
+
+  char *out = data;
+  for (Room *room = worker->rooms; room != NULL; room = room->next)
+  {
+    if (room->state.clientCount == 0)
+    {
+      continue;
+    }
+
+    const ShurikenPool *pool = &room->state.shurikens;
+    RoomSnapshot header = {room->id, room->state.currentTurn, room->state.gameStarted,
+                           room->peakPlayers, room->turnNumber, pool->liveCount};
+    memcpy(out, &header, sizeof(header));
+    out += sizeof(header);
+
+    for (int i = 0; i < g_roomCapacity; i++)
+    {
+      const Player *player = &room->state.players[i];
+      SeatSnapshot seat = {room->seatTokens[i], player->x, player->y, player->hp,
+                           player->shurikens, room->clientSockets[i] == BOT_SOCKET ? 2 : room->clientSockets[i] != -1};
+      memcpy(out, &seat, sizeof(seat));
+      out += sizeof(seat);
+    }
+
+    for (int n = 0; n < pool->liveCount; n++)
+    {
+      int slot = pool->live[n];
+      ShurikenSnapshot shuriken = {pool->x[slot], pool->y[slot], pool->dx[slot], pool->dy[slot],
+                                   pool->step[slot], pool->owner[slot]};
+      memcpy(out, &shuriken, sizeof(shuriken));
+      out += sizeof(shuriken);
+    }
+  }
+
+  pthread_mutex_lock(&g_snapshotMutex);
+  SnapshotPart *part = &g_snapshotParts[worker->id];
+  char *stale = part->data;
+  if (stale == NULL)
+  {
+    g_snapshotPartCount++;
+  }
+  part->data = data;
+  part->len = len;
+  part->rooms = rooms;
+  if (g_snapshotPartCount == g_workerCount)
+  {
+    pthread_cond_signal(&g_snapshotReady);
+  }
+  pthread_mutex_unlock(&g_snapshotMutex);
+  free(stale);
+}
+
+int writeAll(int fd, const void *data, size_t len)
+{
+  for (size_t done = 0; done < len;)
+  {
+    ssize_t n = write(fd, (const char *)data + done, len - done);
+    if (n < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    if (n <= 0)
+    {
+      return -1;
+    }
+    done += n;
+  }
+  return 0;
+}
+
+void *snapshotMain(void *arg)
+{
+  (void)arg;
+  SnapshotPart *parts = calloc(g_workerCount, sizeof(SnapshotPart));
+  char tmpPath[PATH_MAX];
+  snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", g_snapshotPath);
+
+  while (parts != NULL)
+  {
+    pthread_mutex_lock(&g_snapshotMutex);
+    while (g_snapshotPartCount < g_workerCount)
+    {
+      pthread_cond_wait(&g_snapshotReady, &g_snapshotMutex);
+    }
+    memcpy(parts, g_snapshotParts, g_workerCount * sizeof(SnapshotPart));
+    memset(g_snapshotParts, 0, g_workerCount * sizeof(SnapshotPart));
+    g_snapshotPartCount = 0;
+    pthread_mutex_unlock(&g_snapshotMutex);
+
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "BGS1", 4);
+    header.rows = g_map.rows;
+    header.cols = g_map.cols;
+    header.roomCapacity = g_roomCapacity;
+    header.maxShurikens = g_maxShurikens;
+    header.mapHash = mapHash();
+    header.takenNs = realtimeNs();
+    for (int w = 0; w < g_workerCount; w++)
+    {
+      header.roomCount += parts[w].rooms;
+    }
+
+    int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    int failed = fd < 0 || writeAll(fd, &header, sizeof(header)) < 0;
+    for (int w = 0; w < g_workerCount; w++)
+    {
+      failed = failed || writeAll(fd, parts[w].data, parts[w].len) < 0;
+      free(parts[w].data);
+    }
+    // Flushed before the rename, so a crash leaves the old snapshot or the new one
+    failed = failed || fdatasync(fd) < 0;
+    if (fd >= 0)
+    {
+      close(fd);
+    }
+    if (failed || rename(tmpPath, g_snapshotPath) < 0)
+    {
+      perror(g_snapshotPath);
+    }
+  }
+  return NULL;
+}
+
+/*---------------------------------------------------------------------------*
+ * Restore every room of a snapshot before the workers start. Each room goes to
+ * a worker round-robin, its seats are held for REJOIN_WINDOW_MS, and the
+ * seat tokens are indexed so REJOIN is one lookup. A missing file is not an
+ * error: it just means there is nothing to recover.
+ *---------------------------------------------------------------------------*/
+int restoreSnapshot(const char *path)
+{
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  int fd = open(path, O_RDONLY);
+  if (fd < 0)
+  {
+    if (errno == ENOENT)
+    {
+      return 0;
+    }
+    perror(path);
+    return -1;
+  }
+  struct stat st;
+  if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(SnapshotHeader))
+  {
+    fprintf(stderr, "%s: not a snapshot\n", path);
+    close(fd);
+    return -1;
+  }
+  const char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+  {
+    perror("mmap failed");
+    return -1;
+  }
+
+  SnapshotHeader header;
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.magic, "BGS1", 4) != 0 || header.rows != (uint32_t)g_map.rows ||
+      header.cols != (uint32_t)g_map.cols || header.mapHash != mapHash() ||
+      header.roomCapacity != (uint32_t)g_roomCapacity || header.maxShurikens != (uint32_t)g_maxShurikens)
+  {
+    fprintf(stderr, "%s: taken with a different map, -p or -s; start with the same ones to restore it\n", path);
+    munmap((void *)data, st.st_size);
+    return -1;
+  }
+
+  // At most every seat of every room is held; keep the table at most half full
+  size_t seatsInFile = (size_t)header.roomCount * g_roomCapacity;
+  size_t tableSize = 16;
+  while (tableSize < 2 * seatsInFile)
+  {
+    tableSize *= 2;
+  }
+  g_heldSeats = calloc(tableSize, sizeof(HeldSeat));
+  g_heldSeatMask = tableSize - 1;
+  if (g_heldSeats == NULL)
+  {
+    perror("calloc failed");
+    munmap((void *)data, st.st_size);
+    return -1;
+  }
+
+  size_t pos = sizeof(header);
+  size_t seatBytes = g_roomCapacity * sizeof(SeatSnapshot);
+  int maxId = -1;
+  uint32_t restored = 0;
+  for (; restored < header.roomCount; restored++)
+  {
+    RoomSnapshot saved;
+    if (pos + sizeof(saved) + seatBytes > (size_t)st.st_size)
+    {
+      break;
+    }
+    memcpy(&saved, data + pos, sizeof(saved));
+    const char *seats = data + pos + sizeof(saved);
+    const char *shurikens = seats + seatBytes;
+    pos += sizeof(saved) + seatBytes + (size_t)saved.shurikenCount * sizeof(ShurikenSnapshot);
+    if (pos > (size_t)st.st_size || saved.shurikenCount > (uint32_t)(g_roomCapacity * g_maxShurikens))
+    {
+      break;
+    }
+
+    Room *room = allocRoom();
+    if (room == NULL)
+    {
+      perror("failed to restore room");
+      break;
+    }
+    Worker *worker = &g_workers[saved.id % g_workerCount]; // spectators find a room by its id
+    room->id = saved.id;
+    room->worker = worker;
+    room->peakPlayers = saved.peakPlayers;
+    room->turnNumber = saved.turnNumber;
+    room->state.currentTurn = saved.currentTurn;
+    room->state.gameStarted = saved.gameStarted;
+
+    for (int i = 0; i < g_roomCapacity; i++)
+    {
+      SeatSnapshot seat;
+      memcpy(&seat, seats + i * sizeof(seat), sizeof(seat));
+      if (!seat.seated)
+      {
+        continue;
+      }
+      // Bots only play turn-based matches; in real-time mode the seat is freed
+      if (seat.seated == 2 && (g_tickRate > 0 || buildRayTables() < 0))
+      {
+        continue;
+      }
+
+      Player *player = &room->state.players[i];
+      player->x = seat.x;
+      player->y = seat.y;
+      player->hp = seat.hp;
+      player->active = 1;
+      player->shurikens = seat.shurikens;
+      touchPlayer(room, i);
+
+      room->seatTokens[i] = seat.token;
+      room->state.clientCount++;
+      if (seat.seated == 2)
+      {
+        room->clientSockets[i] = BOT_SOCKET;
+        room->botCount++;
+        continue;
+      }
+      room->clientSockets[i] = HELD_SOCKET;
+
+      size_t h = (seat.token * 0x9E3779B97F4A7C15ULL) & g_heldSeatMask;
+      while (g_heldSeats[h].token != 0)
+      {
+        h = (h + 1) & g_heldSeatMask;
+      }
+      g_heldSeats[h].token = seat.token;
+      g_heldSeats[h].worker = worker;
+      g_heldSeats[h].room = room;
+      g_heldSeats[h].slot = i;
+      atomic_init(&g_heldSeats[h].claimed, 0);
+      g_heldSeatCount++;
+    }
+
+    // Slots are handed out in live-list order, so shurikens still move in the
+    // same order; only their slot numbers (the delta S ids) may change
+    ShurikenPool *pool = &room->state.shurikens;
+    for (uint32_t n = 0; n < saved.shurikenCount; n++)
+    {
+      ShurikenSnapshot shuriken;
+      memcpy(&shuriken, shurikens + n * sizeof(shuriken), sizeof(shuriken));
+      int slot = takeShurikenSlot(pool);
+      pool->x[slot] = shuriken.x;
+      pool->y[slot] = shuriken.y;
+      pool->dx[slot] = shuriken.dx;
+      pool->dy[slot] = shuriken.dy;
+      pool->step[slot] = shuriken.step;
+      pool->owner[slot] = shuriken.owner;
+      touchShuriken(room, slot);
+    }
+    refreshPlayerPositions(room);
+
+    // Restored matches are not journaled: a journal replays from an empty room
+    room->next = worker->rooms;
+    worker->rooms = room;
+    worker->roomCount++;
+    atomic_fetch_add(&worker->openSeats, g_roomCapacity - room->state.clientCount);
+    if (room->id > maxId)
+    {
+      maxId = room->id;
+    }
+  }
+  munmap((void *)data, st.st_size);
+
+  g_firstRoomId = maxId + 1;
+  atomic_fetch_add(&g_roomCount, restored);
+  g_rejoinDeadlineMs = nowMs() + REJOIN_WINDOW_MS;
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  double ms = (t1.tv_sec - t0.tv_sec) * 1e3 + (t1.tv_nsec - t0.tv_nsec) / 1e6;
+  printf("Restored %u of %u rooms (%d players held for %d s) from %s in %.2f ms\n", restored, header.roomCount,
+         g_heldSeatCount, REJOIN_WINDOW_MS / 1000, path, ms);
+  return 0;
+}
+
+/*---------------------------------------------------------------------------*
+ * Flush every connection that has output queued. A client whose socket is full
+ * stays queued until EPOLLOUT; once it drains it gets the latest state it
+ * skipped. A client that overflowed its ring buffer or has been unwritable for
+ * longer than g_maxLagMs is disconnected. Disconnecting queues messages for
+ * the rest of the room, so keep going until the dirty list is empty.
+ *---------------------------------------------------------------------------*/
+void flushDirtyConnections(Worker *worker)
+{
+  long long now = nowMs();
+
+  while (worker->dirtyConnections != NULL)
+  {
+    Connection *conn = worker->dirtyConnections;
+    worker->dirtyConnections = conn->nextDirty;
+    conn->dirty = 0;
+
+    // A rejoining client's output goes out from its new worker
+    if (conn->fd == -1 || conn->moving)
+    {
+      continue;
+    }
+
+    if (!conn->lagged && flushOutput(worker, conn) && conn->stateStale)
+    {
+      conn->stateStale = 0;
+      sendLatestState(conn->room, conn);
+      flushOutput(worker, conn);
+    }
+
+    if (conn->blocked && now - conn->blockedSinceMs > g_maxLagMs)
+    {
+      conn->lagged = 1;
+    }
+    if (conn->lagged && conn->spectating)
+    {
+      printf("Room %d: a spectator is too far behind, disconnecting\n", conn->room ? conn->room->id : -1);
+      closeSpectator(worker, conn, NULL);
+    }
+    else if (conn->lagged)
+    {
+      printf("Room %d: Player %s is too far behind, disconnecting\n", conn->room->id, playerName(conn->playerIndex).text);
+      conn->outLen = 0; // Don't bother flushing what it could not take
+      handleDisconnect(conn->room, conn->playerIndex);
+    }
+  }
+}
+
+// Timer tick: catch blocked clients that have not been written to since
+void checkLaggingConnections(Worker *worker)
+{
+  long long now = nowMs();
+  for (Room *room = worker->rooms; room != NULL; room = room->next)
+  {
+    for (int i = 0; i < g_roomCapacity; i++)
+    {
+      Connection *conn = room->connections[i];
+      if (conn != NULL && conn->blocked && now - conn->blockedSinceMs > g_maxLagMs)
+      {
+        conn->lagged = 1;
+        markDirty(worker, conn);
+      }
+    }
+    for (int n = 0; n < room->spectatorCount; n++)
+    {
+      Connection *conn = room->spectators[n];
+      if (conn->blocked && now - conn->blockedSinceMs > g_maxLagMs)
+      {
+        conn->lagged = 1;
+        markDirty(worker, conn);
+      }
+    }
+  }
+}
+
+// Release the connections that were closed during the last batch of events.
+// One that a ring request still points at waits for a later batch.
+void freeClosedConnections(Worker *worker)
+{
+  Connection **link = &worker->closedConnections;
+  while (*link != NULL)
+  {
+    Connection *conn = *link;
+    if (conn->ringOps > 0)
+    {
+      link = &conn->next;
+      continue;
+    }
+    *link = conn->next;
+    free(conn->carry);
+    free(conn->outBuf);
+    free(conn);
+  }
+}
+
+// Send the connections that rejoined a seat to the worker owning that seat,
+// and spectators to the worker owning the room they asked for. A ring
+// connection goes once its receive (and any send) has been cancelled.
+void handOffMovingConnections(Worker *worker)
+{
+  Connection **link = &worker->movingConnections;
+  while (*link != NULL)
+  {
+    Connection *conn = *link;
+    if (conn->ringOps > 0)
+    {
+      ringCancel(worker, conn);
+      link = &conn->next;
+      continue;
+    }
+    *link = conn->next;
+    if (!conn->viaRing)
+    {
+      epoll_ctl(worker->epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+    }
+    Worker *owner = conn->spectating ? &g_workers[conn->watchRoomId % g_workerCount] : conn->room->worker;
+    postToWorker(owner, conn, &worker->metrics);
+  }
+}
+
+// Tick timer: one real-time step for every room on this worker. Expirations
+// that piled up while the worker was busy are counted, not run, so an
+// overloaded server slows the game down instead of lurching ahead.
+void runWorkerTick(Worker *worker)
+{
+  uint64_t expirations = 0;
+  if (read(worker->tickFd, &expirations, sizeof(expirations)) < 0 || expirations == 0)
+  {
+    return;
+  }
+  Metrics *metrics = &worker->metrics;
+  if (expirations > 1)
+  {
+    statAdd(&metrics->counters[STAT_TICKS_MISSED], expirations - 1);
+  }
+
+  long long start = nowNs();
+  for (Room *room = worker->rooms; room != NULL; room = room->next)
+  {
+    runRoomTick(room);
+  }
+  long long elapsed = nowNs() - start;
+
+  statAdd(&metrics->counters[STAT_TICKS], 1);
+  histRecord(&metrics->histograms[HIST_TICK_NS], elapsed);
+  if (elapsed > 1000000000LL / g_tickRate)
+  {
+    statAdd(&metrics->counters[STAT_TICK_OVERRUNS], 1);
+  }
+}
+
+/*---------------------------------------------------------------------------*
+ * Accepting players. Every worker listens on the game port with a socket of
+ * its own (SO_REUSEPORT), so the kernel spreads the accept work over the
+ * workers. Each player is seated by the worker dealPlayer picks: the one that
+ * accepted it, or another one through that worker's inbox.
+ *---------------------------------------------------------------------------*/
+// Wrap an accepted (non-blocking) socket for a worker. NULL if it could not
+// be set up; the caller still owns the socket then.
+Connection *newConnection(int sock)
+{
+  // Output is already gathered into one send per flush, so Nagle would only
+  // hold a client's next frame back until it ACKs the previous one
+  int noDelay = 1;
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay));
+
+  Connection *conn = calloc(1, sizeof(Connection));
+  if (conn == NULL)
+  {
+    perror("failed to set up connection");
+    free(conn);
+    return NULL;
+  }
+  conn->fd = sock;
+  conn->playerIndex = -1;
+  conn->room = NULL;
+  return conn;
+}
+
+// Accept up to ACCEPT_BATCH pending players. The listener is level-triggered,
+// so whatever is left over wakes the worker again after its next batch.
+void acceptPlayers(Worker *worker)
+{
+  for (int i = 0; i < ACCEPT_BATCH; i++)
+  {
+    struct sockaddr_in clientAddr;
+    socklen_t clientLen = sizeof(clientAddr);
+    int newSock = accept4(worker->listenFd, (struct sockaddr *)&clientAddr, &clientLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (newSock < 0)
+    {
+      if (errno == EINTR || errno == ECONNABORTED)
+      {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+      {
+        perror("accept failed");
+      }
+      return;
+    }
+
+    // Queue new clients if every seat is taken, if no room can be opened for
+    // them, or if others are already waiting so nobody jumps the queue. A seat
+    // taken here is given back if the client isn't seated.
+    Room *room = NULL;
+    Worker *owner = NULL;
+    int queue = anyoneWaiting();
+    if (!queue && atomic_fetch_add(&g_playerCount, 1) >= g_maxRooms * g_roomCapacity)
+    {
+      atomic_fetch_sub(&g_playerCount, 1);
+      queue = 1;
+    }
+    else if (!queue && (owner = dealPlayer()) == worker && (room = findOpenRoom(worker)) == NULL)
+    {
+      atomic_fetch_sub(&g_playerCount, 1);
+      queue = 1;
+    }
+    if (queue)
+    {
+      if (postArrival(worker, newSock) < 0)
+      {
+        rejectClient(newSock);
+        statAdd(&worker->metrics.counters[STAT_REJECTS], 1);
+      }
+      continue;
+    }
+
+    Connection *conn = newConnection(newSock);
+    if (conn == NULL)
+    {
+      close(newSock);
+      releaseSeat(worker);
+      continue;
+    }
+
+    // Numeric only: a reverse DNS lookup here would stall every room on this worker
+    char host[INET_ADDRSTRLEN];
+    inet_ntop(AF_INET, &clientAddr.sin_addr, host, sizeof(host));
+    printf("New client connected! Connected to (%s, %d). Active clients: %d/%d\n", host, ntohs(clientAddr.sin_port),
+           atomic_load(&g_playerCount), g_maxRooms * g_roomCapacity);
+
+    statAdd(&worker->metrics.counters[STAT_CONNECTS], 1);
+    if (owner != worker)
+    {
+      postToWorker(owner, conn, &worker->metrics); // seated with the players dealt to it just before
+      continue;
+    }
+    seatConnection(worker, conn, room);
+  }
+}
+
+/*---------------------------------------------------------------------------*
+ * Worker thread: one epoll loop driving every room this worker owns
+ *---------------------------------------------------------------------------*/
+// Tell the acceptor seats opened up or clients arrived for its queue, once per
+// batch and only when clients are waiting
+void announceFreedSeats(Worker *worker)
+{
+  if (!worker->seatsFreed && !worker->arrivalsPosted)
+  {
+    return;
+  }
+  worker->seatsFreed = 0;
+  worker->arrivalsPosted = 0;
+  if (anyoneWaiting())
+  {
+    uint64_t one = 1;
+    write(g_admitFd, &one, sizeof(one));
+  }
+}
+
+// Handle one batch of epoll events: the inbox, the timers, and every socket
+// that is not on the ring
+void handleWorkerEvents(Worker *worker, struct epoll_event *events, int n)
+{
+  for (int i = 0; i < n; i++)
+  {
+    Connection *conn = events[i].data.ptr;
+    if (conn == NULL)
+    {
+      drainInbox(worker);
+      continue;
+    }
+    if (events[i].data.ptr == (void *)&worker->tickFd)
+    {
+      runWorkerTick(worker);
+      continue;
+    }
+    if (events[i].data.ptr == (void *)&worker->listenFd)
+    {
+      acceptPlayers(worker);
+      continue;
+    }
+    if (events[i].data.ptr == (void *)worker)
+    {
+      uint64_t expirations;
+      while (read(worker->timerFd, &expirations, sizeof(expirations)) > 0)
+      {
+        // Drain the timer
+      }
+      checkLaggingConnections(worker);
+      for (Room *room = worker->rooms; room != NULL; room = room->next)
+      {
+        submitJournal(room, 0);
+      }
+      if (g_snapshotPath != NULL && ++worker->snapshotTicks >= SNAPSHOT_INTERVAL_SEC)
+      {
+        worker->snapshotTicks = 0;
+        postSnapshot(worker);
+      }
+      if (g_heldSeatCount > 0 && !worker->heldSeatsExpired && nowMs() >= g_rejoinDeadlineMs)
+      {
+        expireHeldSeats(worker);
+      }
+      if (g_botDelaySec >= 0)
+      {
+        fillRoomsWithBots(worker);
+      }
+      continue;
+    }
+
+    // Skip connections closed earlier in this batch (e.g. killed by a
+    // shuriken) or on their way to another room
+    if (conn->fd == -1 || conn->moving)
+    {
+      continue;
+    }
+
+    if (events[i].events & EPOLLOUT &&
+        (conn->outLen > 0 || conn->stateStale || conn->frameSending != NULL || conn->framePending != NULL))
+    {
+      markDirty(worker, conn);
+    }
+    if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+    {
+      if (conn->spectating)
+      {
+        handleSpectatorReadable(worker, conn);
+      }
+      else
+      {
+        handleReadable(conn);
+      }
+    }
+  }
+}
+
+// Ring mode: the epoll fd polled readable, take everything it has
+void drainEpoll(Worker *worker)
+{
+  struct epoll_event events[MAX_EVENTS];
+  int n;
+  do
+  {
+    n = epoll_wait(worker->epollFd, events, MAX_EVENTS, 0);
+    statAdd(&worker->metrics.counters[STAT_WAIT_CALLS], 1);
+    handleWorkerEvents(worker, events, n);
+  } while (n == MAX_EVENTS);
+}
+
+// Work deferred to the end of every batch
+void finishBatch(Worker *worker)
+{
+  runBotTurns(worker);
+  endFinishedMatches(worker);
+  flushDirtyConnections(worker);
+  handOffMovingConnections(worker);
+  freeClosedConnections(worker);
+  announceFreedSeats(worker);
+}
+
+/*---------------------------------------------------------------------------*
+ * io_uring completions. Received bytes go through the same command parser as
+ * the epoll path; finished sends advance the ring buffer like send() would.
+ *---------------------------------------------------------------------------*/
+
+// Run what a receive delivered. Once a REJOIN has the connection moving, its
+// receive is cancelled at once; whatever still arrives is carried over.
+void ringDeliver(Worker *worker, Connection *conn, const char *data, size_t len)
+{
+  deliverInput(conn, data, len);
+  if (conn->moving)
+  {
+    ringCancel(worker, conn);
+  }
+}
+
+void ringReceived(Worker *worker, Connection *conn, struct io_uring_cqe *cqe)
+{
+  Ring *ring = &worker->ring;
+  if (cqe->flags & IORING_CQE_F_BUFFER)
+  {
+    unsigned short bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (cqe->res > 0)
+    {
+      statAdd(&worker->metrics.counters[STAT_RING_RECVS], 1);
+      ringDeliver(worker, conn, ring->bufs + (size_t)bid * RING_BUF_SIZE, cqe->res);
+    }
+    ringAddBuffer(ring, bid);
+  }
+  if (cqe->flags & IORING_CQE_F_MORE)
+  {
+    return;
+  }
+
+  // The receive has ended. It is re-armed if it only ran out of buffers;
+  // end of file or an error means the client is gone.
+  conn->ringOps--;
+  if (conn->fd == -1 || conn->moving || conn->ringCancelled)
+  {
+    return;
+  }
+  if (cqe->res > 0 || cqe->res == -ENOBUFS)
+  {
+    ringArmRecv(worker, conn);
+    return;
+  }
+  handleDisconnect(conn->room, conn->playerIndex);
+}
+
+void ringSent(Worker *worker, Connection *conn, int res)
+{
+  size_t len = conn->ringSendLen;
+  conn->ringOps--;
+  conn->ringSendLen = 0;
+  if (conn->fd == -1 || res == -ECANCELED || res == -EAGAIN)
+  {
+    return;
+  }
+  if (res < 0)
+  {
+    // The peer is gone; the read side reports the disconnect
+    conn->outLen = 0;
+    return;
+  }
+
+  statAdd(&worker->metrics.counters[STAT_BYTES_SENT], res);
+  conn->outHead = (conn->outHead + res) % g_outbufSize;
+  conn->outLen -= res;
+  if (conn->outLen == 0)
+  {
+    conn->outHead = 0;
+  }
+  // A short send means the client's socket buffer filled up while we waited
+  if ((size_t)res == len)
+  {
+    conn->blocked = 0;
+  }
+  if (conn->outLen > 0 || conn->stateStale)
+  {
+    markDirty(worker, conn);
+  }
+}
+
+// Take every completion the ring has. The worker's epoll fd shows up here too,
+// for timers, the inbox and spectators.
+void ringReap(Worker *worker)
+{
+  Ring *ring = &worker->ring;
+  unsigned head = *ring->cqHead;
+  unsigned tail;
+  while (head != (tail = __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE)))
+  {
+    for (; head != tail; head++)
+    {
+      struct io_uring_cqe *cqe = &ring->cqes[head & ring->cqMask];
+      Connection *conn = (Connection *)(uintptr_t)(cqe->user_data & ~(uint64_t)RING_TAG_MASK);
+      switch (cqe->user_data & RING_TAG_MASK)
+      {
+      case RING_EPOLL:
+        drainEpoll(worker);
+        if (!(cqe->flags & IORING_CQE_F_MORE))
+        {
+          ringWatchEpoll(worker);
+        }
+        break;
+      case RING_RECV:
+        ringReceived(worker, conn, cqe);
+        break;
+      case RING_SEND:
+        ringSent(worker, conn, cqe->res);
+        break;
+      }
+    }
+    __atomic_store_n(ring->cqHead, head, __ATOMIC_RELEASE);
+  }
+}
+
+// Try what the backend needs on a socket pair: a ring, provided buffers and a
+// multishot receive (Linux 6.0+). 0 if it all works.
+int ringProbe(void)
+{
+  Worker *worker = calloc(1, sizeof(Worker));
+  Connection *conn = calloc(1, sizeof(Connection));
+  if (worker == NULL || conn == NULL || ringOpen(&worker->ring) < 0)
+  {
+    free(worker);
+    free(conn);
+    return -1;
+  }
+
+  int works = 0;
+  int pair[2];
+  if (ringEnable(&worker->ring) == 0 && socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == 0)
+  {
+    conn->fd = pair[0];
+    ringArmRecv(worker, conn);
+    if (write(pair[1], "x", 1) == 1)
+    {
+      ringSubmit(worker, 1);
+      Ring *ring = &worker->ring;
+      if (*ring->cqHead != __atomic_load_n(ring->cqTail, __ATOMIC_ACQUIRE))
+      {
+        struct io_uring_cqe *cqe = &ring->cqes[*ring->cqHead & ring->cqMask];
+        works = cqe->res == 1 && (cqe->flags & IORING_CQE_F_MORE);
+      }
+    }
+    close(pair[0]);
+    close(pair[1]);
+  }
+  ringClose(&worker->ring);
+  free(worker);
+  free(conn);
+  return works ? 0 : -1;
+}
+
+void *workerMain(void *arg)
+{
+  Worker *worker = arg;
+
+  // Pin the worker to its own core so its rooms stay cache-hot
+  long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpuCount > 0)
+  {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(worker->id % cpuCount, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+  }
+
+  // Ring mode: one io_uring_enter per batch submits the sends the last batch
+  // prepared and waits for the next completions
+  if (worker->ring.fd >= 0)
+  {
+    if (ringEnable(&worker->ring) < 0)
+    {
+      perror("io_uring enable failed");
+      return NULL;
+    }
+    ringWatchEpoll(worker);
+    while (1)
+    {
+      ringSubmit(worker, !worker->botsPending);
+      ringReap(worker);
+      finishBatch(worker);
+    }
+  }
+
+  struct epoll_event events[MAX_EVENTS];
+  while (1)
+  {
+    // Bots left waiting for their turn only get a look at what is ready
+    int n = epoll_wait(worker->epollFd, events, MAX_EVENTS, worker->botsPending ? 0 : -1);
+    statAdd(&worker->metrics.counters[STAT_WAIT_CALLS], 1);
+    if (n < 0)
+    {
+      if (errno == EINTR)
+      {
+        continue;
+      }
+      perror("epoll_wait failed");
+      break;
+    }
+
+    handleWorkerEvents(worker, events, n);
+    finishBatch(worker);
+  }
+
+  return NULL;
+}
+
+int startWorker(Worker *worker, int id)
+{
+  // rooms and roomCount may already hold rooms restored from a snapshot
+  worker->id = id;
+  worker->nextRoomId = g_firstRoomId + ((id - g_firstRoomId % g_workerCount) + g_workerCount) % g_workerCount;
+  atomic_init(&worker->inbox, NULL);
+  worker->ring.fd = -1;
+  worker->closedConnections = NULL;
+  worker->dirtyConnections = NULL;
+  atomic_init(&worker->matchesCompleted, 0);
+  if (getrandom(&worker->tokenState, sizeof(worker->tokenState), 0) != sizeof(worker->tokenState))
+  {
+    worker->tokenState = realtimeNs() ^ ((uint64_t)id << 48);
+  }
+  worker->stateFrame = malloc(g_frameBound);
+  worker->deltaFrame = malloc(g_frameBound);
+  if (worker->stateFrame == NULL || worker->deltaFrame == NULL)
+  {
+    return -1;
+  }
+
+  worker->epollFd = epoll_create1(0);
+  worker->wakeFd = eventfd(0, EFD_NONBLOCK);
+  worker->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if (worker->epollFd < 0 || worker->wakeFd < 0 || worker->timerFd < 0)
+  {
+    return -1;
+  }
+  if (g_useRing && ringOpen(&worker->ring) < 0)
+  {
+    return -1;
+  }
+
+  struct itimerspec everySecond = {{1, 0}, {1, 0}};
+  timerfd_settime(worker->timerFd, 0, &everySecond, NULL);
+
+  // The wake eventfd is registered with a NULL data.ptr and the timer with the
+  // worker itself; everything else points at a Connection
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = NULL;
+  if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->wakeFd, &ev) < 0)
+  {
+    return -1;
+  }
+  ev.data.ptr = worker;
+  if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->timerFd, &ev) < 0)
+  {
+    return -1;
+  }
+
+  // The listener goes in with a pointer to its fd, level-triggered so that
+  // accepting in bounded batches never strands a connection
+  struct epoll_event listenEv;
+  listenEv.events = EPOLLIN;
+  listenEv.data.ptr = &worker->listenFd;
+  if (epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->listenFd, &listenEv) < 0)
+  {
+    return -1;
+  }
+
+  // Real-time mode: the tick timer is registered with a pointer to its fd
+  if (g_tickRate > 0)
+  {
+    long periodNs = 1000000000L / g_tickRate;
+    struct itimerspec everyTick = {{periodNs / 1000000000L, periodNs % 1000000000L}, {periodNs / 1000000000L, periodNs % 1000000000L}};
+    worker->tickFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    ev.data.ptr = &worker->tickFd;
+    if (worker->tickFd < 0 || timerfd_settime(worker->tickFd, 0, &everyTick, NULL) < 0 ||
+        epoll_ctl(worker->epollFd, EPOLL_CTL_ADD, worker->tickFd, &ev) < 0)
+    {
+      return -1;
+    }
+  }
+
+  return pthread_create(&worker->thread, NULL, workerMain, worker);
+}
+
+/*---------------------------------------------------------------------------*
+ * Socket helpers
+ *---------------------------------------------------------------------------*/
+int setNonBlocking(int fd)
+{
+  int flags = fcntl(fd, F_GETFL, 0);
+  if (flags < 0)
+  {
+    return -1;
+  }
+  return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+// Idle connections only cost a file descriptor now, so let the process use as
+// many as the hard limit allows
+void raiseFileLimit()
+{
+  struct rlimit lim;
+  if (getrlimit(RLIMIT_NOFILE, &lim) == 0 && lim.rlim_cur < lim.rlim_max)
+  {
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &lim);
+  }
+}
+
+// Bind a listening socket on any address. With reusePort, several sockets can
+// share the port and the kernel spreads connections over them. Returns it, or -1.
+int openListener(const char *portArg, int backlog, int reusePort)
+{
+  struct addrinfo *p, *listp, hints; // Exists in netdb.h which I had imported on top of the boilerplate
+  memset(&hints, 0, sizeof(struct addrinfo));
+  hints.ai_family = AF_INET;                   // IPv4
+  hints.ai_socktype = SOCK_STREAM;             // TCP Connections
+  hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG; // Since host is NULL and we need a wildcard address or on any IP address
+  hints.ai_flags |= AI_NUMERICSERV;            // Using port number
+
+  int rc, optval = 1;
+
+  if ((rc = getaddrinfo(NULL, portArg, &hints, &listp)) != 0)
+  {
+    fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(rc));
+    return -1;
+  }
+
+  int listenSock = -1;
+
+  for (p = listp; p != NULL; p = p->ai_next)
+  {
+    listenSock = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (listenSock < 0)
+    {
+      perror("socket creation failed");
+      continue;
+    }
+
+    // Eliminates "Address already in use" error from bind
+    setsockopt(listenSock, SOL_SOCKET, SO_REUSEADDR,
+               (const void *)&optval, sizeof(int));
+    if (reusePort && setsockopt(listenSock, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0)
+    {
+      perror("SO_REUSEPORT failed");
+      close(listenSock);
+      continue;
+    }
+
+    if (bind(listenSock, p->ai_addr, p->ai_addrlen) < 0)
+    {
+      perror("bind failed");
+      close(listenSock);
+      continue;
+    }
+
+    break;
+  }
+
+  // Free result anyways
+  freeaddrinfo(listp);
+
+  if (p == NULL)
+  {
+    fprintf(stderr, "Failed to bind to any address\n");
+    return -1;
+  }
+
+  if (listen(listenSock, backlog) < 0 || setNonBlocking(listenSock) < 0)
+  {
+    perror("listen failed");
+    close(listenSock);
+    return -1;
+  }
+  return listenSock;
+}
+
+/*---------------------------------------------------------------------------*
+ * Admission queue. Clients that arrive while every seat is taken wait here,
+ * oldest first, instead of being turned away; once the queue is non-empty new
+ * arrivals join the back of it too. Workers post such clients to g_arrivals
+ * and the acceptor thread moves them into the ring, which only it touches, so
+ * each entry is just the socket and when it arrived, and enqueue and dequeue
+ * are O(1). Whenever a room can be opened, up to g_roomCapacity of
+ * them are handed to one worker together and start a match of their own;
+ * while every room is in use, they fill the seats left free in running ones.
+ *---------------------------------------------------------------------------*/
+Waiter *g_waiters; // MAX_WAITING-entry ring, allocated the first time anyone waits
+unsigned int g_waitHead; // oldest waiter
+
+// Queue a client for the next free room. -1 if the queue is full.
+int enqueueWaiter(int sock, long long sinceNs)
+{
+  int waiting = atomic_load(&g_waitingCount);
+  if (waiting >= MAX_WAITING)
+  {
+    return -1;
+  }
+  if (g_waiters == NULL && (g_waiters = malloc(MAX_WAITING * sizeof(Waiter))) == NULL)
+  {
+    perror("malloc failed");
+    return -1;
+  }
+
+  Waiter *waiter = &g_waiters[(g_waitHead + waiting) & (MAX_WAITING - 1)];
+  waiter->fd = sock;
+  waiter->sinceNs = sinceNs;
+  atomic_store(&g_waitingCount, waiting + 1);
+  statAdd(&g_acceptorMetrics.counters[STAT_QUEUED], 1);
+
+  char msg[BUFFER_SIZE];
+  int len = snprintf(msg, BUFFER_SIZE, "Queued for a match: %d ahead of you\n", waiting);
+  send(sock, msg, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+  return 0;
+}
+
+Waiter dequeueWaiter(void)
+{
+  Waiter waiter = g_waiters[g_waitHead];
+  g_waitHead = (g_waitHead + 1) & (MAX_WAITING - 1);
+  atomic_fetch_sub(&g_waitingCount, 1);
+  return waiter;
+}
+
+// A waiter that hung up shows as end-of-file (or a reset) under a peek; bytes
+// it already typed stay queued for its worker
+int waiterGone(int sock)
+{
+  char byte;
+  ssize_t n = recv(sock, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+  return n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR);
+}
+
+// Move the clients workers have posted into the queue, in the order they came.
+// They stay counted in g_arrivingCount until they are in it.
+void takeArrivals(void)
+{
+  Arrival *list = atomic_exchange_explicit(&g_arrivals, NULL, memory_order_acquire);
+  Arrival *ordered = NULL;
+  while (list != NULL)
+  {
+    Arrival *next = list->next;
+    list->next = ordered;
+    ordered = list;
+    list = next;
+  }
+
+  int count = 0;
+  while (ordered != NULL)
+  {
+    Arrival *next = ordered->next;
+    if (enqueueWaiter(ordered->waiter.fd, ordered->waiter.sinceNs) < 0)
+    {
+      rejectClient(ordered->waiter.fd);
+      statAdd(&g_acceptorMetrics.counters[STAT_REJECTS], 1);
+    }
+    free(ordered);
+    ordered = next;
+    count++;
+  }
+  atomic_fetch_sub(&g_arrivingCount, count);
+}
+
+// Reserve a free seat in some worker's rooms. NULL if every room is full.
+Worker *reserveOpenSeat(void)
+{
+  static unsigned long nextWorker = 0;
+  for (int n = 0; n < g_workerCount; n++)
+  {
+    Worker *worker = &g_workers[(nextWorker + n) % g_workerCount];
+    int open = atomic_load(&worker->openSeats);
+    while (open > 0)
+    {
+      if (atomic_compare_exchange_weak(&worker->openSeats, &open, open - 1))
+      {
+        nextWorker += n + 1;
+        return worker;
+      }
+    }
+  }
+  return NULL;
+}
+
+// Every room is in use: hand queued clients, oldest first, to the workers with
+// seats free in rooms that are already running (left by a QUIT, a death, a
+// disconnect). The rest wait until a seat frees up or a room closes.
+void admitToOpenSeats(void)
+{
+  Worker *worker;
+  while (atomic_load(&g_waitingCount) > 0 && (worker = reserveOpenSeat()) != NULL)
+  {
+    if (atomic_fetch_add(&g_playerCount, 1) >= g_maxRooms * g_roomCapacity)
+    {
+      atomic_fetch_sub(&g_playerCount, 1);
+      atomic_fetch_add(&worker->openSeats, 1);
+      return;
+    }
+
+    Waiter waiter = dequeueWaiter();
+    Connection *conn = NULL;
+    if (waiterGone(waiter.fd) || (conn = newConnection(waiter.fd)) == NULL)
+    {
+      statAdd(&g_acceptorMetrics.counters[STAT_QUEUE_ABANDONED], 1);
+      close(waiter.fd);
+      atomic_fetch_sub(&g_playerCount, 1);
+      atomic_fetch_add(&worker->openSeats, 1);
+      continue;
+    }
+
+    conn->seatReserved = 1;
+    histRecord(&g_acceptorMetrics.histograms[HIST_QUEUE_WAIT_NS], nowNs() - waiter.sinceNs);
+    statAdd(&g_acceptorMetrics.counters[STAT_QUEUE_ADMITTED], 1);
+    postToWorker(worker, conn, &g_acceptorMetrics);
+  }
+}
+
+// Seat queued clients for as long as rooms and player slots allow. Runs when a
+// worker reports freed seats or has posted arrivals; since each arrival is
+// posted after its worker found no seat, this also covers a seat freed just as
+// its client was being queued.
+void admitWaiting(void)
+{
+  static unsigned long batchCount = 0;
+  uint64_t count;
+  while (read(g_admitFd, &count, sizeof(count)) > 0)
+  {
+    // Reset the eventfd counter
+  }
+  if (atomic_load(&g_arrivingCount) > 0)
+  {
+    takeArrivals();
+  }
+
+  while (atomic_load(&g_waitingCount) > 0)
+  {
+    // Reserve the room here so the worker is certain to have one for the batch.
+    // With every room in use, fill the seats that are free in them instead.
+    if (atomic_fetch_add(&g_roomCount, 1) >= g_maxRooms)
+    {
+      atomic_fetch_sub(&g_roomCount, 1);
+      admitToOpenSeats();
+      return;
+    }
+
+    Worker *worker = &g_workers[batchCount++ % g_workerCount];
+    int seated = 0, seatsLeft = 1;
+    while (seated < g_roomCapacity && atomic_load(&g_waitingCount) > 0)
+    {
+      if (atomic_fetch_add(&g_playerCount, 1) >= g_maxRooms * g_roomCapacity)
+      {
+        atomic_fetch_sub(&g_playerCount, 1);
+        seatsLeft = 0;
+        break;
+      }
 
-      if (nx < 0 || nx >= GRID_ROWS || ny < 0 || ny >= GRID_COLS || g_gameState.grid[nx][ny] == '#')
+      Waiter waiter = dequeueWaiter();
+      Connection *conn = NULL;
+      if (waiterGone(waiter.fd) || (conn = newConnection(waiter.fd)) == NULL)
       {
-        g_gameState.players[i].shuriken.active = 0;
+        statAdd(&g_acceptorMetrics.counters[STAT_QUEUE_ABANDONED], 1);
+        close(waiter.fd);
+        atomic_fetch_sub(&g_playerCount, 1);
         continue;
       }
 
-      g_gameState.players[i].shuriken.x = nx;
-      g_gameState.players[i].shuriken.y = ny;
+      conn->roomReserved = seated == 0;
+      histRecord(&g_acceptorMetrics.histograms[HIST_QUEUE_WAIT_NS], nowNs() - waiter.sinceNs);
+      statAdd(&g_acceptorMetrics.counters[STAT_QUEUE_ADMITTED], 1);
+      postToWorker(worker, conn, &g_acceptorMetrics);
+      seated++;
+    }
+
+    if (seated == 0)
+    {
+      atomic_fetch_sub(&g_roomCount, 1); // everyone dequeued had left, or no slots
+    }
+    if (!seatsLeft)
+    {
+      return;
+    }
+  }
+}
+
+// Spectators do not count against the player limit; they are spread over the
+// workers and wait there for their WATCH
+void acceptSpectators(int spectatorSock)
+{
+  static unsigned long acceptedCount = 0;
 
-      if (checkShurikenCollision(i, nx, ny))
+  while (1)
+  {
+    int newSock = accept4(spectatorSock, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (newSock < 0)
+    {
+      if (errno == EINTR || errno == ECONNABORTED)
       {
         continue;
       }
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+      {
+        perror("accept failed");
+      }
+      return;
+    }
+
+    Connection *conn = newConnection(newSock);
+    if (conn == NULL)
+    {
+      close(newSock);
+      continue;
+    }
+    conn->spectating = 1;
+    conn->watchRoomId = -1;
+
+    postToWorker(&g_workers[acceptedCount++ % g_workerCount], conn, &g_acceptorMetrics);
+  }
+}
+
+/*---------------------------------------------------------------------------*
+ * Print how many matches each worker finished since the last report
+ *---------------------------------------------------------------------------*/
+void reportMatchThroughput(unsigned long *lastCompleted, double seconds)
+{
+  int anyActivity = 0;
+  for (int i = 0; i < g_workerCount; i++)
+  {
+    if (atomic_load(&g_workers[i].matchesCompleted) != lastCompleted[i])
+    {
+      anyActivity = 1;
+    }
+  }
+  if (!anyActivity)
+  {
+    return;
+  }
+
+  for (int i = 0; i < g_workerCount; i++)
+  {
+    unsigned long completed = atomic_load(&g_workers[i].matchesCompleted);
+    printf("Worker %d: %.2f matches/sec (%lu completed)\n", i, (completed - lastCompleted[i]) / seconds, completed);
+    lastCompleted[i] = completed;
+  }
+  fflush(stdout);
+}
+
+/*---------------------------------------------------------------------------*
+ * Stats endpoint (-M). Every connection to the Unix socket gets one text dump
+ * of the counters and histograms summed over all threads, then is closed:
+ *   socat - UNIX-CONNECT:/tmp/battle.sock
+ *---------------------------------------------------------------------------*/
+const char *g_counterNames[STAT_COUNTERS] = {
+    "connects", "rejects", "disconnects", "commands", "broadcasts", "broadcast_bytes",
+    "send_calls", "bytes_sent", "recv_calls", "inbox_posts", "inbox_retries",
+    "ticks", "tick_overruns", "ticks_missed", "spectators", "frames_built", "frames_reused",
+    "queued", "queue_admitted", "queue_abandoned", "wait_calls", "ring_recvs", "ring_sends",
+    "bot_turns", "bot_nodes"};
+const char *g_histogramNames[STAT_HISTOGRAMS] = {
+    "command_ns", "turn_ns", "broadcast_bytes_each", "inbox_wait_ns", "tick_ns", "queue_wait_ns",
+    "bot_turn_ns"};
+
+void addMetrics(Metrics *total, Metrics *metrics)
+{
+  for (int c = 0; c < STAT_COUNTERS; c++)
+  {
+    atomic_store(&total->counters[c], atomic_load(&total->counters[c]) + atomic_load_explicit(&metrics->counters[c], memory_order_relaxed));
+  }
+  for (int h = 0; h < STAT_HISTOGRAMS; h++)
+  {
+    Histogram *sum = &total->histograms[h], *hist = &metrics->histograms[h];
+    for (int b = 0; b < HIST_BUCKETS; b++)
+    {
+      atomic_store(&sum->buckets[b], atomic_load(&sum->buckets[b]) + atomic_load_explicit(&hist->buckets[b], memory_order_relaxed));
+    }
+    atomic_store(&sum->count, atomic_load(&sum->count) + atomic_load_explicit(&hist->count, memory_order_relaxed));
+    atomic_store(&sum->sum, atomic_load(&sum->sum) + atomic_load_explicit(&hist->sum, memory_order_relaxed));
+    unsigned long max = atomic_load_explicit(&hist->max, memory_order_relaxed);
+    if (max > atomic_load(&sum->max))
+    {
+      atomic_store(&sum->max, max);
+    }
+  }
+}
+
+// Smallest bucket top with at least `fraction` of the samples at or below it.
+// Counts are read while workers keep recording, so stop at the last bucket.
+unsigned long histPercentile(Histogram *hist, unsigned long count, double fraction)
+{
+  unsigned long want = (unsigned long)(fraction * count), seen = 0;
+  for (int b = 0; b < HIST_BUCKETS; b++)
+  {
+    seen += atomic_load(&hist->buckets[b]);
+    if (seen > want)
+    {
+      unsigned long top = histBucketTop(b), max = atomic_load(&hist->max);
+      return top < max ? top : max;
+    }
+  }
+  return atomic_load(&hist->max);
+}
+
+size_t formatStats(char *out, size_t cap)
+{
+  static Metrics total; // too big for the stack; only the main thread formats
+  memset(&total, 0, sizeof(total));
+  addMetrics(&total, &g_acceptorMetrics);
+  for (int w = 0; w < g_workerCount; w++)
+  {
+    addMetrics(&total, &g_workers[w].metrics);
+  }
+
+  size_t len = 0;
+  len += snprintf(out + len, cap - len, "uptime_sec %.3f\nworkers %d\nrooms %d\nplayers %d\nqueue_depth %d\n",
+                  (nowNs() - g_startNs) / 1e9, g_workerCount, atomic_load(&g_roomCount), atomic_load(&g_playerCount),
+                  atomic_load(&g_waitingCount));
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) == 0)
+  {
+    len += snprintf(out + len, cap - len, "cpu_user_sec %ld.%06ld\ncpu_sys_sec %ld.%06ld\n",
+                    (long)usage.ru_utime.tv_sec, (long)usage.ru_utime.tv_usec,
+                    (long)usage.ru_stime.tv_sec, (long)usage.ru_stime.tv_usec);
+  }
+  for (int c = 0; c < STAT_COUNTERS && len < cap; c++)
+  {
+    len += snprintf(out + len, cap - len, "%s %lu\n", g_counterNames[c], atomic_load(&total.counters[c]));
+  }
+  for (int h = 0; h < STAT_HISTOGRAMS && len < cap; h++)
+  {
+    Histogram *hist = &total.histograms[h];
+    unsigned long count = atomic_load(&hist->count);
+    len += snprintf(out + len, cap - len, "%s count %lu mean %lu p50 %lu p90 %lu p99 %lu p999 %lu max %lu\n",
+                    g_histogramNames[h], count, count ? atomic_load(&hist->sum) / count : 0,
+                    histPercentile(hist, count, 0.5), histPercentile(hist, count, 0.9),
+                    histPercentile(hist, count, 0.99), histPercentile(hist, count, 0.999), atomic_load(&hist->max));
+  }
+  return len < cap ? len : cap - 1;
+}
+
+int openStatsSocket(const char *path)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path))
+  {
+    fprintf(stderr, "Stats socket path too long: %s\n", path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+  unlink(path); // Left over from an earlier run
+
+  int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0);
+  if (sock < 0 || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(sock, LISTENQ) < 0)
+  {
+    perror(path);
+    if (sock >= 0)
+    {
+      close(sock);
+    }
+    return -1;
+  }
+  return sock;
+}
+
+void serveStats(int statsSock)
+{
+  static char dump[8192];
+  int client;
+  while ((client = accept(statsSock, NULL, NULL)) >= 0)
+  {
+    size_t len = formatStats(dump, sizeof(dump));
+    send(client, dump, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    close(client);
+  }
+}
+
+/*---------------------------------------------------------------------------*
+ * Encoder benchmark (./server -B). Compares buildStateString against the old
+ * strcat/sprintf version, which is kept here only as a baseline. Use -m to
+ * benchmark bigger maps, e.g. ./server -m 200x200 -B.
+ *---------------------------------------------------------------------------*/
+void legacyBuildStateString(Room *room, const char *grid, char *outBuffer)
+{
+  outBuffer[0] = '\0';
+  strcat(outBuffer, "\nSTATE:\n\n");
+  for (int r = 0; r < g_map.rows; r++)
+  {
+    for (int c = 0; c < g_map.cols; c++)
+    {
+      sprintf(outBuffer + strlen(outBuffer), "%c", grid[(size_t)r * g_map.cols + c]);
+    }
+    strcat(outBuffer, "\n");
+  }
+  strcat(outBuffer, "\nACTIVE PLAYER INFO (IF EXISTS)\n");
+  for (int i = 0; i < g_roomCapacity; i++)
+  {
+    if (room->state.players[i].active == 1)
+    {
+      Player active_player = room->state.players[i];
+      sprintf(outBuffer + strlen(outBuffer), "Player %d\n", i);
+      sprintf(outBuffer + strlen(outBuffer), "Player position: (%d, %d)\n", active_player.x, active_player.y);
+      sprintf(outBuffer + strlen(outBuffer), "Player health points %d\n", active_player.hp);
+    }
+  }
+}
+
+double elapsedNs(const struct timespec *start, const struct timespec *end)
+{
+  return (end->tv_sec - start->tv_sec) * 1e9 + (end->tv_nsec - start->tv_nsec);
+}
+
+int runEncodeBenchmark()
+{
+  Room *room = allocRoom();
+  char *buffer = malloc(g_frameBound);
+  char *grid = malloc((size_t)g_map.rows * g_map.cols);
+  if (room == NULL || buffer == NULL || grid == NULL)
+  {
+    perror("benchmark setup failed");
+    return 1;
+  }
+
+  for (int i = 0; i < g_roomCapacity; i++)
+  {
+    room->state.players[i].x = g_map.spawnX[i];
+    room->state.players[i].y = g_map.spawnY[i];
+    room->state.players[i].active = 1;
+    touchPlayer(room, i);
+  }
+  refreshPlayerPositions(room);
+
+  // The old encoder read a char grid; give it one without timing that part
+  for (int r = 0; r < g_map.rows; r++)
+  {
+    for (int c = 0; c < g_map.cols; c++)
+    {
+      grid[(size_t)r * g_map.cols + c] = cellGlyph(room, r, c);
+    }
+  }
+
+  // Aim for roughly the same amount of grid work whatever the grid size
+  long cells = (long)g_map.rows * g_map.cols;
+  long iterations = 20000000 / cells;
+  if (iterations < 10)
+  {
+    iterations = 10;
+  }
+
+  // strcat/sprintf rescans the whole frame per cell, so past about a
+  // million cells the baseline would run for hours
+  int runLegacy = cells <= (1L << 20);
+
+  // The frame cache only needs a worker for its scratch buffer and metrics
+  Worker worker;
+  memset(&worker, 0, sizeof(worker));
+  worker.stateFrame = buffer;
+  room->worker = &worker;
+
+  struct timespec t0, t1, t2, t3;
+  volatile size_t sink = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (long i = 0; runLegacy && i < iterations; i++)
+  {
+    legacyBuildStateString(room, grid, buffer);
+    sink += buffer[0];
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  for (long i = 0; i < iterations; i++)
+  {
+    sink += buildStateString(room, buffer, g_frameBound);
+  }
+  cachedFrame(room, &room->stateFrame, buildStateString); // the one build
+  clock_gettime(CLOCK_MONOTONIC, &t2);
+  for (long i = 0; i < iterations; i++)
+  {
+    sink += cachedFrame(room, &room->stateFrame, buildStateString)->len;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t3);
+
+  double legacyNs = elapsedNs(&t0, &t1) / iterations;
+  double encoderNs = elapsedNs(&t1, &t2) / iterations;
+  double cachedNs = elapsedNs(&t2, &t3) / iterations;
+  printf("Grid %dx%d, frame %zu bytes, %ld iterations\n", g_map.rows, g_map.cols, strlen(buffer), iterations);
+  if (runLegacy)
+  {
+    printf("  strcat/sprintf: %12.1f ns/frame\n", legacyNs);
+    printf("  encoder:        %12.1f ns/frame (%.1fx faster)\n", encoderNs, legacyNs / encoderNs);
+  }
+  else
+  {
+    printf("  strcat/sprintf: skipped (too slow at this size)\n");
+    printf("  encoder:        %12.1f ns/frame\n", encoderNs);
+  }
+  printf("  cached:         %12.1f ns/frame (state unchanged since the last build)\n", cachedNs);
+
+  free(grid);
+  free(buffer);
+  freeRoom(room);
+  return 0;
+}
+
+/*---------------------------------------------------------------------------*
+ * Command decoding (also part of ./server -B). Decodes the eight MOVE and
+ * ATTACK commands over and over, as text with parseAction and as binary
+ * opcodes through g_binaryActions.
+ *---------------------------------------------------------------------------*/
+int runProtocolBenchmark()
+{
+  static const char *const texts[8] = {"MOVE UP", "MOVE DOWN", "MOVE LEFT", "MOVE RIGHT",
+                                       "ATTACK UP", "ATTACK DOWN", "ATTACK LEFT", "ATTACK RIGHT"};
+  unsigned char bytes[8];
+  for (int i = 0; i < 8; i++)
+  {
+    bytes[i] = ((i < 4 ? OP_MOVE : OP_ATTACK) << 2) | (i & 3);
+  }
+
+  long iterations = 20000000;
+  struct timespec t0, t1, t2;
+  volatile int sink = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  for (long i = 0; i < iterations; i++)
+  {
+    Action action = parseAction(texts[i & 7]);
+    sink += action.verb + action.dx + action.dy;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  for (long i = 0; i < iterations; i++)
+  {
+    Action action = g_binaryActions[bytes[i & 7]];
+    sink += action.verb + action.dx + action.dy;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t2);
+
+  double textNs = elapsedNs(&t0, &t1) / iterations;
+  double binaryNs = elapsedNs(&t1, &t2) / iterations;
+  printf("Command decoding, %ld commands\n", iterations);
+  printf("  text:           %12.1f ns/command (strncmp/strstr)\n", textNs);
+  printf("  binary:         %12.1f ns/command (%.1fx faster)\n", binaryNs, textNs / binaryNs);
+  return 0;
+}
 
-      g_gameState.grid[nx][ny] = '*';
-    }
+/*---------------------------------------------------------------------------*
+ * Metrics overhead (also part of ./server -B). Times the server's hot path for
+ * a command: recv, handleCommand, broadcast and send. It runs over socketpairs
+ * with a few players, which is the same work a worker does for a loopback
+ * client, except for epoll_wait. Separately, it times the metrics work that
+ * one command triggers, done on its own, and reports it as a share of the
+ * hot path.
+ *---------------------------------------------------------------------------*/
+int runMetricsBenchmark()
+{
+  int players = g_roomCapacity < MAX_CLIENTS ? g_roomCapacity : MAX_CLIENTS;
+  Worker worker;
+  memset(&worker, 0, sizeof(worker));
+  worker.stateFrame = malloc(g_frameBound);
+  worker.deltaFrame = malloc(g_frameBound);
+  Room *room = allocRoom();
+  if (worker.stateFrame == NULL || worker.deltaFrame == NULL || room == NULL)
+  {
+    perror("benchmark setup failed");
+    return 1;
   }
+  room->worker = &worker;
 
-  // Process the player's command
-  if (strncmp(cmd, "MOVE", 4) == 0)
+  int peers[MAX_CLIENTS];
+  Connection *conns[MAX_CLIENTS];
+  for (int i = 0; i < players; i++)
   {
-    if (strstr(cmd, "UP"))
+    int pair[2], bufferSize = 4 << 20;
+    conns[i] = calloc(1, sizeof(Connection));
+    if (conns[i] == NULL || socketpair(AF_UNIX, SOCK_STREAM, 0, pair) < 0 ||
+        setNonBlocking(pair[0]) < 0 || setNonBlocking(pair[1]) < 0)
     {
-      int nx = g_gameState.players[playerIndex].x > 0 ? g_gameState.players[playerIndex].x - 1 : g_gameState.players[playerIndex].x;
-      int ny = g_gameState.players[playerIndex].y;
-      if (nx >= 0 && g_gameState.grid[nx][ny] != '#')
-      {
-        g_gameState.players[playerIndex].x = nx;
-      }
+      perror("benchmark setup failed");
+      return 1;
     }
-    else if (strstr(cmd, "DOWN"))
+    setsockopt(pair[0], SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize));
+    conns[i]->fd = pair[0];
+    conns[i]->room = room;
+    conns[i]->playerIndex = i;
+    peers[i] = pair[1];
+    seatPlayer(room, i, pair[0], conns[i]);
+  }
+  flushDirtyConnections(&worker);
+
+  char sink[1 << 16];
+  long rounds = 25000;
+  double hotNs = 0;
+  for (long r = 0; r < rounds; r++)
+  {
+    // Every player gets one command in; the turn order then takes them in turn
+    const char *cmd = r % 2 ? "MOVE UP\n" : "MOVE DOWN\n";
+    for (int i = 0; i < players; i++)
     {
-      int nx = g_gameState.players[playerIndex].x < GRID_ROWS - 1 ? g_gameState.players[playerIndex].x + 1 : g_gameState.players[playerIndex].x;
-      int ny = g_gameState.players[playerIndex].y;
-      if (nx >= 0 && g_gameState.grid[nx][ny] != '#')
-      {
-        g_gameState.players[playerIndex].x = nx;
-      }
+      write(peers[i], cmd, strlen(cmd));
     }
-    else if (strstr(cmd, "LEFT"))
+
+    long long start = nowNs();
+    for (int n = 0; n < players; n++)
     {
-      int nx = g_gameState.players[playerIndex].x;
-      int ny = g_gameState.players[playerIndex].y < GRID_COLS ? g_gameState.players[playerIndex].y - 1 : g_gameState.players[playerIndex].y;
-      if (ny >= 0 && g_gameState.grid[nx][ny] != '#')
-      {
-        g_gameState.players[playerIndex].y = ny;
-      }
+      handleReadable(conns[room->state.currentTurn]);
+      flushDirtyConnections(&worker);
     }
-    else if (strstr(cmd, "RIGHT"))
+    hotNs += nowNs() - start;
+
+    for (int i = 0; i < players; i++)
     {
-      int nx = g_gameState.players[playerIndex].x;
-      int ny = g_gameState.players[playerIndex].y < GRID_COLS - 1 ? g_gameState.players[playerIndex].y + 1 : g_gameState.players[playerIndex].y;
-      if (ny >= 0 && g_gameState.grid[nx][ny] != '#')
+      while (read(peers[i], sink, sizeof(sink)) > 0)
       {
-        g_gameState.players[playerIndex].y = ny;
+        // What the clients would read
       }
     }
   }
-  else if (strncmp(cmd, "ATTACK", 6) == 0)
-  {
-    if (g_gameState.players[playerIndex].shuriken.active)
-    {
-      pthread_mutex_unlock(&g_stateMutex);
-      return;
-    }
+  long commands = rounds * players;
+  hotNs /= commands;
 
-    int px = g_gameState.players[playerIndex].x;
-    int py = g_gameState.players[playerIndex].y;
-    int dx = 0, dy = 0;
-
-    if (strstr(cmd, "UP"))
-    {
-      dx = -1;
-    }
-    else if (strstr(cmd, "DOWN"))
-    {
-      dx = 1;
-    }
-    else if (strstr(cmd, "LEFT"))
+  // The same recording one command does above: the sampled command and turn
+  // timers, the broadcast histogram, two recvs (the command and EAGAIN) and a
+  // send per player
+  Metrics *metrics = calloc(1, sizeof(Metrics));
+  if (metrics == NULL)
+  {
+    perror("benchmark setup failed");
+    return 1;
+  }
+  long iterations = 10000000;
+  unsigned int tick = 0;
+  long long start = nowNs();
+  for (long i = 0; i < iterations; i++)
+  {
+    statAdd(&metrics->counters[STAT_RECV_CALLS], 2);
+    statAdd(&metrics->counters[STAT_COMMANDS], 1);
+    if (++tick % COMMAND_SAMPLE_RATE == 0)
     {
-      dy = -1;
+      long long commandStart = nowNs();
+      histRecord(&metrics->histograms[HIST_COMMAND_NS], nowNs() - commandStart);
     }
-    else if (strstr(cmd, "RIGHT"))
+    if (i % COMMAND_SAMPLE_RATE == 3)
     {
-      dy = 1;
+      long long turnStart = nowNs();
+      histRecord(&metrics->histograms[HIST_TURN_NS], nowNs() - turnStart);
     }
-
-    int tx = px + dx;
-    int ty = py + dy;
-    if (tx >= 0 && tx < GRID_ROWS && ty >= 0 && ty < GRID_COLS && g_gameState.grid[tx][ty] != '#')
+    statAdd(&metrics->counters[STAT_BROADCASTS], 1);
+    statAdd(&metrics->counters[STAT_BROADCAST_BYTES], 1000);
+    histRecord(&metrics->histograms[HIST_BROADCAST_BYTES], 1000 + (i & 255));
+    for (int p = 0; p < players; p++)
     {
-      g_gameState.players[playerIndex].shuriken.x = tx;
-      g_gameState.players[playerIndex].shuriken.y = ty;
-      g_gameState.players[playerIndex].shuriken.dx = dx;
-      g_gameState.players[playerIndex].shuriken.dy = dy;
-      g_gameState.players[playerIndex].shuriken.active = 1;
-      g_gameState.players[playerIndex].shuriken.justSpawned = 1;
-      g_gameState.grid[tx][ty] = '*';
-
-      checkShurikenCollision(playerIndex, tx, ty);
+      statAdd(&metrics->counters[STAT_SEND_CALLS], 1);
+      statAdd(&metrics->counters[STAT_BYTES_SENT], 250);
     }
   }
-  else if (strncmp(cmd, "QUIT", 4) == 0)
-  {
-    // Notify the player they are quitting
-    const char *quitMessage = "\nhYou have quit the game.\n";
-    sendMessageToPlayer(playerIndex, quitMessage);
+  double collectNs = (double)(nowNs() - start) / iterations;
 
-    // Notify other players that this player has quit
-    char otherMessage[BUFFER_SIZE];
-    snprintf(otherMessage, BUFFER_SIZE, "\nPlayer %c has quit the game.\n", 'A' + playerIndex);
-    for (int i = 0; i < MAX_CLIENTS; i++)
-    {
-      if (i != playerIndex && g_clientSockets[i] != -1)
-      {
-        sendMessageToPlayer(i, otherMessage);
-      }
-    }
+  printf("Metrics overhead, %d players, %ld commands over socketpairs\n", players, commands);
+  printf("  hot path:   %10.1f ns/command (recv, handleCommand, broadcast, send)\n", hotNs);
+  printf("  collection: %10.1f ns/command (%.2f%% of the hot path)\n", collectNs, 100 * collectNs / hotNs);
 
-    // Reset the player's state
-    resetPlayerState(playerIndex);
+  for (int i = 0; i < players; i++)
+  {
+    close(peers[i]);
+    closeClientSocket(room, i);
+  }
+  freeClosedConnections(&worker);
+  free(metrics);
+  freeRoom(room);
+  free(worker.stateFrame);
+  free(worker.deltaFrame);
+  return 0;
+}
 
-    // Close their socket
-    if (g_clientSockets[playerIndex] != -1)
-    {
-      close(g_clientSockets[playerIndex]);
-      g_clientSockets[playerIndex] = -1;
-      g_gameState.clientCount--;
-    }
+/*---------------------------------------------------------------------------*
+ * Bot search (also part of ./server -B). Seats a bot in every slot of one
+ * room and plays a match out with each decision given the share of
+ * BOT_ROUND_BUDGET_NS it would get on a live server, then reports how many
+ * positions a second the search gets through and how deep that lets it look.
+ *---------------------------------------------------------------------------*/
+int runBotBenchmark()
+{
+  int players = g_roomCapacity < MAX_CLIENTS ? g_roomCapacity : MAX_CLIENTS;
+  if (players < 2 || buildRayTables() < 0)
+  {
+    return players < 2 ? 0 : 1;
+  }
+  Worker worker;
+  memset(&worker, 0, sizeof(worker));
+  worker.stateFrame = malloc(g_frameBound);
+  worker.deltaFrame = malloc(g_frameBound);
+  Room *room = allocRoom();
+  if (worker.stateFrame == NULL || worker.deltaFrame == NULL || room == NULL)
+  {
+    perror("benchmark setup failed");
+    return 1;
+  }
+  room->worker = &worker;
+  for (int i = 0; i < players; i++)
+  {
+    room->clientSockets[i] = BOT_SOCKET;
+    room->botCount++;
+    seatPlayer(room, i, BOT_SOCKET, NULL);
+  }
 
-    // Refresh positions and broadcast the updated state
-    refreshPlayerPositions();
-    broadcastState();
+  // The match's game log would be mixed into the report, so it goes to
+  // /dev/null until the match is over
+  fflush(stdout);
+  int savedStdout = dup(STDOUT_FILENO);
+  int devNull = open("/dev/null", O_WRONLY);
+  if (savedStdout >= 0 && devNull >= 0)
+  {
+    dup2(devNull, STDOUT_FILENO);
+  }
+  if (devNull >= 0)
+  {
+    close(devNull);
+  }
 
-    // Rotate turn if the quitting player was the current turn
-    if (playerIndex == g_gameState.currentTurn)
-    {
-      rotateTurn();
-    }
+  long decisions = 0, depthSum = 0, deepest = 0;
+  long long searchNs = 0;
+  while (decisions < 400 && room->state.clientCount >= 2)
+  {
+    int slot = room->state.currentTurn, depth;
+    long long start = nowNs();
+    int move = botChooseMove(&worker, room, slot, BOT_ROUND_BUDGET_NS / room->botCount, &depth);
+    searchNs += nowNs() - start;
+    decisions++;
+    depthSum += depth;
+    deepest = depth > deepest ? depth : deepest;
 
-    pthread_mutex_unlock(&g_stateMutex);
-    return;
+    char cmd[16];
+    snprintf(cmd, sizeof(cmd), "%s %s", move < 4 ? "MOVE" : "ATTACK", g_dirNames[move & 3]);
+    handleAction(room, slot, parseAction(cmd), cmd);
+  }
+  for (int i = 0; i < players; i++)
+  {
+    closeClientSocket(room, i);
   }
 
-  // Refresh positions and broadcast
-  refreshPlayerPositions();
-  broadcastState();
+  fflush(stdout);
+  if (savedStdout >= 0)
+  {
+    dup2(savedStdout, STDOUT_FILENO);
+    close(savedStdout);
+  }
 
-  // Rotate the turn to the next player
-  rotateTurn();
+  unsigned long nodes = atomic_load(&worker.metrics.counters[STAT_BOT_NODES]);
+  printf("Bot search, %d bots, %ld decisions, %d ms budget per round\n", players, decisions, BOT_ROUND_BUDGET_NS / 1000000);
+  printf("  search:   %12.0f positions/sec\n", nodes / (searchNs / 1e9));
+  printf("  decision: %12.3f ms average, depth %.1f average, %ld deepest\n",
+         searchNs / 1e6 / decisions, (double)depthSum / decisions, deepest);
 
-  pthread_mutex_unlock(&g_stateMutex);
+  free(worker.botTable);
+  freeRoom(room);
+  free(worker.stateFrame);
+  free(worker.deltaFrame);
+  return 0;
 }
 
 /*---------------------------------------------------------------------------*
- * Thread function: handle communication with one client
+ * Journal replay (./server -R FILE). Feeds a recorded match back through
+ * seatPlayer, handleCommand (or queueAction and runRoomTick for a real-time
+ * match) and handleDisconnect on a room with no
+ * connections, so the game log it prints matches what the server printed
+ * for that room. Give the same -m the match was played with.
  *---------------------------------------------------------------------------*/
-void *clientHandler(void *arg)
+int replayJournal(const char *path, const char *mapSpec)
 {
-  int playerIndex = *(int *)arg;
-  free(arg);
-
-  int clientSocket = g_clientSockets[playerIndex];
-
-  pthread_mutex_lock(&g_stateMutex);
-  g_gameState.players[playerIndex].x = playerIndex;
-  g_gameState.players[playerIndex].y = 0;
-  g_gameState.players[playerIndex].active = 1;
-
-  if (!g_gameState.gameStarted)
+  int fd = open(path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) < 0)
   {
-    g_gameState.gameStarted = 1;
-    const char *yourTurnMsg = "\nIt's your turn, Player A\n";
-    sendMessageToPlayer(playerIndex, yourTurnMsg);
+    perror(path);
+    return 1;
+  }
+  if ((size_t)st.st_size < sizeof(JournalHeader))
+  {
+    fprintf(stderr, "%s: not a match journal\n", path);
+    return 1;
+  }
+  const char *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (data == MAP_FAILED)
+  {
+    perror("mmap failed");
+    return 1;
   }
+  madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
 
-  refreshPlayerPositions();
-  broadcastState();
-  pthread_mutex_unlock(&g_stateMutex);
+  JournalHeader header;
+  memcpy(&header, data, sizeof(header));
+  if (memcmp(header.magic, "BGJ2", 4) != 0 || header.roomCapacity < 1 ||
+      header.roomCapacity > MAX_ROOM_PLAYERS || header.maxShurikens < 1 ||
+      header.maxShurikens > MAX_SHURIKENS_PER_PLAYER)
+  {
+    fprintf(stderr, "%s: not a match journal\n", path);
+    return 1;
+  }
+  g_roomCapacity = header.roomCapacity;
+  g_maxShurikens = header.maxShurikens;
+  g_tickRate = header.tickRate;
+  if (loadMap(mapSpec) != 0)
+  {
+    return 1;
+  }
+  if ((uint32_t)g_map.rows != header.rows || (uint32_t)g_map.cols != header.cols || mapHash() != header.mapHash)
+  {
+    fprintf(stderr, "%s: recorded on a different %ux%u map; pass it with -m\n", path, header.rows, header.cols);
+    return 1;
+  }
 
-  char buffer[BUFFER_SIZE];
+  Worker worker;
+  memset(&worker, 0, sizeof(worker));
+  worker.stateFrame = malloc(g_frameBound);
+  worker.deltaFrame = malloc(g_frameBound);
+  Room *room = allocRoom();
+  if (worker.stateFrame == NULL || worker.deltaFrame == NULL || room == NULL)
+  {
+    perror("replay setup failed");
+    return 1;
+  }
+  room->id = header.roomId;
+  room->worker = &worker;
 
-  while (1)
+  char cmd[UINT8_MAX + 1];
+  long records = 0, commands = 0;
+  size_t pos = sizeof(header);
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  while (pos + sizeof(JournalRecord) <= (size_t)st.st_size)
   {
-    memset(buffer, 0, sizeof(buffer));
-    int bytesReceived = recv(clientSocket, buffer, BUFFER_SIZE, 0);
-    if (bytesReceived <= 0) // Client disconnected
+    JournalRecord record;
+    memcpy(&record, data + pos, sizeof(record));
+    pos += sizeof(record);
+    if (pos + record.length > (size_t)st.st_size || record.player >= g_roomCapacity)
+    {
+      fprintf(stderr, "%s: corrupt record %ld\n", path, records);
+      break;
+    }
+    memcpy(cmd, data + pos, record.length);
+    cmd[record.length] = '\0';
+    pos += record.length;
+    records++;
+
+    if (record.turn != room->turnNumber)
     {
-      pthread_mutex_lock(&g_stateMutex);
+      fprintf(stderr, "%s: record %ld expected turn %u but the replay is at %u\n", path, records, record.turn, room->turnNumber);
+    }
 
-      // Notify other players that this player has disconnected
-      char disconnectMessage[BUFFER_SIZE];
-      snprintf(disconnectMessage, BUFFER_SIZE, "\nPlayer %c has disconnected.\n", 'A' + playerIndex);
-      for (int i = 0; i < MAX_CLIENTS; i++)
+    switch (record.kind)
+    {
+    case 'J':
+      if (room->clientSockets[record.player] == -1)
+      {
+        printf("Room %d: Player %s joined on replay. Players in room: %d/%d\n", room->id, playerName(record.player).text, room->state.clientCount + 1, g_roomCapacity);
+        seatPlayer(room, record.player, REPLAY_SOCKET, NULL);
+      }
+      break;
+    case 'C':
+      if (room->clientSockets[record.player] != -1)
       {
-        if (i != playerIndex && g_clientSockets[i] != -1)
+        if (g_tickRate > 0)
         {
-          sendMessageToPlayer(i, disconnectMessage);
+          queueAction(room, record.player, parseAction(cmd));
         }
+        else
+        {
+          handleCommand(room, record.player, cmd);
+        }
+        commands++;
       }
-
-      // Reset the player's state
-      resetPlayerState(playerIndex);
-
-      // Close the socket
-      close(clientSocket);
-      g_clientSockets[playerIndex] = -1;
-      g_gameState.clientCount--;
-
-      // Refresh and broadcast the updated state
-      refreshPlayerPositions();
-      broadcastState();
-
-      // Rotate turn if the disconnected player was the current turn
-      if (playerIndex == g_gameState.currentTurn)
+      break;
+    case 'T':
+      runRoomTick(room);
+      break;
+    case 'L':
+      if (room->clientSockets[record.player] != -1)
       {
-        rotateTurn();
+        handleDisconnect(room, record.player);
       }
-
-      pthread_mutex_unlock(&g_stateMutex);
       break;
-    }
-
-    // Strip trailing newline (if any)
-    size_t len = strlen(buffer);
-    if (len > 0 && buffer[len - 1] == '\n')
-    {
-      buffer[len - 1] = '\0';
-    }
-
-    // Handle the command
-    handleCommand(playerIndex, buffer);
-
-    // Check if the player quit via command
-    pthread_mutex_lock(&g_stateMutex);
-    if (g_gameState.players[playerIndex].active == 0)
-    {
-      pthread_mutex_unlock(&g_stateMutex);
+    default:
+      fprintf(stderr, "%s: unknown record kind '%c'\n", path, record.kind);
       break;
     }
-    pthread_mutex_unlock(&g_stateMutex);
   }
+  clock_gettime(CLOCK_MONOTONIC, &t1);
 
-  return NULL;
+  int alive = 0;
+  for (int i = 0; i < g_roomCapacity; i++)
+  {
+    alive += room->clientSockets[i] != -1;
+  }
+  double seconds = elapsedNs(&t0, &t1) / 1e9;
+  fflush(stdout);
+  fprintf(stderr, "Replayed %ld records (%ld commands) of room %d in %.3f ms, %.0f commands/sec; %d players left\n",
+          records, commands, room->id, seconds * 1e3, seconds > 0 ? commands / seconds : 0.0, alive);
+
+  munmap((void *)data, st.st_size);
+  freeRoom(room);
+  free(worker.stateFrame);
+  free(worker.deltaFrame);
+  return 0;
+}
+
+void usage(const char *prog)
+{
+  fprintf(stderr, "Usage: %s <PORT> [-w WORKERS] [-r MAX_ROOMS] [-l MAX_LAG_MS] [-m MAPFILE|ROWSxCOLS] [-p PLAYERS] [-s SHURIKENS] [-j JOURNAL_DIR] [-S SNAPSHOT_FILE] [-M STATS_SOCKET] [-t TICK_RATE] [-v SPECTATOR_PORT] [-U] [-a BOT_DELAY_SEC]\n", prog);
+  fprintf(stderr, "       %s [-m MAPFILE|ROWSxCOLS] [-p PLAYERS] -B   (benchmark the state encoder, metrics and bots)\n", prog);
+  fprintf(stderr, "       %s [-m MAPFILE|ROWSxCOLS] -R JOURNAL    (replay a recorded match)\n", prog);
+  exit(EXIT_FAILURE);
 }
 
 /*---------------------------------------------------------------------------*
- * main: set up server socket, accept clients, spawn threads
+ * main: set up server socket, start the workers, then accept clients
  *---------------------------------------------------------------------------*/
 int main(int argc, char *argv[])
 {
-  if (argc != 2)
+  long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+  g_workerCount = cpuCount > 0 ? (int)cpuCount : 1;
+  g_startNs = nowNs();
+  initBinaryProtocol();
+
+  int opt, benchmark = 0;
+  const char *mapSpec = NULL, *replayPath = NULL, *statsPath = NULL, *spectatorPort = NULL;
+  while ((opt = getopt(argc, argv, "w:r:l:m:p:s:j:S:M:t:v:R:a:BU")) != -1)
+  {
+    switch (opt)
+    {
+    case 't':
+      g_tickRate = atoi(optarg);
+      if (g_tickRate < 1 || g_tickRate > MAX_TICK_RATE)
+      {
+        fprintf(stderr, "Tick rate must be between 1 and %d per second\n", MAX_TICK_RATE);
+        return 1;
+      }
+      break;
+    case 'S':
+      g_snapshotPath = optarg;
+      break;
+    case 'v':
+      spectatorPort = optarg;
+      break;
+    case 'M':
+      statsPath = optarg;
+      break;
+    case 'j':
+      g_journalDir = optarg;
+      break;
+    case 'R':
+      replayPath = optarg;
+      break;
+    case 'B':
+      benchmark = 1;
+      break;
+    case 'U':
+      g_useRing = 1;
+      break;
+    case 'a':
+      g_botDelaySec = atoi(optarg);
+      if (g_botDelaySec < 0)
+      {
+        fprintf(stderr, "Bot delay must be 0 seconds or more\n");
+        return 1;
+      }
+      break;
+    case 'm':
+      mapSpec = optarg;
+      break;
+    case 'p':
+      g_roomCapacity = atoi(optarg);
+      if (g_roomCapacity < 1 || g_roomCapacity > MAX_ROOM_PLAYERS)
+      {
+        fprintf(stderr, "Players per room must be between 1 and %d\n", MAX_ROOM_PLAYERS);
+        return 1;
+      }
+      break;
+    case 's':
+      g_maxShurikens = atoi(optarg);
+      if (g_maxShurikens < 1 || g_maxShurikens > MAX_SHURIKENS_PER_PLAYER)
+      {
+        fprintf(stderr, "Shurikens per player must be between 1 and %d\n", MAX_SHURIKENS_PER_PLAYER);
+        return 1;
+      }
+      break;
+    case 'w':
+      g_workerCount = atoi(optarg);
+      break;
+    case 'r':
+      g_maxRooms = atoi(optarg);
+      break;
+    case 'l':
+      g_maxLagMs = atoi(optarg);
+      break;
+    default:
+      usage(argv[0]);
+    }
+  }
+  if (replayPath != NULL)
   {
-    fprintf(stderr, "Usage: %s <PORT>\n", argv[0]);
-    exit(EXIT_FAILURE);
+    return replayJournal(replayPath, mapSpec);
   }
-  int port = atoi(argv[1]); // No need in getaddrinfo because expects a char
-  g_gameState.clientCount = 0;
-
-  // 1. Initialize game state
-  initGameState();
-  initSockets();
+  if (loadMap(mapSpec) != 0)
+  {
+    return 1;
+  }
+  if (benchmark)
+  {
+    return runEncodeBenchmark() || runProtocolBenchmark() || runMetricsBenchmark() || runBotBenchmark();
+  }
+  if (optind != argc - 1 || g_workerCount < 1 || g_maxRooms < 1)
+  {
+    usage(argv[0]);
+  }
+  if (g_botDelaySec >= 0 && g_tickRate > 0)
+  {
+    fprintf(stderr, "Bots only play turn-based matches; -a cannot be used with -t\n");
+    return 1;
+  }
+  if (g_botDelaySec >= 0 && buildRayTables() < 0)
+  {
+    return 1;
+  }
+  const char *portArg = argv[optind];
+  int port = atoi(portArg); // No need in getaddrinfo because expects a char
 
-  // Setting up addrInfo
+  raiseFileLimit();
 
-  struct addrinfo *p, *listp, hints; // Exists in netdb.h which I had imported on top of the boilerplate
-  memset(&hints, 0, sizeof(struct addrinfo));
-  hints.ai_family = AF_INET;                   // IPv4
-  hints.ai_socktype = SOCK_STREAM;             // TCP Connections
-  hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG; // Since host is NULL and we need a wildcard address or on any IP address
-  hints.ai_flags |= AI_NUMERICSERV;            // Using port number
+  // A client vanishing mid-send must not kill every match on the server
+  signal(SIGPIPE, SIG_IGN);
+  setvbuf(stdout, NULL, _IOLBF, 0);
 
-  int rc, optval = 1;
+  if (g_journalDir != NULL)
+  {
+    pthread_t journalThread;
+    if (pthread_create(&journalThread, NULL, journalMain, NULL) != 0)
+    {
+      perror("failed to start journal thread");
+      return 1;
+    }
+    pthread_detach(journalThread);
+  }
 
-  if ((rc = getaddrinfo(NULL, argv[1], &hints, &listp)) != 0)
+  // 1. Start the workers; each one creates its rooms (and their game state) on demand
+  g_workers = calloc(g_workerCount, sizeof(Worker));
+  if (g_workers == NULL)
   {
-    fprintf(stderr, "getaddrinfo error: %s\n", gai_strerror(rc));
+    perror("calloc failed");
     return 1;
   }
-
-  int serverSock; // Global server socket
-
-  for (p = listp; p != NULL; p = p->ai_next)
+  if (g_snapshotPath != NULL)
   {
-    // 2. Create server socket
-    serverSock = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
-    if (serverSock < 0)
+    // Rooms from the last snapshot are handed to the workers before they start
+    pthread_t snapshotThread;
+    g_snapshotParts = calloc(g_workerCount, sizeof(SnapshotPart));
+    if (g_snapshotParts == NULL || restoreSnapshot(g_snapshotPath) != 0 ||
+        pthread_create(&snapshotThread, NULL, snapshotMain, NULL) != 0)
     {
-      perror("socket creation failed");
-      continue;
+      return 1;
     }
-
-    // Eliminates "Address already in use" error from bind
-    setsockopt(serverSock, SOL_SOCKET, SO_REUSEADDR,
-               (const void *)&optval, sizeof(int));
-
-    // 3. Bind, listen
-    if (bind(serverSock, p->ai_addr, p->ai_addrlen) < 0)
+    pthread_detach(snapshotThread);
+  }
+  if (g_useRing && ringProbe() < 0)
+  {
+    fprintf(stderr, "io_uring multishot receive not available, using epoll\n");
+    g_useRing = 0;
+  }
+  // Each worker accepts players on its own listener, so it needs the admission
+  // queue's wakeup from the start
+  g_admitFd = eventfd(0, EFD_NONBLOCK);
+  if (g_admitFd < 0)
+  {
+    perror("eventfd failed");
+    return 1;
+  }
+  for (int i = 0; i < g_workerCount; i++)
+  {
+    if ((g_workers[i].listenFd = openListener(portArg, LISTENQ, 1)) < 0)
     {
-      perror("bind failed");
-      close(serverSock);
-      continue;
+      return 1;
+    }
+    if (startWorker(&g_workers[i], i) != 0)
+    {
+      perror("failed to start worker");
+      return 1;
     }
-
-    break;
   }
 
-  if (p == NULL)
+  int spectatorSock = -1;
+  if (spectatorPort != NULL && (spectatorSock = openListener(spectatorPort, SOMAXCONN, 0)) < 0)
   {
-    fprintf(stderr, "Failed to bind to any address\n");
-    freeaddrinfo(listp);
     return 1;
   }
 
-  // Free result anyways
-  freeaddrinfo(listp);
-
-  // listen(...)
-  if (listen(serverSock, LISTENQ) < 0)
+  // 4. The main thread runs the admission queue, accepts spectators, reports
+  // throughput and answers the stats socket. The report timer is tagged with
+  // data.u32 = 1, the stats socket with 2, the spectator port with 3 and the
+  // admission queue's wakeup with 4.
+  int epollFd = epoll_create1(0);
+  int timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+  if (epollFd < 0 || timerFd < 0)
   {
-    perror("listen failed");
-    close(serverSock);
+    perror("epoll setup failed");
     return 1;
   }
 
-  printf("Server listening on port %d...\n", port);
+  struct itimerspec interval = {{REPORT_INTERVAL_SEC, 0}, {REPORT_INTERVAL_SEC, 0}};
+  timerfd_settime(timerFd, 0, &interval, NULL);
 
-  // 4. Accept loop
-  while (1)
-  {
-    struct sockaddr_storage clientAddr;
-    socklen_t clientlen = sizeof(clientAddr);
-    char client_hostname[MAXLINE], client_port[MAXLINE];
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.u32 = 1;
+  epoll_ctl(epollFd, EPOLL_CTL_ADD, timerFd, &ev);
+  ev.data.u32 = 4;
+  epoll_ctl(epollFd, EPOLL_CTL_ADD, g_admitFd, &ev);
 
-    int newSock = accept(serverSock, (struct sockaddr *)&clientAddr, &clientlen);
-    if (newSock < 0)
+  int statsSock = -1;
+  if (statsPath != NULL)
+  {
+    if ((statsSock = openStatsSocket(statsPath)) < 0)
     {
-      perror("accept failed");
-      continue;
+      return 1;
     }
+    ev.data.u32 = 2;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, statsSock, &ev);
+  }
+  if (spectatorSock >= 0)
+  {
+    ev.data.u32 = 3;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, spectatorSock, &ev);
+    printf("Spectators can watch on port %s\n", spectatorPort);
+  }
 
-    // Reject new clients if it exceeds the max capacity at a time
-    if (g_gameState.clientCount >= MAX_CLIENTS)
-    {
-      // Server is full, reject the client
-      printf("Server full! Rejecting new client.\n");
-      const char *msg = "Server full. Please try again later.\n";
-      send(newSock, msg, strlen(msg), 0);
-      close(newSock);
-      continue;
-    }
+  printf("Server listening on port %d with %d workers, up to %d rooms...\n", port, g_workerCount, g_maxRooms);
 
-    getnameinfo((struct sockaddr *)&clientAddr, clientlen, client_hostname, MAXLINE, client_port, MAXLINE, 0); // Get hostname from address
+  unsigned long *lastCompleted = calloc(g_workerCount, sizeof(unsigned long));
 
-    // If we have capacity, find a free index in g_clientSockets
-    int freeIndex;
-    for (int i = 0; i < MAX_CLIENTS; i++)
+  // 5. Event loop
+  struct epoll_event events[MAX_EVENTS];
+  while (1)
+  {
+    int n = epoll_wait(epollFd, events, MAX_EVENTS, -1);
+    if (n < 0)
     {
-      if (g_clientSockets[i] == -1) // Change to ==
+      if (errno == EINTR)
       {
-        freeIndex = i;
-        break;
+        continue;
       }
+      perror("epoll_wait failed");
+      break;
     }
 
-    g_clientSockets[freeIndex] = newSock; // Adding the activeClient to the array
-    g_gameState.clientCount++;
-
-    printf("New client connected! Connected to (%s, %s). Active clients: %d/%d\n", client_hostname, client_port, g_gameState.clientCount, MAX_CLIENTS);
-
-    // create a thread:
-    pthread_t tid;
-    int *arg = malloc(sizeof(int));
-    *arg = freeIndex;
-    pthread_create(&tid, NULL, clientHandler, arg);
-    pthread_detach(tid);
+    for (int i = 0; i < n; i++)
+    {
+      if (events[i].data.u32 == 2)
+      {
+        serveStats(statsSock);
+      }
+      else if (events[i].data.u32 == 3)
+      {
+        acceptSpectators(spectatorSock);
+      }
+      else if (events[i].data.u32 == 4)
+      {
+        admitWaiting();
+      }
+      else
+      {
+        uint64_t expirations;
+        while (read(timerFd, &expirations, sizeof(expirations)) > 0)
+        {
+          // Drain the timer
+        }
+        reportMatchThroughput(lastCompleted, REPORT_INTERVAL_SEC);
+      }
+    }
   }
 
-  close(serverSock);
+  free(lastCompleted);
+  if (statsSock >= 0)
+  {
+    close(statsSock);
+    unlink(statsPath);
+  }
+  close(timerFd);
+  close(g_admitFd);
+  close(epollFd);
+  for (int i = 0; i < g_workerCount; i++)
+  {
+    close(g_workers[i].listenFd);
+  }
+  if (spectatorSock >= 0)
+  {
+    close(spectatorSock);
+  }
   return 0;
-}
\ No newline at end of file
+}